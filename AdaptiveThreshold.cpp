@@ -0,0 +1,135 @@
+#include "AdaptiveThreshold.h"
+
+#include <cmath>
+#include <algorithm>
+
+
+bool AdaptiveParams::parseMethod(const std::string& name, AdaptiveMethod& method) {
+	if (name == "niblack") method = AdaptiveMethod::NIBLACK;
+	else if (name == "sauvola") method = AdaptiveMethod::SAUVOLA;
+	else return false;
+	return true;
+}
+
+
+AdaptiveThreshold::AdaptiveThreshold(SliceSource& source, const AdaptiveParams& params) :
+	source(&source), params(params), width(source.getWidth()), height(source.getHeight()), depth(source.getDepth()),
+	ring(3 * source.getWidth() * source.getHeight(), source.getDepth(), params.volumetric ? params.radius + 1 : 0) {}
+
+void AdaptiveThreshold::sumWindows(const float* values, float* sliceSums, float* sliceSquares) {
+	const size_t r = params.radius;
+	const size_t stride = width + 1;
+
+	// Integral images, with a row and column of zeros in front: entry (x, y) sums the values above and left of voxel (x, y)
+	integral.assign(stride * (height + 1), 0.0);
+	integralSquares.assign(stride * (height + 1), 0.0);
+	for (size_t y = 0; y < height; ++y) {
+		double rowSum = 0.0, rowSquares = 0.0;
+		const double* above = &integral[y * stride];
+		const double* aboveSquares = &integralSquares[y * stride];
+		double* here = &integral[(y + 1) * stride];
+		double* hereSquares = &integralSquares[(y + 1) * stride];
+		for (size_t x = 0; x < width; ++x) {
+			const double v = values[y * width + x];
+			rowSum += v;
+			rowSquares += v * v;
+			here[x + 1] = above[x + 1] + rowSum;
+			hereSquares[x + 1] = aboveSquares[x + 1] + rowSquares;
+		}
+	}
+
+	// Window [x - r, x + r] x [y - r, y + r], cut short at the slice bounds
+	for (size_t y = 0; y < height; ++y) {
+		const size_t y0 = y > r ? y - r : 0, y1 = std::min(height, y + r + 1);
+		const double* top = &integral[y0 * stride];
+		const double* bottom = &integral[y1 * stride];
+		const double* topSquares = &integralSquares[y0 * stride];
+		const double* bottomSquares = &integralSquares[y1 * stride];
+		for (size_t x = 0; x < width; ++x) {
+			const size_t x0 = x > r ? x - r : 0, x1 = std::min(width, x + r + 1);
+			sliceSums[y * width + x] = (float)(bottom[x1] - bottom[x0] - top[x1] + top[x0]);
+			sliceSquares[y * width + x] = (float)(bottomSquares[x1] - bottomSquares[x0] - topSquares[x1] + topSquares[x0]);
+		}
+	}
+}
+
+bool AdaptiveThreshold::readMask(size_t z, BitSlice& out) {
+	const size_t size = width * height;
+	const size_t r = params.radius;
+	const bool loaded = ring.load(z, [&](size_t inputZ, float* dst) {
+		if (!source->readSlice(inputZ, dst)) {
+			return false;
+		}
+		sumWindows(dst, dst + size, dst + 2 * size);
+		return true;
+	});
+	if (!loaded) {
+		return false;
+	}
+	const float* values = ring.get(z, 0);
+
+	// Voxels per window: the in-slice window area, times the slices within the volume
+	counts.resize(size);
+	const size_t zBegin = params.volumetric ? (z > r ? z - r : 0) : z;
+	const size_t zEnd = params.volumetric ? std::min(depth, z + r + 1) : z + 1;
+	for (size_t y = 0; y < height; ++y) {
+		const size_t rows = std::min(height, y + r + 1) - (y > r ? y - r : 0);
+		for (size_t x = 0; x < width; ++x) {
+			const size_t columns = std::min(width, x + r + 1) - (x > r ? x - r : 0);
+			counts[y * width + x] = (float)(rows * columns * (zEnd - zBegin));
+		}
+	}
+
+	// Window sums: the slice's own, or running sums over the slices of the volumetric window
+	const float* windowSums = values + size;
+	const float* windowSquares = values + 2 * size;
+	if (params.volumetric) {
+		sums.resize(size);
+		sumSquares.resize(size);
+		auto add = [&](size_t sliceZ, double sign) {
+			const float* slice = ring.get(z, (long long)sliceZ - (long long)z);
+			for (size_t i = 0; i < size; ++i) {
+				sums[i] += sign * slice[size + i];
+				sumSquares[i] += sign * slice[2 * size + i];
+			}
+		};
+		if (summedZ >= 0 && (size_t)summedZ + 1 == z) {
+			if (z > r) add(z - r - 1, -1.0);
+			if (z + r < depth) add(z + r, 1.0);
+		} else {
+			std::fill(sums.begin(), sums.end(), 0.0);
+			std::fill(sumSquares.begin(), sumSquares.end(), 0.0);
+			for (size_t sliceZ = zBegin; sliceZ < zEnd; ++sliceZ) add(sliceZ, 1.0);
+		}
+		summedZ = (long long)z;
+	}
+
+	out.resize(width, height);
+	for (size_t y = 0; y < height; ++y) {
+		for (size_t x = 0; x < width; ++x) {
+			const size_t i = y * width + x;
+			const double sum = params.volumetric ? sums[i] : windowSums[i];
+			const double squares = params.volumetric ? sumSquares[i] : windowSquares[i];
+			const double mean = sum / counts[i];
+			const double stdDev = std::sqrt(std::max(0.0, squares / counts[i] - mean * mean));
+			double threshold;
+			if (stdDev < params.minStdDev) {
+				threshold = params.threshold;
+			} else if (params.method == AdaptiveMethod::NIBLACK) {
+				threshold = mean + params.k * stdDev;
+			} else {
+				threshold = mean * (1.0 + params.k * (stdDev / params.range - 1.0));
+			}
+			if (values[i] >= threshold) out.set(x, y);
+		}
+	}
+	return true;
+}
+
+MaskSource* AdaptiveThreshold::clone() const {
+	SliceSource* sourceClone = source->clone();
+	if (!sourceClone) return nullptr;
+	AdaptiveThreshold* mask = new AdaptiveThreshold(*sourceClone, params);
+	mask->ownedSource.reset(sourceClone);
+	return mask;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "BitSlice.h"
+#include "MaskSource.h"
+#include "SliceSource.h"
+#include "Filters.h"
+
+
+enum class AdaptiveMethod {
+	NIBLACK, SAUVOLA
+};
+
+
+/// Local threshold computed from the mean m and standard deviation s of the values in a window around each voxel
+struct AdaptiveParams {
+
+	/// Niblack: m + k s; Sauvola: m (1 + k (s / range - 1))
+	AdaptiveMethod method = AdaptiveMethod::SAUVOLA;
+	float k = 0.5f;
+
+	/// Dynamic range of the standard deviation, for Sauvola; 128 suits 8-bit images, float scans need about half the span of their values
+	float range = 128.0f;
+
+	/// The window spans radius voxels on each side within the slice, and also across slices when volumetric; it is cut short at the volume bounds
+	size_t radius = 7;
+	bool volumetric = false;
+
+	/// Windows with a standard deviation below minStdDev (flat air or bone, where a local threshold would only split noise) use the global threshold instead
+	float minStdDev = 0.0f;
+	float threshold = 0.0f;
+
+	/// Reads "niblack" or "sauvola"; returns false for anything else
+	static bool parseMethod(const std::string& name, AdaptiveMethod& method);
+};
+
+
+/// Occupancy of the voxels greater than or equal to their local threshold
+/// Window sums come from per-slice integral images, so each voxel costs the same whatever the radius; volumetric windows add up the slices' window sums
+/// over a ring of slices, as a running sum updated by one slice in and one out while z increases
+class AdaptiveThreshold : public MaskSource {
+
+	/// Values being thresholded; owned when this mask was cloned
+	SliceSource* source;
+	std::unique_ptr<SliceSource> ownedSource;
+
+	AdaptiveParams params;
+	size_t width, height, depth;
+
+	/// Each slice of the ring holds its values, then the sums and sums of squares over its in-slice windows
+	SliceRing ring;
+	std::vector<double> integral, integralSquares;
+	std::vector<float> input;
+
+	/// Sums over the slices of the volumetric window of summedZ, and the number of voxels per window
+	std::vector<double> sums, sumSquares;
+	std::vector<float> counts;
+	long long summedZ = -1;
+
+	/// Computes the in-slice window sums of values into sliceSums and sliceSquares
+	void sumWindows(const float* values, float* sliceSums, float* sliceSquares);
+
+public:
+	AdaptiveThreshold(SliceSource& source, const AdaptiveParams& params);
+
+	size_t getWidth() const override { return width; }
+	size_t getHeight() const override { return height; }
+	size_t getDepth() const override { return depth; }
+
+	bool readMask(size_t z, BitSlice& out) override;
+	MaskSource* clone() const override;
+};
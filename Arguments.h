@@ -10,6 +10,15 @@ class Arguments {
     bool help = false;
     std::unordered_map<std::string, std::string> args;
     
+    // when not exiting on errors (e.g. for the lines of a job manifest), errors are only printed and remembered, and reads return their default value
+    bool exitOnError = true;
+    mutable bool failed = false;
+    
+    void fail () const {
+        if (exitOnError) std::exit(1);
+        failed = true;
+    }
+    
     template<typename T>
     T fromString (const std::string& str) const {
         // error out upon no existing specialization - see below for implemented specializations
@@ -25,7 +34,7 @@ class Arguments {
     
 public:
     
-    Arguments(int argc, char** argv) {
+    Arguments(int argc, char** argv, bool exitOnError = true) : exitOnError(exitOnError) {
         std::string prevKey;
         bool hasPrevKey = false;
         for (int i = 1; i < argc; ++i) {
@@ -34,6 +43,11 @@ public:
                 
                 // passing 'help' as an argument turns on help mode, printing each key/type and exiting early
                 if (arg.compare("help") == 0 && !hasPrevKey) {
+                    if (!exitOnError) {
+                        std::printf(RED "Error reading arguments: help is only available on the command line\n" WHITE);
+                        fail();
+                        continue;
+                    }
                     help = true;
                     std::printf(BLUE "Usage:\n" WHITE);
                     continue;
@@ -51,7 +65,7 @@ public:
                     hasPrevKey = false;
                 } else {
                     std::printf(RED "Error reading arguments: value '%s' is not bound to a key (did you mean '-%s'?)\n" WHITE, arg.c_str(), arg.c_str());
-                    std::exit(1);
+                    fail();
                 }
                 
             }
@@ -59,15 +73,26 @@ public:
     }
     
     virtual ~Arguments () {
-        if (args.size() > 0) {
-            std::printf(YELLOW "Unused arguments, are you sure you meant to include these?\n%s" WHITE, toString().c_str());
-            std::exit(1);
-        }
+        if (exitOnError) check(); // otherwise the owner calls check() once it has read everything, and may have given up earlier on an error of its own
         if (help) {
             std::exit(0);
         }
     }
     
+    // reports the arguments that were not read as errors, then returns whether every argument was read without error
+    bool check () {
+        if (args.size() > 0) {
+            std::printf(YELLOW "Unused arguments, are you sure you meant to include these?\n%s" WHITE, toString().c_str());
+            args.clear();
+            fail();
+        }
+        return !failed;
+    }
+    
+    bool has (const std::string& key) const {
+        return args.find(key) != args.end();
+    }
+    
     template<typename T>
     T read(const std::string& key, const T& defaultValue, bool required = false) {
         T val = defaultValue;
@@ -78,7 +103,7 @@ public:
             args.erase(found);
         } else if (required && !help) {
             std::printf(RED "No argument passed for required parameter -%s!\n" WHITE, key.c_str());
-            std::exit(1);
+            fail();
         }
         if (help) {
             std::printf(BLUE "-%s: %s", key.c_str(), typeName<T>().c_str());
@@ -119,7 +144,8 @@ bool Arguments::fromString<bool>(const std::string& val) const {
         return false;
     } else {
         std::printf(RED "Could not convert '%s' to bool; use 'true' (or '1') or 'false' (or '0')!\n" WHITE, val.c_str());
-        std::exit(1);
+        fail();
+        return false;
     }
 }
 
@@ -129,10 +155,12 @@ bool Arguments::fromString<bool>(const std::string& val) const {
             return std::stot(val); \
         } catch (const std::invalid_argument& e) { \
             std::printf(RED "Could not convert '%s' to " #T " (invalid argument): %s\n" WHITE, val.c_str(), e.what()); \
-            std::exit(1); \
+            fail(); \
+            return T(); \
         } catch (const std::out_of_range& e ) { \
             std::printf(RED "Could not convert '%s' to " #T " (out of range): %s\n" WHITE, val.c_str(), e.what()); \
-            std::exit(1); \
+            fail(); \
+            return T(); \
         } \
     }
 FROM_STRING_STD_STO_T(int, stoi);
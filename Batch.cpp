@@ -0,0 +1,99 @@
+#include "Batch.h"
+
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+
+#include "colours.h"
+#include "Metrics.h"
+
+
+bool batch::readManifest(std::string filename, std::vector<BatchJob>& jobs) {
+	std::ifstream file(filename);
+	if (!file) {
+		printf(RED "Cannot read job manifest %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	std::string line;
+	for (size_t lineNumber = 1; std::getline(file, line); ++lineNumber) {
+		BatchJob job;
+		job.line = lineNumber;
+		std::string word;
+		bool inWord = false, quoted = false;
+		for (char c : line) {
+			if (c == '"') {
+				quoted = !quoted;
+				inWord = true;
+			} else if (!quoted && c == '#') {
+				break;
+			} else if (!quoted && (c == ' ' || c == '\t' || c == '\r')) {
+				if (inWord) job.args.push_back(word);
+				word.clear();
+				inWord = false;
+			} else {
+				word += c;
+				inWord = true;
+			}
+		}
+		if (quoted) {
+			printf(RED "Unterminated quote on line %zu of job manifest %s.\n" WHITE, lineNumber, filename.c_str());
+			return false;
+		}
+		if (inWord) job.args.push_back(word);
+		if (!job.args.empty()) {
+			jobs.push_back(job);
+		}
+	}
+	return true;
+}
+
+bool batch::run(std::vector<BatchJob>& jobs, size_t maxConcurrent, const std::function<int(BatchJob&)>& runJob) {
+
+	// Each runner thread takes the next job in manifest order until there are none left
+	std::atomic<size_t> next{ 0 };
+	auto runner = [&](size_t index) {
+		metrics::setThreadName("job runner " + std::to_string(index));
+		for (size_t i = next++; i < jobs.size(); i = next++) {
+			BatchJob& job = jobs[i];
+			if (job.status != -1) {
+				continue; // already failed, e.g. on its arguments
+			}
+			printf(BLUE "Starting job %zu of %zu (manifest line %zu).\n" WHITE, i + 1, jobs.size(), job.line);
+			const auto start = std::chrono::steady_clock::now();
+			job.status = runJob(job);
+			job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (job.status != 0) {
+				printf(RED "Job %zu of %zu (manifest line %zu) failed.\n" WHITE, i + 1, jobs.size(), job.line);
+			}
+		}
+	};
+	std::vector<std::thread> runners;
+	for (size_t i = 0, count = std::min(std::max<size_t>(1, maxConcurrent), jobs.size()); i < count; ++i) {
+		runners.emplace_back(runner, i);
+	}
+	for (auto& thread : runners) {
+		thread.join();
+	}
+	return std::all_of(jobs.begin(), jobs.end(), [](const BatchJob& job) { return job.status == 0; });
+}
+
+void batch::printSummary(const std::vector<BatchJob>& jobs, double wallSeconds) {
+	printf(BLUE "Batch summary:\n" WHITE);
+	double seconds = 0.0;
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		const BatchJob& job = jobs[i];
+		const auto file = std::find(job.args.begin(), job.args.end(), "-file");
+		const std::string scan = file != job.args.end() && file + 1 != job.args.end() ? *(file + 1) : job.args.front();
+		const double megabytes = job.regionBytes / (1024.0 * 1024.0);
+		printf("  Job %zu (line %zu, %s): %s, %.2f s, %.1f MB region, %.1f MB/s\n", i + 1, job.line, scan.c_str(), job.status == 0 ? "done" : "failed",
+			job.seconds, megabytes, job.seconds > 0.0 ? megabytes / job.seconds : 0.0);
+		seconds += job.seconds;
+		bytes += job.regionBytes;
+	}
+	printf(BLUE "%zu jobs, %.1f MB of regions in %.2f s (%.2f s of job time), %.1f MB/s overall.\n" WHITE, jobs.size(), bytes / (1024.0 * 1024.0), wallSeconds, seconds,
+		wallSeconds > 0.0 ? bytes / (1024.0 * 1024.0) / wallSeconds : 0.0);
+}
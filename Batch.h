@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+
+/// One scan of a batch, with the arguments it runs with as they would be given on the command line, and how it went
+struct BatchJob {
+	size_t line = 0;
+	std::vector<std::string> args;
+
+	int status = -1;
+	double seconds = 0.0;
+
+	/// Volume data within the job's region, read by each pass over it
+	uint64_t regionBytes = 0;
+};
+
+
+namespace batch {
+
+	/// Reads a job manifest: one job per line, with the command-line arguments of the scan (e.g. -file, -width, -threshold, -3d); words in double quotes are kept together,
+	/// and # starts a comment
+	bool readManifest(std::string filename, std::vector<BatchJob>& jobs);
+
+	/// Runs the jobs in manifest order, up to maxConcurrent at once on threads of their own, each calling runJob, which is expected to wait for what it needs of
+	/// the global memory budget; all jobs share the global thread pool; jobs that already have a status (e.g. rejected arguments) are skipped; returns whether
+	/// every job succeeded
+	bool run(std::vector<BatchJob>& jobs, size_t maxConcurrent, const std::function<int(BatchJob&)>& runJob);
+
+	/// Prints the status, time, region size and throughput of each job, and the throughput of the batch over wallSeconds
+	void printSummary(const std::vector<BatchJob>& jobs, double wallSeconds);
+
+}
@@ -0,0 +1,290 @@
+#include "Bench.h"
+
+#include <cmath>
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+#include "VolIterator.h"
+#include "SliceSource.h"
+#include "MaskSource.h"
+#include "ObjModel.h"
+#include "Mesher.h"
+#include "filesystem.h"
+#include "colours.h"
+
+
+/// Threshold between air and bone in the synthetic volume
+static constexpr float BONE_THRESHOLD = 5.5f;
+
+/// Uniform noise in [-1, 1] for voxel index i, the same on every run with the same seed
+static inline float noiseAt(uint64_t i, uint32_t seed) {
+	uint64_t h = (i + 1) * 0x9E3779B97F4A7C15ull ^ seed;
+	h ^= h >> 31;
+	h *= 0xBF58476D1CE4E5B9ull;
+	h ^= h >> 29;
+	return (float)(h >> 40) * (2.0f / (1 << 24)) - 1.0f;
+}
+
+/// Value of the synthetic skull at voxel {x, y, z}, before noise
+static float skullValue(const SyntheticParams& params, size_t x, size_t y, size_t z) {
+	const double u = (x + 0.5) / params.width * 2.0 - 1.0;
+	const double v = (y + 0.5) / params.height * 2.0 - 1.0;
+	const double w = (z + 0.5) / params.depth * 2.0 - 1.0;
+
+	// Foramen through the bottom of the braincase
+	if (w < -0.4 && u * u + v * v < 0.04) return 1.0f;
+
+	// Outer table, spongy bone, inner table and braincase, as nested ellipsoids
+	const double r = std::sqrt(u * u / 0.81 + v * v / 0.64 + w * w / 0.81);
+	if (r > 1.0) return 1.0f;
+	if (r > 0.9) return 10.0f;
+	if (r > 0.8) return 6.0f;
+	if (r > 0.72) return 10.0f;
+	return 2.0f;
+}
+
+bool bench::generateVolume(const SyntheticParams& params, std::string filename) {
+	const uint64_t sliceVoxels = (uint64_t)params.width * params.height;
+	const uint64_t totalBytes = sliceVoxels * params.depth * sizeof(float);
+
+	// Parts share the same size but for the last one, as VolIterator expects; they're named in the order they're read
+	const size_t partCount = std::max<size_t>(1, params.parts);
+	const uint64_t partBytes = partCount > 1 ? ((totalBytes + partCount - 1) / partCount + 3) / 4 * 4 : totalBytes;
+	if (partCount > 1 && !fs::createDirectory(filename)) {
+		printf(RED "Cannot create directory %s for volume parts.\n" WHITE, filename.c_str());
+		return false;
+	}
+	std::ofstream file;
+	size_t part = 0;
+	uint64_t partLeft = 0;
+	auto write = [&](const char* data, uint64_t size) {
+		while (size > 0) {
+			if (partLeft == 0) {
+				char partName[32];
+				snprintf(partName, sizeof(partName), "/part%04zu.vol", part++);
+				file.close();
+				file.open(partCount > 1 ? filename + partName : filename, std::ios::binary);
+				partLeft = partBytes;
+			}
+			const uint64_t chunk = std::min(size, partLeft);
+			if (!file.write(data, chunk)) return false;
+			data += chunk;
+			size -= chunk;
+			partLeft -= chunk;
+		}
+		return true;
+	};
+
+	std::vector<float> slice(sliceVoxels);
+	for (size_t z = 0; z < params.depth; ++z) {
+		for (size_t y = 0; y < params.height; ++y) {
+			for (size_t x = 0; x < params.width; ++x) {
+				const uint64_t i = (z * params.height + y) * params.width + x;
+				slice[y * params.width + x] = skullValue(params, x, y, z) + params.noise * noiseAt(i, params.seed);
+			}
+		}
+		if (!write((const char*)slice.data(), slice.size() * sizeof(float))) {
+			printf(RED "Cannot write synthetic volume to %s.\n" WHITE, filename.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+uint64_t bench::getPeakRss() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.PeakWorkingSetSize : 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+	return (uint64_t)usage.ru_maxrss;
+#else
+	return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+bool bench::run(const SyntheticParams& params, std::string filename, std::string directory, std::vector<BenchResult>& results) {
+	using Clock = std::chrono::steady_clock;
+	const size_t width = params.width, height = params.height, depth = params.depth;
+	const uint64_t sliceVoxels = (uint64_t)width * height, voxels = sliceVoxels * depth;
+	auto record = [&](const char* name, uint64_t items, uint64_t bytes, double seconds) {
+		BenchResult result;
+		result.name = name;
+		result.items = items;
+		result.bytes = bytes;
+		result.seconds = seconds;
+		result.peakRss = getPeakRss();
+		results.push_back(result);
+		printf("  %s: %.3f s\n", name, seconds);
+	};
+	auto since = [](Clock::time_point start) { return std::chrono::duration<double>(Clock::now() - start).count(); };
+
+	// Loading full-resolution slices; the volume was just written, so this mostly measures reads from the page cache
+	{
+		std::unique_ptr<VolIterator> vol(VolIterator::Open(filename, width, height, depth, VolIteratorParams()));
+		if (!vol) return false;
+		const Clock::time_point start = Clock::now();
+		for (size_t z = 0; z < depth; ++z) {
+			if (!vol->getFullSlice(z)) return false;
+		}
+		record("load_slice", voxels, voxels * sizeof(float), since(start));
+	}
+
+	// Fetching every voxel through getVoxel, the slices being loaded beforehand
+	{
+		std::unique_ptr<VolIterator> vol(VolIterator::Open(filename, width, height, depth, VolIteratorParams()));
+		if (!vol) return false;
+		double seconds = 0.0;
+		float sum = 0.0f;
+		for (size_t z = 0; z < depth; ++z) {
+			if (!vol->getFullSlice(z)) return false;
+			const Clock::time_point start = Clock::now();
+			for (size_t y = 0; y < height; ++y) {
+				for (size_t x = 0; x < width; ++x) {
+					sum += vol->getVoxel(x, y, z);
+				}
+			}
+			seconds += since(start);
+		}
+		volatile float keep = sum; // keeps the loop from being optimised away
+		(void)keep;
+		record("get_voxel", voxels, voxels * sizeof(float), seconds);
+	}
+
+	// Downscaling by 2 along each axis, including the loading of the slices it averages
+	{
+		VolIteratorParams downscaled;
+		downscaled.downscaleX = downscaled.downscaleY = downscaled.downscaleZ = 2;
+		downscaled.loadedNum = downscaled.downscaleZ * 3;
+		std::unique_ptr<VolIterator> vol(VolIterator::Open(filename, width, height, depth, downscaled));
+		if (!vol) return false;
+		std::vector<float> slice(vol->getDownscaledWidth() * vol->getDownscaledHeight());
+		const Clock::time_point start = Clock::now();
+		for (size_t z = 0, dDepth = vol->getDownscaledDepth(); z < dDepth; ++z) {
+			if (!vol->readSlice(z, slice.data())) return false;
+		}
+		record("downscale_2x2x2", voxels, voxels * sizeof(float), since(start));
+	}
+
+	// Slices from the middle of the volume, where the braincase is widest, kept in memory for the stages below that would take too long over the whole volume
+	const size_t sampleDepth = std::min<size_t>(depth, 16);
+	const size_t sampleBegin = (depth - sampleDepth) / 2;
+	std::vector<float> sample(sliceVoxels * sampleDepth);
+	{
+		std::unique_ptr<VolIterator> vol(VolIterator::Open(filename, width, height, depth, VolIteratorParams()));
+		if (!vol) return false;
+		for (size_t z = 0; z < sampleDepth; ++z) {
+			const float* slice = vol->getFullSlice(sampleBegin + z);
+			if (!slice) return false;
+			std::copy(slice, slice + sliceVoxels, &sample[z * sliceVoxels]);
+		}
+	}
+
+	// Remapping slices to 8 bits and encoding them as png files
+	{
+		const Clock::time_point start = Clock::now();
+		for (size_t z = 0; z < sampleDepth; ++z) {
+			if (!slices::writePng(&sample[z * sliceVoxels], nullptr, width, height, directory + "/bench.png", 1.0f, 10.0f)) return false;
+		}
+		record("png_remap_encode", sampleDepth * sliceVoxels, sampleDepth * sliceVoxels * sizeof(float), since(start));
+	}
+
+	// Hashed vertex deduplication: the corner of every bone voxel, then all six faces of every bone voxel
+	{
+		ObjModel model;
+		uint64_t calls = 0;
+		const Clock::time_point start = Clock::now();
+		for (size_t z = 0; z < sampleDepth; ++z) {
+			for (size_t y = 0; y < height; ++y) {
+				for (size_t x = 0; x < width; ++x) {
+					if (sample[(z * height + y) * width + x] >= BONE_THRESHOLD) {
+						model.addPosition(x - 0.5f, y - 0.5f, sampleBegin + z - 0.5f);
+						++calls;
+					}
+				}
+			}
+		}
+		record("obj_add_position", calls, 0, since(start));
+	}
+	{
+		ObjModel model;
+		uint64_t squares = 0;
+		const Clock::time_point start = Clock::now();
+		for (size_t z = 0; z < sampleDepth; ++z) {
+			for (size_t y = 0; y < height; ++y) {
+				for (size_t x = 0; x < width; ++x) {
+					if (sample[(z * height + y) * width + x] >= BONE_THRESHOLD) {
+						for (int direction = 0; direction < 6; ++direction) {
+							model.addAASquare((float)x, (float)y, (float)(sampleBegin + z), (ObjModel::Direction)direction, 0.5f);
+						}
+						squares += 6;
+					}
+				}
+			}
+		}
+		record("obj_add_aa_square", squares, 0, since(start));
+	}
+
+	// Meshing the whole volume on the corner lattice as exports do, thresholding included, then writing it out
+	{
+		std::unique_ptr<VolIterator> vol(VolIterator::Open(filename, width, height, depth, VolIteratorParams()));
+		if (!vol) return false;
+		VolSlices values(*vol);
+		ThresholdMask mask(values, BONE_THRESHOLD);
+		ObjModel model;
+		model.scale = 0.01f;
+		model.setLatticeSize(width, height);
+		Clock::time_point start = Clock::now();
+		if (!mesher::meshSlab(mask, model, 0, depth)) return false;
+		record("mesh_lattice", voxels, voxels * sizeof(float), since(start));
+
+		const std::string objFilename = directory + "/bench.obj";
+		const size_t faces = model.positionIndices.size() / 3;
+		start = Clock::now();
+		if (!model.writeToFile(objFilename)) return false;
+		record("write_obj", faces, fs::fileSize(objFilename), since(start));
+	}
+	return true;
+}
+
+void bench::print(const std::vector<BenchResult>& results) {
+	printf(BLUE "%-20s %12s %14s %12s %14s\n" WHITE, "benchmark", "items", "ns/item", "MB/s", "peak RSS (MB)");
+	for (const BenchResult& result : results) {
+		printf("%-20s %12llu %14.2f %12.1f %14.1f\n", result.name.c_str(), (unsigned long long)result.items, result.nsPerItem(), result.megabytesPerSecond(), result.peakRss / (1024.0 * 1024.0));
+	}
+}
+
+bool bench::writeJson(const std::vector<BenchResult>& results, const SyntheticParams& params, size_t threads, std::string filename) {
+	std::ofstream file(filename);
+	if (!file) {
+		printf(RED "Cannot write benchmark results to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	file << "{\n  \"volume\": { \"width\": " << params.width << ", \"height\": " << params.height << ", \"depth\": " << params.depth
+		<< ", \"parts\": " << params.parts << ", \"noise\": " << params.noise << ", \"seed\": " << params.seed << " },\n";
+	file << "  \"threads\": " << threads << ",\n";
+	file << "  \"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const BenchResult& r = results[i];
+		file << "    { \"name\": \"" << r.name << "\", \"items\": " << r.items << ", \"bytes\": " << r.bytes << ", \"seconds\": " << r.seconds
+			<< ", \"ns_per_item\": " << r.nsPerItem() << ", \"mb_per_s\": " << r.megabytesPerSecond() << ", \"peak_rss_bytes\": " << r.peakRss << " }"
+			<< (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	file << "  ]\n}\n";
+	return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+/// Synthetic skull-like volume: an ellipsoidal braincase of two dense bone tables around spongy bone, opened by a foramen, in air, with uniform noise
+struct SyntheticParams {
+	size_t width = 256, height = 256, depth = 256;
+
+	/// Amplitude of the noise added to every voxel; bone is around 10, spongy bone around 6, air 1 and the braincase 2
+	float noise = 1.0f;
+	uint32_t seed = 1;
+
+	/// Number of files the volume is split into, in a directory as with .vol-parts; 1 writes a single .vol file
+	size_t parts = 1;
+};
+
+
+/// Timing of one microbenchmark
+struct BenchResult {
+	std::string name;
+
+	/// Voxels (or items, for mesh stages) processed and bytes read or written
+	uint64_t items = 0, bytes = 0;
+	double seconds = 0.0;
+
+	/// Peak resident memory of the process after the benchmark, in bytes
+	uint64_t peakRss = 0;
+
+	inline double nsPerItem() const { return items ? seconds * 1e9 / items : 0.0; }
+	inline double megabytesPerSecond() const { return seconds > 0.0 ? bytes / (1024.0 * 1024.0) / seconds : 0.0; }
+};
+
+
+namespace bench {
+
+	/// Writes a synthetic volume to filename (a directory of parts if params.parts > 1), slice by slice
+	bool generateVolume(const SyntheticParams& params, std::string filename);
+
+	/// Benchmarks the stages of an export over the synthetic volume at filename: loading slices, getVoxel, downscaling, png remapping and encoding, adding mesh faces
+	/// and writing the mesh; scratch outputs go to directory
+	bool run(const SyntheticParams& params, std::string filename, std::string directory, std::vector<BenchResult>& results);
+
+	/// Prints the results as a table
+	void print(const std::vector<BenchResult>& results);
+
+	/// Writes the results and the volume they were measured on to a json file
+	bool writeJson(const std::vector<BenchResult>& results, const SyntheticParams& params, size_t threads, std::string filename);
+
+	/// Peak resident memory of the process so far, in bytes; 0 if unknown
+	uint64_t getPeakRss();
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+
+namespace bits {
+
+	/// Returns the index of the lowest set bit; word must not be 0
+	inline int countTrailingZeros(uint64_t word) {
+	#ifdef _MSC_VER
+		unsigned long idx;
+		_BitScanForward64(&idx, word);
+		return (int)idx;
+	#else
+		return __builtin_ctzll(word);
+	#endif
+	}
+
+	/// Returns the number of zero bits above the highest set bit; word must not be 0
+	inline int countLeadingZeros(uint64_t word) {
+	#ifdef _MSC_VER
+		unsigned long idx;
+		_BitScanReverse64(&idx, word);
+		return 63 - (int)idx;
+	#else
+		return __builtin_clzll(word);
+	#endif
+	}
+
+	/// Returns the number of set bits
+	inline int popCount(uint64_t word) {
+	#ifdef _MSC_VER
+		return (int)__popcnt64(word);
+	#else
+		return __builtin_popcountll(word);
+	#endif
+	}
+
+}
+
+
+/// Bit-packed occupancy of a single (downscaled) slice, 64 voxels per word along X
+/// Each row starts on a new word; padding bits past the width are always 0
+struct BitSlice {
+
+	size_t width = 0, height = 0;
+	size_t wordsPerRow = 0;
+	std::vector<uint64_t> words;
+
+	/// Resizes the slice and clears all bits
+	inline void resize(size_t w, size_t h) {
+		width = w;
+		height = h;
+		wordsPerRow = (w + 63) / 64;
+		words.assign(wordsPerRow * h, 0);
+	}
+
+	inline void clear() { std::fill(words.begin(), words.end(), 0); }
+
+	inline uint64_t* row(size_t y) { return &words[y * wordsPerRow]; }
+	inline const uint64_t* row(size_t y) const { return &words[y * wordsPerRow]; }
+
+	inline bool get(size_t x, size_t y) const { return (row(y)[x >> 6] >> (x & 63)) & 1; }
+	inline void set(size_t x, size_t y) { row(y)[x >> 6] |= uint64_t(1) << (x & 63); }
+	inline void reset(size_t x, size_t y) { row(y)[x >> 6] &= ~(uint64_t(1) << (x & 63)); }
+
+	/// Sets voxels [xBegin, xEnd) of row y
+	inline void setRange(size_t y, size_t xBegin, size_t xEnd) {
+		uint64_t* r = row(y);
+		while (xBegin < xEnd) {
+			const size_t bit = xBegin & 63, count = std::min<size_t>(64 - bit, xEnd - xBegin);
+			r[xBegin >> 6] |= (count == 64 ? ~uint64_t(0) : ((uint64_t(1) << count) - 1)) << bit;
+			xBegin += count;
+		}
+	}
+
+	/// Returns whether any voxel of [xBegin, xEnd) on row y is set
+	inline bool anyInRange(size_t y, size_t xBegin, size_t xEnd) const {
+		const uint64_t* r = row(y);
+		while (xBegin < xEnd) {
+			const size_t bit = xBegin & 63, count = std::min<size_t>(64 - bit, xEnd - xBegin);
+			if ((r[xBegin >> 6] >> bit) & (count == 64 ? ~uint64_t(0) : ((uint64_t(1) << count) - 1))) return true;
+			xBegin += count;
+		}
+		return false;
+	}
+
+	/// Calls fn(xBegin, xEnd) for each run of set voxels [xBegin, xEnd) along row y, in increasing x; runs may span several words
+	template<typename Fn>
+	inline void forEachRun(size_t y, Fn fn) const {
+		const uint64_t* r = row(y);
+		bool open = false;
+		size_t begin = 0;
+		for (size_t w = 0; w < wordsPerRow; ++w) {
+			const uint64_t word = r[w];
+			size_t pos = 0;
+			while (pos < 64) {
+				if (open) {
+					const uint64_t zeros = ~word >> pos;
+					if (!zeros) break; // run continues into the next word
+					pos += bits::countTrailingZeros(zeros);
+					fn(begin, w * 64 + pos);
+					open = false;
+				} else {
+					const uint64_t ones = word >> pos;
+					if (!ones) break;
+					pos += bits::countTrailingZeros(ones);
+					begin = w * 64 + pos;
+					open = true;
+				}
+			}
+		}
+		if (open) fn(begin, width);
+	}
+
+	/// Mask of the valid bits in the last word of each row
+	inline uint64_t lastWordMask() const { return (width & 63) ? (uint64_t(1) << (width & 63)) - 1 : ~uint64_t(0); }
+
+	/// Returns the number of set voxels
+	inline size_t count() const {
+		size_t total = 0;
+		for (uint64_t word : words) total += bits::popCount(word);
+		return total;
+	}
+};
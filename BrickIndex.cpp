@@ -0,0 +1,188 @@
+#include "BrickIndex.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <algorithm>
+
+#include "VolIterator.h"
+#include "ThreadPool.h"
+#include "Metrics.h"
+#include "filesystem.h"
+#include "colours.h"
+
+
+/// Identifies sidecar files, the last character being the format version
+static const char MAGIC[8] = { 'S', 'V', 'B', 'R', 'I', 'C', 'K', '2' };
+
+
+std::vector<int64_t> BrickIndex::getVolumeStamps(const std::string& filename) {
+	std::vector<std::string> filenames;
+	if (fs::isDirectory(filename)) {
+		fs::listDirectoryFiles(filename, filenames);
+		std::sort(filenames.begin(), filenames.end(), fs::naturalLess);
+	} else {
+		filenames.push_back(filename);
+	}
+	std::vector<int64_t> stamps;
+	for (const std::string& part : filenames) {
+		stamps.push_back((int64_t)fs::fileSize(part));
+		stamps.push_back(fs::fileModificationTime(part));
+	}
+	return stamps;
+}
+
+std::string BrickIndex::getSidecarFilename(std::string volumeFilename) {
+	while (!volumeFilename.empty() && (volumeFilename.back() == '/' || volumeFilename.back() == '\\')) {
+		volumeFilename.pop_back();
+	}
+	return volumeFilename + ".bricks";
+}
+
+std::shared_ptr<BrickIndex> BrickIndex::Open(const VolIterator& vol, size_t brickSize) {
+	const std::string filename = getSidecarFilename(vol.getFilename());
+	auto index = std::make_shared<BrickIndex>();
+	if (index->load(filename, vol, brickSize)) {
+		printf(BLUE "Loaded brick index %s (%zu bricks).\n" WHITE, filename.c_str(), index->getBrickCount());
+		return index;
+	}
+	printf(BLUE "Building brick index %s\n" WHITE, filename.c_str());
+	if (!index->build(vol, brickSize)) {
+		return nullptr;
+	}
+	if (!index->save(filename)) {
+		printf(YELLOW "Warning: cannot write brick index %s, it will be rebuilt next time.\n" WHITE, filename.c_str());
+	}
+	return index;
+}
+
+bool BrickIndex::build(const VolIterator& vol, size_t size) {
+	brickSize = std::max<size_t>(1, size);
+	width = vol.getFullWidth();
+	height = vol.getFullHeight();
+	depth = vol.getFullDepth();
+	volumeStamps = getVolumeStamps(vol.getFilename());
+	const size_t sizes[3] = { width, height, depth };
+	for (int axis = 0; axis < 3; ++axis) {
+		bricks[axis] = (sizes[axis] + brickSize - 1) / brickSize;
+	}
+	const size_t layerBricks = bricks[0] * bricks[1];
+	mins.assign(layerBricks * bricks[2], std::numeric_limits<float>::infinity());
+	maxs.assign(layerBricks * bricks[2], -std::numeric_limits<float>::infinity());
+
+	// Split the brick layers into Z slabs read concurrently, each with its own copy of the volume over all of it; slabs only write the bricks of their layers
+	ThreadPool& pool = ThreadPool::Global();
+	metrics::Progress progress(depth);
+	return pool.forEachSlab(0, bricks[2], pool.getSlabCount(bricks[2]), nullptr, [this, &vol, layerBricks](const ThreadPool::Slab& slab) {
+		metrics::TraceSpan span("brick_index_slab");
+		std::unique_ptr<VolIterator> reader(vol.clone());
+		reader->setRegion(VolRegion());
+		for (size_t z = slab.begin * brickSize, zEnd = std::min(depth, slab.end * brickSize); z < zEnd; ++z) {
+			const float* slice = reader->getFullSlice(z);
+			if (!slice) return false;
+			float* layerMins = &mins[(z / brickSize) * layerBricks];
+			float* layerMaxs = &maxs[(z / brickSize) * layerBricks];
+			for (size_t y = 0; y < height; ++y) {
+				const float* row = &slice[y * width];
+				float* rowMins = &layerMins[(y / brickSize) * bricks[0]];
+				float* rowMaxs = &layerMaxs[(y / brickSize) * bricks[0]];
+				for (size_t bx = 0; bx < bricks[0]; ++bx) {
+
+					// Comparisons are false for NaN, which keeps it out of both bounds; it is only flagged
+					float lo = rowMins[bx], hi = rowMaxs[bx];
+					bool nan = false;
+					for (size_t x = bx * brickSize, xEnd = std::min(width, x + brickSize); x < xEnd; ++x) {
+						const float v = row[x];
+						lo = v < lo ? v : lo;
+						hi = v > hi ? v : hi;
+						nan |= v != v;
+					}
+					rowMins[bx] = nan ? -std::numeric_limits<float>::infinity() : lo;
+					rowMaxs[bx] = hi;
+				}
+			}
+		}
+		return true;
+	}, [&](const ThreadPool::Slab& slab) {
+		progress.update(std::min(depth, slab.end * brickSize));
+		return true;
+	});
+}
+
+bool BrickIndex::load(std::string filename, const VolIterator& vol, size_t size) {
+	std::ifstream file(filename, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+	char magic[sizeof(MAGIC)];
+	uint64_t header[5];
+	if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || !file.read((char*)header, sizeof(header))) {
+		return false;
+	}
+	const std::vector<int64_t> stamps = getVolumeStamps(vol.getFilename());
+	if (header[0] != size || header[1] != vol.getFullWidth() || header[2] != vol.getFullHeight() || header[3] != vol.getFullDepth() || header[4] != stamps.size()) {
+		return false;
+	}
+	volumeStamps.resize(stamps.size());
+	if (!file.read((char*)volumeStamps.data(), volumeStamps.size() * sizeof(int64_t)) || volumeStamps != stamps) {
+		return false;
+	}
+	brickSize = header[0];
+	width = header[1];
+	height = header[2];
+	depth = header[3];
+	const size_t sizes[3] = { width, height, depth };
+	for (int axis = 0; axis < 3; ++axis) {
+		bricks[axis] = (sizes[axis] + brickSize - 1) / brickSize;
+	}
+	const size_t count = bricks[0] * bricks[1] * bricks[2];
+	mins.resize(count);
+	maxs.resize(count);
+	return file.read((char*)mins.data(), count * sizeof(float)) && file.read((char*)maxs.data(), count * sizeof(float));
+}
+
+bool BrickIndex::save(std::string filename) const {
+	const std::string tempFilename = filename + "." + std::to_string(std::random_device()()) + ".tmp";
+	std::ofstream file(tempFilename, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+	const uint64_t header[5] = { brickSize, width, height, depth, volumeStamps.size() };
+	file.write(MAGIC, sizeof(MAGIC));
+	file.write((const char*)header, sizeof(header));
+	file.write((const char*)volumeStamps.data(), volumeStamps.size() * sizeof(int64_t));
+	file.write((const char*)mins.data(), mins.size() * sizeof(float));
+	file.write((const char*)maxs.data(), maxs.size() * sizeof(float));
+	file.close();
+	if (!file || !fs::renameFile(tempFilename, filename)) {
+		fs::removeAll(tempFilename);
+		return false;
+	}
+	return true;
+}
+
+bool BrickIndex::getBounds(const VolRegion& region, float& min, float& max) const {
+	if (region.empty() || mins.empty()) {
+		return false;
+	}
+	size_t first[3], last[3];
+	const size_t sizes[3] = { width, height, depth };
+	for (int axis = 0; axis < 3; ++axis) {
+		first[axis] = std::min(region.begin[axis], sizes[axis] - 1) / brickSize;
+		last[axis] = (std::min(region.end[axis], sizes[axis]) - 1) / brickSize;
+	}
+	min = std::numeric_limits<float>::infinity();
+	max = -std::numeric_limits<float>::infinity();
+	for (size_t bz = first[2]; bz <= last[2]; ++bz) {
+		for (size_t by = first[1]; by <= last[1]; ++by) {
+			const size_t rowStart = (bz * bricks[1] + by) * bricks[0];
+			for (size_t bx = first[0]; bx <= last[0]; ++bx) {
+				min = std::min(min, mins[rowStart + bx]);
+				max = std::max(max, maxs[rowStart + bx]);
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+class VolIterator;
+struct VolRegion;
+
+
+/// Minimum and maximum of the full-resolution values within each brick (a cube of brickSize voxels) of a volume, to tell which parts of it lie entirely on one side of a threshold without reading them
+/// NaN voxels fail any threshold, so they are left out of a brick's maximum and pull its minimum down to -infinity
+/// Built in a single streaming pass, brick layers read concurrently, and kept next to the volume as a sidecar file (a few bytes per brick) that gets rebuilt when
+/// the volume's files are no longer the size or the age they were when it was built
+class BrickIndex {
+
+	size_t brickSize = 0;
+	size_t width = 0, height = 0, depth = 0;
+	size_t bricks[3] = { 0, 0, 0 };
+
+	/// Size and modification time of each volume file or part when the index was built, in the order of their names, to detect a volume that changed since
+	/// (e.g. a scan reconstructed again at the same size)
+	std::vector<int64_t> volumeStamps;
+
+	/// Bounds of each brick, X fastest then Y then Z
+	std::vector<float> mins, maxs;
+
+	/// Size and modification time of each file of a .vol file or .vol-parts directory, as stored in volumeStamps
+	static std::vector<int64_t> getVolumeStamps(const std::string& filename);
+
+public:
+	static constexpr size_t DEFAULT_BRICK_SIZE = 32;
+
+	/// Path of the sidecar file for a .vol file or .vol-parts directory
+	static std::string getSidecarFilename(std::string volumeFilename);
+
+	/// Loads the index from the sidecar file of the volume if it matches, or builds it and saves it there; returns nullptr if the volume cannot be read
+	static std::shared_ptr<BrickIndex> Open(const VolIterator& vol, size_t brickSize = DEFAULT_BRICK_SIZE);
+
+	/// Reads the bounds of every brick of the whole volume
+	bool build(const VolIterator& vol, size_t brickSize = DEFAULT_BRICK_SIZE);
+
+	/// Loads an index file; returns false if it is missing, malformed, or does not describe the given volume with the given brick size
+	bool load(std::string filename, const VolIterator& vol, size_t brickSize);
+
+	/// Writes the index to a temporary file next to filename, which then replaces it, so that jobs opening the same volume never read a partly written index
+	bool save(std::string filename) const;
+
+	/// Bounds of the values within a full-resolution region, from the bricks it overlaps; returns false if the region is empty
+	bool getBounds(const VolRegion& region, float& min, float& max) const;
+
+	inline size_t getBrickCount() const { return mins.size(); }
+};
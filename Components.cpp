@@ -0,0 +1,293 @@
+#include "Components.h"
+
+#include <algorithm>
+#include <fstream>
+#include <cassert>
+
+#include "colours.h"
+#include "Metrics.h"
+
+
+static constexpr uint32_t NO_LABEL = UINT32_MAX;
+
+/// Labels the label arrays grow by at once, and the bytes each label takes in them (the bits of boundary and marked rounded up)
+static constexpr size_t LABEL_CHUNK = 1 << 16;
+static constexpr size_t LABEL_BYTES = sizeof(uint32_t) + sizeof(uint64_t) + 1;
+
+
+void ComponentLabeller::reset(size_t width, size_t height, size_t depth) {
+	this->width = width;
+	this->height = height;
+	this->depth = depth;
+	parent.clear();
+	sizes.clear();
+	boundary.clear();
+	marked.clear();
+	parent.shrink_to_fit();
+	sizes.shrink_to_fit();
+	boundary.shrink_to_fit();
+	marked.shrink_to_fit();
+	labelCapacity = 0;
+	labelMemory.resize(0);
+	rewind();
+}
+
+bool ComponentLabeller::reserveLabels(size_t count) {
+	if (count <= labelCapacity) return true;
+	const size_t capacity = std::max(count, labelCapacity + LABEL_CHUNK);
+	if (!labelMemory.resize(capacity * LABEL_BYTES)) {
+		MemoryBudget::Current().printExceeded("the component labels", (capacity - labelCapacity) * LABEL_BYTES);
+		return false;
+	}
+	parent.reserve(capacity);
+	sizes.reserve(capacity);
+	boundary.reserve(capacity);
+	marked.reserve(capacity);
+	labelCapacity = capacity;
+	return true;
+}
+
+void ComponentLabeller::rewind() {
+	nextZ = 0;
+	labelCount = 0;
+	runs.clear();
+	rowStart.assign(height + 1, 0);
+}
+
+uint32_t ComponentLabeller::findLocal(uint32_t r) {
+	while (localParent[r] != r) {
+		localParent[r] = localParent[localParent[r]];
+		r = localParent[r];
+	}
+	return r;
+}
+
+void ComponentLabeller::unionLocal(uint32_t a, uint32_t b) {
+	a = findLocal(a);
+	b = findLocal(b);
+	if (a != b) localParent[std::max(a, b)] = std::min(a, b);
+}
+
+uint32_t ComponentLabeller::find(uint32_t label) {
+	while (parent[label] != label) {
+		parent[label] = parent[parent[label]];
+		label = parent[label];
+	}
+	return label;
+}
+
+void ComponentLabeller::unionLabels(uint32_t a, uint32_t b) {
+	a = find(a);
+	b = find(b);
+	if (a != b) parent[std::max(a, b)] = std::min(a, b);
+}
+
+bool ComponentLabeller::labelSlice(const BitSlice& mask, bool record, const BitSlice* marks) {
+	assert(nextZ < depth && mask.width == width && mask.height == height);
+	const size_t z = nextZ++;
+
+	// The previous slice's runs are kept to link against
+	std::swap(runs, prevRuns);
+	std::swap(rowStart, prevRowStart);
+
+	// Extract runs of set voxels, row by row
+	runs.clear();
+	rowStart.resize(height + 1);
+	for (size_t y = 0; y < height; ++y) {
+		rowStart[y] = (uint32_t)runs.size();
+		mask.forEachRun(y, [&](size_t xBegin, size_t xEnd) {
+			runs.push_back({ (uint32_t)y, (uint32_t)xBegin, (uint32_t)xEnd, NO_LABEL });
+		});
+	}
+	rowStart[height] = (uint32_t)runs.size();
+
+	// Merge runs overlapping along Y within the slice
+	localParent.resize(runs.size());
+	for (uint32_t i = 0; i < runs.size(); ++i) localParent[i] = i;
+	for (size_t y = 1; y < height; ++y) {
+		for (uint32_t i = rowStart[y - 1], j = rowStart[y]; i < rowStart[y] && j < rowStart[y + 1];) {
+			if (runs[i].xBegin < runs[j].xEnd && runs[j].xBegin < runs[i].xEnd) unionLocal(i, j);
+			if (runs[i].xEnd < runs[j].xEnd) ++i;
+			else ++j;
+		}
+	}
+
+	// Give each local component the label of the first previous slice run it overlaps along Z; any other such labels are the same component
+	localLabel.assign(runs.size(), NO_LABEL);
+	for (size_t y = 0; y < height; ++y) {
+		for (uint32_t i = prevRowStart[y], j = rowStart[y]; i < prevRowStart[y + 1] && j < rowStart[y + 1];) {
+			if (prevRuns[i].xBegin < runs[j].xEnd && runs[j].xBegin < prevRuns[i].xEnd) {
+				uint32_t& label = localLabel[findLocal(j)];
+				if (label == NO_LABEL) label = prevRuns[i].label;
+				else if (record && label != prevRuns[i].label) unionLabels(label, prevRuns[i].label);
+			}
+			if (prevRuns[i].xEnd < runs[j].xEnd) ++i;
+			else ++j;
+		}
+	}
+
+	// Start new labels for components that didn't connect to the previous slice, in run order so that replaying assigns the same labels
+	const bool boundarySlice = z == 0 || z == depth - 1;
+	for (uint32_t j = 0; j < runs.size(); ++j) {
+		uint32_t& label = localLabel[findLocal(j)];
+		if (label == NO_LABEL) {
+			if (labelCount == NO_LABEL) {
+				printf(RED "Too many connected components to label (%u labels started by slice %zu), aborting.\n" WHITE, labelCount, z);
+				return false;
+			}
+			if (record && !reserveLabels((size_t)labelCount + 1)) {
+				return false;
+			}
+			label = labelCount++;
+			if (record) {
+				parent.push_back(label);
+				sizes.push_back(0);
+				boundary.push_back(false);
+				marked.push_back(false);
+			}
+			assert(label < parent.size());
+		}
+		Run& run = runs[j];
+		run.label = label;
+		if (record) {
+			sizes[label] += run.xEnd - run.xBegin;
+			if (boundarySlice || run.xBegin == 0 || run.xEnd == width || run.y == 0 || run.y == height - 1) {
+				boundary[label] = true;
+			}
+			if (marks && !marked[label] && marks->anyInRange(run.y, run.xBegin, run.xEnd)) {
+				marked[label] = true;
+			}
+		}
+	}
+	return true;
+}
+
+void ComponentLabeller::finalise() {
+	for (uint32_t label = 0; label < parent.size(); ++label) {
+		const uint32_t root = find(label);
+		if (root == label) continue;
+		sizes[root] += sizes[label];
+		sizes[label] = 0;
+		if (boundary[label]) boundary[root] = true;
+		if (marked[label]) marked[root] = true;
+	}
+}
+
+
+ComponentFilter::ComponentFilter(MaskSource& source, const ComponentParams& params, MaskSource* marks) : source(source), marks(marks), params(params) {}
+
+bool ComponentFilter::analyse() {
+	const size_t depth = getDepth();
+	labeller.reset(getWidth(), getHeight(), depth);
+	metrics::TraceSpan span("label_components");
+	metrics::Progress progress(depth, 0, "Labelling components: ");
+	for (size_t z = 0; z < depth; ++z) {
+		if (!source.readMask(z, input) || (marks && !marks->readMask(z, inputMarks))) {
+			printf(RED "Cannot read mask slice %zu out of %zu, aborting.\n" WHITE, z, depth);
+			return false;
+		}
+		if (!labeller.labelSlice(input, true, marks ? &inputMarks : nullptr)) {
+			return false;
+		}
+		if ((z + 1) % 100 == 0 || z + 1 == depth) {
+			progress.update(z + 1);
+		}
+	}
+	labeller.finalise();
+
+	// Rank components, largest first
+	const uint32_t labels = labeller.getLabelCount();
+	size_t roots = 0;
+	for (uint32_t label = 0; label < labels; ++label) {
+		if (labeller.find(label) == label) ++roots;
+	}
+	const uint64_t bytes = roots * sizeof(Component) + labels / 8;
+	if (!memory.resize(bytes)) {
+		MemoryBudget::Current().printExceeded("the list of components", bytes);
+		return false;
+	}
+	components.clear();
+	components.reserve(roots);
+	for (uint32_t label = 0; label < labels; ++label) {
+		if (labeller.find(label) == label) {
+			components.push_back({ label, labeller.getSize(label), labeller.touchesBoundary(label), labeller.isMarked(label) });
+		}
+	}
+	std::stable_sort(components.begin(), components.end(), [](const Component& a, const Component& b) { return a.voxels > b.voxels; });
+
+	// Decide which components to keep, then spread that to every label
+	keep.assign(labels, false);
+	size_t rank = 0;
+	for (size_t i = 0; i < components.size(); ++i) {
+		if (params.enclosedOnly && components[i].boundary) continue;
+		if (params.markedOnly && !components[i].marked) continue;
+		if ((params.keepLargest == 0 || rank < params.keepLargest) && components[i].voxels >= params.minVoxels) {
+			keep[components[i].label] = true;
+		}
+		++rank;
+	}
+	for (uint32_t label = 0; label < labels; ++label) {
+		keep[label] = keep[labeller.find(label)];
+	}
+
+	labeller.rewind();
+	hasOutput = false;
+	return true;
+}
+
+size_t ComponentFilter::getKeptCount() const {
+	size_t kept = 0;
+	for (const Component& component : components) {
+		if (keep[component.label]) ++kept;
+	}
+	return kept;
+}
+
+bool ComponentFilter::report(std::string filename) const {
+	uint64_t total = 0, kept = 0;
+	for (const Component& component : components) {
+		total += component.voxels;
+		if (keep[component.label]) kept += component.voxels;
+	}
+	printf(BLUE "Found %zu connected components (%llu voxels), keeping %zu of them (%llu voxels).\n" WHITE, components.size(), (unsigned long long)total, getKeptCount(), (unsigned long long)kept);
+	for (size_t i = 0; i < components.size() && i < 10; ++i) {
+		printf("  #%zu: %llu voxels%s%s%s\n", i + 1, (unsigned long long)components[i].voxels, components[i].boundary ? ", touches volume bounds" : "", marks && components[i].marked ? ", marked" : "", keep[components[i].label] ? "" : " (removed)");
+	}
+
+	if (filename.empty()) return true;
+	std::ofstream file(filename);
+	if (!file) {
+		printf(RED "Cannot write component sizes to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	file << "rank,voxels,touches_bounds,kept\n";
+	for (size_t i = 0; i < components.size(); ++i) {
+		file << i + 1 << ',' << components[i].voxels << ',' << (components[i].boundary ? 1 : 0) << ',' << (keep[components[i].label] ? 1 : 0) << "\n";
+	}
+	return true;
+}
+
+bool ComponentFilter::readMask(size_t z, BitSlice& out) {
+
+	// Serve the same slice again, or replay labelling up to z, restarting if z is behind
+	if (!hasOutput || z + 1 != labeller.getNextZ()) {
+		if (z < labeller.getNextZ()) {
+			labeller.rewind();
+		}
+		while (labeller.getNextZ() <= z) {
+			if (!source.readMask(labeller.getNextZ(), input)) {
+				return false;
+			}
+			if (!labeller.labelSlice(input, false)) {
+				return false;
+			}
+		}
+		output.resize(getWidth(), getHeight());
+		for (const ComponentLabeller::Run& run : labeller.getRuns()) {
+			if (keep[run.label]) output.setRange(run.y, run.xBegin, run.xEnd);
+		}
+		hasOutput = true;
+	}
+	out = output;
+	return true;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "BitSlice.h"
+#include "MaskSource.h"
+#include "MemoryBudget.h"
+
+
+/// Streaming 6-connected component labelling of mask slices, fed one slice at a time in increasing z
+/// Each slice is split into runs of set voxels along X; runs are merged with a union-find within the slice and against the previous slice's runs
+/// Memory is proportional to the runs of two slices, plus a few bytes for each label started (a component, or a branch of one, appearing), which are reserved
+/// from the current memory budget while recording
+class ComponentLabeller {
+public:
+
+	/// A run of set voxels [xBegin, xEnd) on row y, with the label it was assigned
+	struct Run {
+		uint32_t y, xBegin, xEnd, label;
+	};
+
+private:
+
+	size_t width = 0, height = 0, depth = 0;
+	size_t nextZ = 0;
+
+	/// Runs of the current and previous slices, in row then x order, with the index of each row's first run (height + 1 entries)
+	std::vector<Run> runs, prevRuns;
+	std::vector<uint32_t> rowStart, prevRowStart;
+
+	/// Union-find over the runs of the current slice
+	std::vector<uint32_t> localParent;
+	std::vector<uint32_t> localLabel;
+
+	/// Union-find over labels, and per label voxel count / whether it touches the volume bounds / whether it holds marked voxels; only maintained while recording
+	std::vector<uint32_t> parent;
+	std::vector<uint64_t> sizes;
+	std::vector<bool> boundary;
+	std::vector<bool> marked;
+	uint32_t labelCount = 0;
+
+	/// Budget reservation for the label arrays, grown a chunk of labels at a time along with their capacity
+	MemoryBudget::Reservation labelMemory{ &MemoryBudget::Current(), 0 };
+	size_t labelCapacity = 0;
+
+	bool reserveLabels(size_t count);
+	uint32_t findLocal(uint32_t r);
+	void unionLocal(uint32_t a, uint32_t b);
+	void unionLabels(uint32_t a, uint32_t b);
+
+public:
+
+	/// Starts labelling a new volume, forgetting any labels
+	void reset(size_t width, size_t height, size_t depth);
+
+	/// Starts again from slice 0, keeping the labels and merges recorded so far; replaying the same slices assigns the same labels
+	void rewind();
+
+	/// Labels the runs of the next slice; with record, merges between labels and their sizes are recorded, along with which labels overlap marks (if given)
+	/// Returns false if labels run out, or the label arrays don't fit in the memory budget
+	bool labelSlice(const BitSlice& mask, bool record, const BitSlice* marks = nullptr);
+
+	/// Runs of the slice last labelled, and the z of the next slice to label
+	inline const std::vector<Run>& getRuns() const { return runs; }
+	inline size_t getNextZ() const { return nextZ; }
+
+	/// Number of labels started so far
+	inline uint32_t getLabelCount() const { return labelCount; }
+
+	/// Returns the label representing the whole component label belongs to (after recording)
+	uint32_t find(uint32_t label);
+
+	/// Voxel count / volume bounds contact of the component represented by root
+	inline uint64_t getSize(uint32_t root) const { return sizes[root]; }
+	inline bool touchesBoundary(uint32_t root) const { return boundary[root]; }
+	inline bool isMarked(uint32_t root) const { return marked[root]; }
+
+	/// Adds up sizes, boundary contact and marks onto each component's root; call once after recording all slices
+	void finalise();
+};
+
+
+/// Limits on the components kept by a ComponentFilter; a component is kept if it satisfies all of them
+struct ComponentParams {
+
+	/// Keep only the N largest components; 0 to keep all of them
+	size_t keepLargest = 0;
+
+	/// Keep only components of at least this many voxels
+	size_t minVoxels = 0;
+
+	/// Keep only components that don't touch the volume bounds; keepLargest then ranks these alone
+	bool enclosedOnly = false;
+
+	/// Keep only components holding at least one voxel of the filter's marks; keepLargest then ranks these alone
+	bool markedOnly = false;
+};
+
+
+/// Mask of the connected components of another mask that satisfy ComponentParams, computed in two streaming passes
+/// The first pass (analyse) labels the whole source and sizes components; slices are then labelled again on demand, in the same order, to filter them
+/// Slices must be read in increasing z order; stepping back restarts the second pass from slice 0
+/// With marks (another mask over the same volume, only read by analyse), components can be selected by whether they overlap them: with marks above a high threshold over
+/// a mask above a low one, this is hysteresis thresholding
+class ComponentFilter : public MaskSource {
+public:
+
+	struct Component {
+		uint32_t label;
+		uint64_t voxels;
+		bool boundary;
+		bool marked;
+	};
+
+private:
+
+	MaskSource& source;
+	MaskSource* marks;
+	ComponentParams params;
+	ComponentLabeller labeller;
+	MemoryBudget::Reservation memory{ &MemoryBudget::Current(), 0 };
+
+	/// All components, largest first, and whether each label belongs to a kept component
+	std::vector<Component> components;
+	std::vector<bool> keep;
+
+	/// Upstream slice buffers and last slice produced
+	BitSlice input, inputMarks, output;
+	bool hasOutput = false;
+
+public:
+	ComponentFilter(MaskSource& source, const ComponentParams& params, MaskSource* marks = nullptr);
+
+	/// Labels the entire source, needs to be called once before reading masks
+	bool analyse();
+
+	/// Components found by analyse, largest first, and the number of them that are kept
+	inline const std::vector<Component>& getComponents() const { return components; }
+	size_t getKeptCount() const;
+	inline bool isKept(const Component& component) const { return keep[component.label]; }
+
+	/// Prints the largest components, and writes all component sizes out as csv if filename isn't empty
+	bool report(std::string filename) const;
+
+	size_t getWidth() const override { return source.getWidth(); }
+	size_t getHeight() const override { return source.getHeight(); }
+	size_t getDepth() const override { return source.getDepth(); }
+
+	bool readMask(size_t z, BitSlice& out) override;
+};
@@ -0,0 +1,436 @@
+#include "Decimator.h"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "colours.h"
+#include "ObjModel.h"
+
+
+namespace {
+
+	/// Symmetric 4x4 matrix accumulating squared distances to a set of planes, stored as its upper triangle
+	struct Quadric {
+		double m[10] = {};
+
+		/// Quadric of the plane ax + by + cz + d = 0, with {a, b, c} normalised
+		static inline Quadric fromPlane(double a, double b, double c, double d) {
+			Quadric q;
+			q.m[0] = a * a; q.m[1] = a * b; q.m[2] = a * c; q.m[3] = a * d;
+			q.m[4] = b * b; q.m[5] = b * c; q.m[6] = b * d;
+			q.m[7] = c * c; q.m[8] = c * d;
+			q.m[9] = d * d;
+			return q;
+		}
+
+		inline Quadric operator+(const Quadric& other) const {
+			Quadric q;
+			for (int i = 0; i < 10; ++i) q.m[i] = m[i] + other.m[i];
+			return q;
+		}
+		inline Quadric& operator+=(const Quadric& other) {
+			for (int i = 0; i < 10; ++i) m[i] += other.m[i];
+			return *this;
+		}
+
+		/// Sum of squared distances from {x, y, z} to the planes
+		inline double evaluate(double x, double y, double z) const {
+			return m[0] * x * x + 2 * m[1] * x * y + 2 * m[2] * x * z + 2 * m[3] * x
+				 + m[4] * y * y + 2 * m[5] * y * z + 2 * m[6] * y
+				 + m[7] * z * z + 2 * m[8] * z
+				 + m[9];
+		}
+
+		/// Finds the point minimising the error; returns false when the planes don't constrain it to a single point
+		inline bool minimise(double& x, double& y, double& z) const {
+			auto det3 = [](double a, double b, double c, double d, double e, double f, double g, double h, double i) {
+				return a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
+			};
+			const double det = det3(m[0], m[1], m[2], m[1], m[4], m[5], m[2], m[5], m[7]);
+			if (std::abs(det) < 1e-6) return false;
+			const double bx = -m[3], by = -m[6], bz = -m[8];
+			x = det3(bx, m[1], m[2], by, m[4], m[5], bz, m[5], m[7]) / det;
+			y = det3(m[0], bx, m[2], m[1], by, m[5], m[2], bz, m[7]) / det;
+			z = det3(m[0], m[1], bx, m[1], m[4], by, m[2], m[5], bz) / det;
+			return true;
+		}
+	};
+
+	/// Cheapest known collapse for a vertex; only valid while the vertex's stamp matches
+	struct Candidate {
+		float cost;
+		uint32_t vertex, other, stamp;
+		inline bool operator>(const Candidate& c) const { return cost > c.cost; }
+	};
+
+	struct double3 {
+		double x, y, z;
+		inline double3 operator-(const double3& o) const { return { x - o.x, y - o.y, z - o.z }; }
+		inline double3 cross(const double3& o) const { return { y * o.z - z * o.y, z * o.x - x * o.z, x * o.y - y * o.x }; }
+		inline double dot(const double3& o) const { return x * o.x + y * o.y + z * o.z; }
+	};
+
+	/// Edge collapse simplifier working in place on an ObjModel's positions and position indices
+	/// Memory is a quadric, a stamp and a triangle list range per vertex, a flag per triangle, and a heap of at most a few entries per vertex
+	class Decimator {
+
+		std::vector<float>& positions;
+		std::vector<uint32_t>& tris;
+		const size_t vertexCount;
+		size_t liveTris;
+
+		std::vector<Quadric> quadrics;
+		std::vector<uint32_t> stamps;
+		std::vector<bool> removedVertices, removedTris;
+
+		/// Triangles around each vertex are refs[refStart[v] .. refStart[v] + refCount[v]), and may include removed triangles
+		/// Collapses append the surviving vertex's new list at the end; refs gets compacted once it has doubled
+		std::vector<uint32_t> refStart, refCount, refs;
+		size_t compactRefsSize;
+
+		/// Min-heap of candidates
+		std::vector<Candidate> heap;
+
+		/// Scratch buffers
+		std::vector<uint32_t> ringA, ringB, candidateRing, collapseRing;
+		std::vector<std::pair<double, uint32_t>> candidateCosts;
+
+		inline double3 position(uint32_t v) const { return { positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2] }; }
+
+		/// Rebuilds the triangle lists of all vertices from the live triangles
+		void buildRefs() {
+			refStart.assign(vertexCount, 0);
+			refCount.assign(vertexCount, 0);
+			for (size_t t = 0, s = tris.size() / 3; t < s; ++t) {
+				if (removedTris[t]) continue;
+				for (int i = 0; i < 3; ++i) ++refCount[tris[t * 3 + i]];
+			}
+			uint32_t offset = 0;
+			for (size_t v = 0; v < vertexCount; ++v) {
+				refStart[v] = offset;
+				offset += refCount[v];
+				refCount[v] = 0;
+			}
+			refs.assign(offset, 0);
+			for (size_t t = 0, s = tris.size() / 3; t < s; ++t) {
+				if (removedTris[t]) continue;
+				for (int i = 0; i < 3; ++i) {
+					uint32_t v = tris[t * 3 + i];
+					refs[refStart[v] + refCount[v]++] = (uint32_t)t;
+				}
+			}
+			compactRefsSize = refs.size();
+		}
+
+		/// Collects the distinct vertices sharing a live triangle with v, excluding v itself
+		/// Returns whether every edge around v is shared by exactly two triangles
+		bool gatherRing(uint32_t v, std::vector<uint32_t>& ring) const {
+			ring.clear();
+			for (uint32_t i = refStart[v], e = refStart[v] + refCount[v]; i < e; ++i) {
+				const uint32_t t = refs[i];
+				if (removedTris[t]) continue;
+				for (int k = 0; k < 3; ++k) {
+					if (tris[t * 3 + k] != v) ring.push_back(tris[t * 3 + k]);
+				}
+			}
+			std::sort(ring.begin(), ring.end());
+			bool manifold = true;
+			size_t unique = 0;
+			for (size_t i = 0; i < ring.size();) {
+				size_t j = i;
+				while (j < ring.size() && ring[j] == ring[i]) ++j;
+				manifold = manifold && j - i == 2;
+				ring[unique++] = ring[i];
+				i = j;
+			}
+			ring.resize(unique);
+			return manifold;
+		}
+
+		/// Computes where collapsing edge {a, b} should place the merged vertex, and the error it introduces
+		double evaluate(uint32_t a, uint32_t b, double3& p) const {
+			const Quadric q = quadrics[a] + quadrics[b];
+			const double3 pa = position(a), pb = position(b);
+			const double3 mid = { (pa.x + pb.x) * 0.5, (pa.y + pb.y) * 0.5, (pa.z + pb.z) * 0.5 };
+
+			// Optimal placement, unless the planes are (nearly) degenerate and it would land far off the edge
+			if (q.minimise(p.x, p.y, p.z)) {
+				const double3 offset = p - mid, edge = pb - pa;
+				if (offset.dot(offset) <= edge.dot(edge)) {
+					return std::max(0.0, q.evaluate(p.x, p.y, p.z));
+				}
+			}
+			double best = -1.0;
+			for (const double3& c : { pa, pb, mid }) {
+				double cost = std::max(0.0, q.evaluate(c.x, c.y, c.z));
+				if (best < 0.0 || cost < best) {
+					best = cost;
+					p = c;
+				}
+			}
+			return best;
+		}
+
+		/// Returns whether collapsing edge {a, b} to p keeps the surface manifold and doesn't fold any face over
+		bool isValid(uint32_t a, uint32_t b, const double3& p) {
+
+			// All edges around both endpoints must be shared by exactly two faces, and the endpoints must have exactly the two opposite vertices as common neighbours
+			if (!gatherRing(a, ringA) || !gatherRing(b, ringB)) return false;
+			size_t common = 0;
+			for (size_t i = 0, j = 0; i < ringA.size() && j < ringB.size();) {
+				if (ringA[i] < ringB[j]) ++i;
+				else if (ringA[i] > ringB[j]) ++j;
+				else { ++common; ++i; ++j; }
+			}
+			if (common != 2) return false;
+
+			// Faces that survive the collapse must not flip or become degenerate
+			for (uint32_t moved : { a, b }) {
+				const uint32_t other = moved == a ? b : a;
+				for (uint32_t i = refStart[moved], e = refStart[moved] + refCount[moved]; i < e; ++i) {
+					const uint32_t t = refs[i];
+					if (removedTris[t]) continue;
+					const uint32_t* tri = &tris[t * 3];
+					if (tri[0] == other || tri[1] == other || tri[2] == other) continue;
+					double3 corners[3] = { position(tri[0]), position(tri[1]), position(tri[2]) };
+					const double3 before = (corners[1] - corners[0]).cross(corners[2] - corners[0]);
+					for (int k = 0; k < 3; ++k) {
+						if (tri[k] == moved) corners[k] = p;
+					}
+					const double3 after = (corners[1] - corners[0]).cross(corners[2] - corners[0]);
+					const double lengths = std::sqrt(before.dot(before) * after.dot(after));
+					if (lengths <= 0.0 || before.dot(after) < 0.2 * lengths) return false;
+				}
+			}
+			return true;
+		}
+
+		/// Pushes the cheapest collapse for v, invalidating any earlier candidate for it; with validate, skips over invalid collapses
+		void pushCandidate(uint32_t v, bool validate) {
+			++stamps[v];
+			gatherRing(v, candidateRing);
+			candidateCosts.clear();
+			for (uint32_t u : candidateRing) {
+				double3 p;
+				candidateCosts.emplace_back(evaluate(v, u, p), u);
+			}
+			if (validate) {
+				std::sort(candidateCosts.begin(), candidateCosts.end());
+			} else if (!candidateCosts.empty()) {
+				std::iter_swap(candidateCosts.begin(), std::min_element(candidateCosts.begin(), candidateCosts.end()));
+				candidateCosts.resize(1);
+			}
+			for (const auto& cost : candidateCosts) {
+				if (validate) {
+					double3 p;
+					evaluate(v, cost.second, p);
+					if (!isValid(v, cost.second, p)) continue;
+				}
+				heap.push_back({ (float)cost.first, v, cost.second, stamps[v] });
+				std::push_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+				return;
+			}
+		}
+
+		/// Merges b into a, placing a at p
+		void collapse(uint32_t a, uint32_t b, const double3& p) {
+			positions[a * 3] = (float)p.x;
+			positions[a * 3 + 1] = (float)p.y;
+			positions[a * 3 + 2] = (float)p.z;
+			quadrics[a] += quadrics[b];
+
+			// a's new triangle list: its own faces minus the two collapsed ones, plus b's other faces now pointing to a
+			const uint32_t start = (uint32_t)refs.size();
+			for (uint32_t i = refStart[a], e = refStart[a] + refCount[a]; i < e; ++i) {
+				const uint32_t t = refs[i];
+				if (removedTris[t]) continue;
+				uint32_t* tri = &tris[t * 3];
+				if (tri[0] == b || tri[1] == b || tri[2] == b) {
+					removedTris[t] = true;
+					--liveTris;
+				} else {
+					refs.push_back(t);
+				}
+			}
+			for (uint32_t i = refStart[b], e = refStart[b] + refCount[b]; i < e; ++i) {
+				const uint32_t t = refs[i];
+				if (removedTris[t]) continue;
+				uint32_t* tri = &tris[t * 3];
+				for (int k = 0; k < 3; ++k) {
+					if (tri[k] == b) tri[k] = a;
+				}
+				refs.push_back(t);
+			}
+			refStart[a] = start;
+			refCount[a] = (uint32_t)refs.size() - start;
+			removedVertices[b] = true;
+			refCount[b] = 0;
+
+			if (refs.size() > 2 * compactRefsSize) {
+				buildRefs();
+			}
+
+			// The costs of all edges around a changed
+			gatherRing(a, collapseRing);
+			pushCandidate(a, false);
+			for (uint32_t v : collapseRing) {
+				pushCandidate(v, false);
+			}
+		}
+
+		/// Drops stale candidates once the heap grows too large
+		void pruneHeap() {
+			heap.erase(std::remove_if(heap.begin(), heap.end(), [this](const Candidate& c) {
+				return removedVertices[c.vertex] || stamps[c.vertex] != c.stamp;
+			}), heap.end());
+			std::make_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+		}
+
+	public:
+
+		Decimator(ObjModel& model) : positions(model.positions), tris(model.positionIndices), vertexCount(model.positions.size() / 3), liveTris(model.positionIndices.size() / 3) {}
+
+		void run(const DecimateParams& params, double maxCost) {
+			removedVertices.assign(vertexCount, false);
+			removedTris.assign(liveTris, false);
+			stamps.assign(vertexCount, 0);
+			buildRefs();
+
+			// Accumulate the planes of the faces around each vertex
+			quadrics.assign(vertexCount, Quadric());
+			for (size_t t = 0, s = tris.size() / 3; t < s; ++t) {
+				const double3 p0 = position(tris[t * 3]), p1 = position(tris[t * 3 + 1]), p2 = position(tris[t * 3 + 2]);
+				double3 n = (p1 - p0).cross(p2 - p0);
+				const double length = std::sqrt(n.dot(n));
+				if (length <= 0.0) continue;
+				n = { n.x / length, n.y / length, n.z / length };
+				const Quadric q = Quadric::fromPlane(n.x, n.y, n.z, -n.dot(p0));
+				for (int i = 0; i < 3; ++i) quadrics[tris[t * 3 + i]] += q;
+			}
+
+			for (uint32_t v = 0; v < vertexCount; ++v) {
+				pushCandidate(v, false);
+			}
+
+			// Report every tenth of the triangles removed
+			const size_t initialTris = liveTris;
+			const size_t reportStep = std::max<size_t>(initialTris / 10, 1);
+			size_t nextReport = initialTris > reportStep ? initialTris - reportStep : 0;
+			while (liveTris > params.targetTriangles && !heap.empty()) {
+				std::pop_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+				const Candidate c = heap.back();
+				heap.pop_back();
+				if (removedVertices[c.vertex] || stamps[c.vertex] != c.stamp) continue;
+				if (removedVertices[c.other]) {
+					pushCandidate(c.vertex, false);
+					continue;
+				}
+				if (maxCost > 0.0 && c.cost > maxCost) break; // every remaining collapse is at least as expensive
+
+				double3 p;
+				evaluate(c.vertex, c.other, p);
+				if (!isValid(c.vertex, c.other, p)) {
+					pushCandidate(c.vertex, true);
+					continue;
+				}
+				collapse(c.vertex, c.other, p);
+
+				if (heap.size() > 4 * vertexCount) {
+					pruneHeap();
+				}
+				if (liveTris <= nextReport) {
+					printf("Decimating: %zu of %zu triangles left\n", liveTris, initialTris);
+					nextReport = liveTris > reportStep ? liveTris - reportStep : 0;
+				}
+			}
+		}
+
+		/// Number of triangles left
+		inline size_t getTriangleCount() const { return liveTris; }
+
+		/// Drops removed faces and unreferenced vertices, keeping the original order of everything else
+		void compact(std::vector<float>& newPositions, std::vector<uint32_t>& newTris) {
+			std::vector<uint32_t> remap(vertexCount, ObjModel::NO_INDEX);
+			newTris.reserve(liveTris * 3);
+			for (size_t t = 0, s = tris.size() / 3; t < s; ++t) {
+				if (removedTris[t]) continue;
+				for (int i = 0; i < 3; ++i) {
+					remap[tris[t * 3 + i]] = 0;
+				}
+			}
+			uint32_t next = 0;
+			for (size_t v = 0; v < vertexCount; ++v) {
+				if (remap[v] == ObjModel::NO_INDEX) continue;
+				remap[v] = next++;
+				newPositions.insert(newPositions.end(), &positions[v * 3], &positions[v * 3 + 3]);
+			}
+			for (size_t t = 0, s = tris.size() / 3; t < s; ++t) {
+				if (removedTris[t]) continue;
+				for (int i = 0; i < 3; ++i) {
+					newTris.push_back(remap[tris[t * 3 + i]]);
+				}
+			}
+		}
+	};
+
+}
+
+
+bool decimator::simplify(ObjModel& model, const DecimateParams& params) {
+
+	if (model.positionIndices.size() % 3 != 0) {
+		printf(RED "Cannot decimate a model whose index count (%zu) is not a multiple of 3.\n" WHITE, model.positionIndices.size());
+		return false;
+	}
+	const size_t initialTris = model.positionIndices.size() / 3;
+
+	// Normals get recomputed at the end, free them up front
+	model.normals = std::vector<float>();
+	model.normalIndices = std::vector<uint32_t>();
+
+	// Positions are unscaled until written out, so the error limit is brought back to the same units
+	const double maxDistance = params.maxError / (model.scale != 0.0f ? model.scale : 1.0f);
+	std::vector<float> positions;
+	std::vector<uint32_t> tris;
+	{
+		Decimator decimator(model);
+		decimator.run(params, maxDistance * maxDistance);
+		decimator.compact(positions, tris);
+	}
+	model.positions = std::move(positions);
+	model.positionIndices = std::move(tris);
+
+	// Smooth per-vertex normals, weighted by face area
+	std::vector<float>& normals = model.normals;
+	normals.assign(model.positions.size(), 0.0f);
+	for (size_t i = 0, s = model.positionIndices.size(); i < s; i += 3) {
+		const uint32_t* tri = &model.positionIndices[i];
+		const float* p0 = &model.positions[tri[0] * 3];
+		const float* p1 = &model.positions[tri[1] * 3];
+		const float* p2 = &model.positions[tri[2] * 3];
+		const float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		const float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		const float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+		for (int k = 0; k < 3; ++k) {
+			for (int c = 0; c < 3; ++c) normals[tri[k] * 3 + c] += n[c];
+		}
+	}
+	for (size_t i = 0, s = normals.size(); i < s; i += 3) {
+		const float length = std::sqrt(normals[i] * normals[i] + normals[i + 1] * normals[i + 1] + normals[i + 2] * normals[i + 2]);
+		if (length > 0.0f) {
+			for (int c = 0; c < 3; ++c) normals[i + c] /= length;
+		}
+	}
+	model.normalIndices = model.positionIndices;
+
+	// Lookups of the original vertices no longer apply
+	model.knownPositions.clear();
+	model.knownNormals.clear();
+	std::fill(std::begin(model.directionNormals), std::end(model.directionNormals), ObjModel::NO_INDEX);
+	model.setLatticeSize(0, 0);
+
+	printf("Decimated %zu triangles down to %zu.\n", initialTris, model.positionIndices.size() / 3);
+	return true;
+}
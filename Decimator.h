@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+
+struct ObjModel;
+
+
+/// Parameters driving mesh simplification; collapses stop as soon as either limit is reached
+struct DecimateParams {
+
+	/// Number of triangles to reduce the mesh down to; 0 for no target
+	size_t targetTriangles = 0;
+
+	/// Maximum error a collapse may introduce, as a distance (in output units) to the planes of the original faces; 0 for no limit
+	float maxError = 0.0f;
+
+	inline bool enabled() const { return targetTriangles > 0 || maxError > 0.0f; }
+};
+
+
+namespace decimator {
+
+	/// Simplifies the model in place with quadric error edge collapses, cheapest first, working directly on its index buffers
+	/// Only manifold edges are collapsed and collapses flipping faces are rejected; normals are replaced by smooth per-vertex normals
+	bool simplify(ObjModel& model, const DecimateParams& params);
+
+}
@@ -0,0 +1,192 @@
+#include "DistanceTransform.h"
+
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <mutex>
+#include <algorithm>
+
+#include "MaskSource.h"
+#include "ThreadPool.h"
+#include "colours.h"
+
+
+/// Lower envelope of parabolas: out[i] = min over j of (f[j] + (i - j)^2), where f is 0 just outside [0, n)
+/// sites and bounds are scratch buffers, resized as needed
+static void distanceEnvelope(const uint32_t* f, uint32_t* out, size_t n, std::vector<long long>& sites, std::vector<double>& bounds) {
+	sites.resize(n + 2);
+	bounds.resize(n + 3);
+	auto value = [&](long long j) -> long long { return j < 0 || j >= (long long)n ? 0 : f[j]; };
+
+	// Sites -1 and n are the voxels outside the volume; site -1 can never be hidden, as its bound is -infinity
+	size_t k = 0;
+	sites[0] = -1;
+	bounds[0] = -std::numeric_limits<double>::infinity();
+	bounds[1] = std::numeric_limits<double>::infinity();
+	for (long long q = 0; q <= (long long)n; ++q) {
+		const long long fq = value(q) + q * q;
+		double s;
+		while (true) {
+			const long long v = sites[k];
+			s = double(fq - (value(v) + v * v)) / double(2 * (q - v));
+			if (s > bounds[k]) break;
+			--k;
+		}
+		++k;
+		sites[k] = q;
+		bounds[k] = s;
+		bounds[k + 1] = std::numeric_limits<double>::infinity();
+	}
+
+	k = 0;
+	for (size_t i = 0; i < n; ++i) {
+		while (bounds[k + 1] < (double)i) ++k;
+		const long long d = (long long)i - sites[k];
+		out[i] = (uint32_t)(d * d + value(sites[k]));
+	}
+}
+
+
+DistanceMap::DistanceMap(MaskSource& mask, std::string scratchFilename, size_t memoryBudget) :
+	mask(&mask), width(mask.getWidth()), height(mask.getHeight()), depth(mask.getDepth()), scratchFilename(scratchFilename) {
+	bandRows = std::max<size_t>(1, std::min(height, memoryBudget / std::max<size_t>(1, width * depth * sizeof(uint32_t))));
+}
+
+DistanceMap::~DistanceMap() {
+	if (scratch.is_open()) {
+		scratch.close();
+		std::remove(scratchFilename.c_str());
+	}
+}
+
+std::streamoff DistanceMap::offsetOf(size_t y, size_t z) const {
+	const size_t bandBegin = (y / bandRows) * bandRows;
+	const size_t rows = std::min(bandRows, height - bandBegin);
+	return (std::streamoff)((bandBegin * depth + z * rows + (y - bandBegin)) * width) * sizeof(uint32_t);
+}
+
+bool DistanceMap::compute() {
+	scratch.open(scratchFilename, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+	if (!scratch.is_open()) {
+		printf(RED "Cannot create scratch file %s.\n" WHITE, scratchFilename.c_str());
+		return false;
+	}
+
+	ThreadPool& pool = ThreadPool::Global();
+	const size_t bandCount = (height + bandRows - 1) / bandRows;
+	BitSlice slice;
+	squared.resize(width * height);
+
+	// Along X and Y, one slice at a time; along X the distance is to either end of the run the voxel is in
+	for (size_t z = 0; z < depth; ++z) {
+		if (!mask->readMask(z, slice)) {
+			return false;
+		}
+		pool.parallelFor(0, height, 16, [&](size_t yBegin, size_t yEnd) {
+			for (size_t y = yBegin; y < yEnd; ++y) {
+				uint32_t* row = &squared[y * width];
+				std::fill(row, row + width, 0);
+				slice.forEachRun(y, [&](size_t xBegin, size_t xEnd) {
+					for (size_t x = xBegin; x < xEnd; ++x) {
+						const uint32_t d = (uint32_t)std::min(x - xBegin + 1, xEnd - x);
+						row[x] = d * d;
+					}
+				});
+			}
+		});
+		pool.parallelFor(0, width, 16, [&](size_t xBegin, size_t xEnd) {
+			std::vector<uint32_t> column(height), result(height);
+			std::vector<long long> sites;
+			std::vector<double> bounds;
+			for (size_t x = xBegin; x < xEnd; ++x) {
+				for (size_t y = 0; y < height; ++y) column[y] = squared[y * width + x];
+				distanceEnvelope(column.data(), result.data(), height, sites, bounds);
+				for (size_t y = 0; y < height; ++y) squared[y * width + x] = result[y];
+			}
+		});
+
+		for (size_t band = 0; band < bandCount; ++band) {
+			const size_t yBegin = band * bandRows, rows = std::min(bandRows, height - yBegin);
+			scratch.seekp(offsetOf(yBegin, z));
+			scratch.write((const char*)&squared[yBegin * width], (std::streamsize)(rows * width * sizeof(uint32_t)));
+		}
+		if (!scratch) {
+			printf(RED "Cannot write to scratch file %s.\n" WHITE, scratchFilename.c_str());
+			return false;
+		}
+	}
+
+	// Along Z, one band of rows at a time
+	std::vector<uint32_t> band;
+	std::mutex maxMutex;
+	maxSquared = 0;
+	for (size_t b = 0; b < bandCount; ++b) {
+		const size_t yBegin = b * bandRows, rows = std::min(bandRows, height - yBegin);
+		const size_t columns = rows * width;
+		band.resize(columns * depth);
+		scratch.seekg(offsetOf(yBegin, 0));
+		scratch.read((char*)band.data(), (std::streamsize)(band.size() * sizeof(uint32_t)));
+		if (!scratch) {
+			printf(RED "Cannot read from scratch file %s.\n" WHITE, scratchFilename.c_str());
+			return false;
+		}
+
+		pool.parallelFor(0, columns, 256, [&](size_t cBegin, size_t cEnd) {
+			std::vector<uint32_t> column(depth), result(depth);
+			std::vector<long long> sites;
+			std::vector<double> bounds;
+			uint32_t chunkMax = 0;
+			for (size_t c = cBegin; c < cEnd; ++c) {
+				for (size_t z = 0; z < depth; ++z) column[z] = band[z * columns + c];
+				distanceEnvelope(column.data(), result.data(), depth, sites, bounds);
+				for (size_t z = 0; z < depth; ++z) {
+					band[z * columns + c] = result[z];
+					chunkMax = std::max(chunkMax, result[z]);
+				}
+			}
+			std::lock_guard<std::mutex> lock(maxMutex);
+			maxSquared = std::max(maxSquared, chunkMax);
+		});
+
+		scratch.seekp(offsetOf(yBegin, 0));
+		scratch.write((const char*)band.data(), (std::streamsize)(band.size() * sizeof(uint32_t)));
+		if (!scratch) {
+			printf(RED "Cannot write to scratch file %s.\n" WHITE, scratchFilename.c_str());
+			return false;
+		}
+	}
+	scratch.flush();
+	return true;
+}
+
+float DistanceMap::getMaxDistance() const {
+	return std::sqrt((float)maxSquared);
+}
+
+bool DistanceMap::readSquared(size_t z, uint32_t* out) {
+	if (!scratch.is_open() || z >= depth) {
+		printf(RED "Cannot read distance slice %zu; the distance map has not been computed.\n" WHITE, z);
+		return false;
+	}
+	for (size_t yBegin = 0; yBegin < height; yBegin += bandRows) {
+		const size_t rows = std::min(bandRows, height - yBegin);
+		scratch.seekg(offsetOf(yBegin, z));
+		scratch.read((char*)&out[yBegin * width], (std::streamsize)(rows * width * sizeof(uint32_t)));
+	}
+	if (!scratch) {
+		printf(RED "Cannot read from scratch file %s.\n" WHITE, scratchFilename.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool DistanceMap::readSlice(size_t z, float* out) {
+	squared.resize(width * height);
+	if (!readSquared(z, squared.data())) {
+		return false;
+	}
+	for (size_t i = 0; i < width * height; ++i) {
+		out[i] = std::sqrt((float)squared[i]);
+	}
+	return true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+
+#include "SliceSource.h"
+
+class MaskSource;
+
+
+/// Exact Euclidean distance from each voxel of a mask to the centre of the nearest voxel outside of it (0 outside); voxels beyond the volume count as outside
+/// Computed out of core with separable passes (Felzenszwalb & Huttenlocher): along X and Y one slice at a time, then along Z through a scratch file
+/// The scratch file is split into bands of rows, each holding all slices of its rows contiguously, so that a band's columns can be processed in memory
+class DistanceMap : public SliceSource {
+
+	MaskSource* mask;
+	size_t width, height, depth;
+
+	/// Scratch file holding squared distances, removed once the map is destroyed
+	std::string scratchFilename;
+	std::fstream scratch;
+
+	/// Number of rows per band, sized to the memory budget
+	size_t bandRows;
+
+	uint32_t maxSquared = 0;
+	std::vector<uint32_t> squared;
+
+	/// Byte offset of row y of slice z in the scratch file
+	std::streamoff offsetOf(size_t y, size_t z) const;
+
+public:
+
+	/// memoryBudget is the number of bytes a band of rows may take while computing the Z pass
+	DistanceMap(MaskSource& mask, std::string scratchFilename, size_t memoryBudget = size_t(512) << 20);
+	virtual ~DistanceMap();
+
+	/// Runs both passes over the mask; must be called before reading slices
+	bool compute();
+
+	/// Largest distance found, in voxels
+	float getMaxDistance() const;
+
+	size_t getWidth() const override { return width; }
+	size_t getHeight() const override { return height; }
+	size_t getDepth() const override { return depth; }
+
+	/// Fills out with the width x height squared distances of slice z
+	bool readSquared(size_t z, uint32_t* out);
+
+	bool readSlice(size_t z, float* out) override;
+};
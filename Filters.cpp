@@ -0,0 +1,176 @@
+#include "Filters.h"
+
+#include <cmath>
+
+
+/// Writes row to dst, extended by radius copies of its first and last values on either side
+static void padRow(const float* row, size_t width, size_t radius, float* dst) {
+	std::fill(dst, dst + radius, row[0]);
+	std::copy(row, row + width, dst + radius);
+	std::fill(dst + radius + width, dst + 2 * radius + width, row[width - 1]);
+}
+
+
+GaussianFilter::GaussianFilter(SliceSource& source, float sigma) :
+	source(&source), sigma(sigma), radius(sigma > 0.0f ? (size_t)std::ceil(3.0f * sigma) : 0),
+	ring(source.getWidth() * source.getHeight(), source.getDepth(), radius) {
+	weights.resize(2 * radius + 1);
+	float total = 0.0f;
+	for (size_t i = 0; i < weights.size(); ++i) {
+		const float d = (float)i - (float)radius;
+		weights[i] = radius > 0 ? std::exp(-d * d / (2.0f * sigma * sigma)) : 1.0f;
+		total += weights[i];
+	}
+	for (float& w : weights) w /= total;
+}
+
+bool GaussianFilter::readSlice(size_t z, float* out) {
+	const size_t width = getWidth(), height = getHeight();
+	const long long r = (long long)radius;
+	const bool loaded = ring.load(z, [&](size_t inputZ, float* dst) {
+		input.resize(width * height);
+		rows.resize(width * height);
+		padded.resize(width + 2 * radius);
+		if (!source->readSlice(inputZ, input.data())) {
+			return false;
+		}
+
+		// Along X, as a sum of shifted copies of each padded row
+		for (size_t y = 0; y < height; ++y) {
+			padRow(&input[y * width], width, radius, padded.data());
+			float* row = &rows[y * width];
+			std::fill(row, row + width, 0.0f);
+			for (size_t k = 0; k < weights.size(); ++k) {
+				const float w = weights[k];
+				const float* shifted = &padded[k];
+				for (size_t x = 0; x < width; ++x) row[x] += w * shifted[x];
+			}
+		}
+
+		// Along Y, as a sum of whole neighbouring rows
+		for (size_t y = 0; y < height; ++y) {
+			float* row = &dst[y * width];
+			std::fill(row, row + width, 0.0f);
+			for (size_t k = 0; k < weights.size(); ++k) {
+				const float w = weights[k];
+				const long long neighbour = std::min(std::max((long long)y + (long long)k - r, 0LL), (long long)height - 1);
+				const float* from = &rows[(size_t)neighbour * width];
+				for (size_t x = 0; x < width; ++x) row[x] += w * from[x];
+			}
+		}
+		return true;
+	});
+	if (!loaded) {
+		return false;
+	}
+
+	// Along Z, over the ring of filtered slices
+	const size_t size = width * height;
+	std::fill(out, out + size, 0.0f);
+	for (size_t k = 0; k < weights.size(); ++k) {
+		const float w = weights[k];
+		const float* from = ring.get(z, (long long)k - r);
+		for (size_t i = 0; i < size; ++i) out[i] += w * from[i];
+	}
+	return true;
+}
+
+SliceSource* GaussianFilter::clone() const {
+	SliceSource* sourceClone = source->clone();
+	if (!sourceClone) return nullptr;
+	GaussianFilter* stage = new GaussianFilter(*sourceClone, sigma);
+	stage->ownedSource.reset(sourceClone);
+	return stage;
+}
+
+
+MedianFilter::MedianFilter(SliceSource& source, size_t radius) :
+	source(&source), radius(radius),
+	ring((source.getWidth() + 2 * radius) * source.getHeight(), source.getDepth(), radius) {}
+
+bool MedianFilter::readSlice(size_t z, float* out) {
+	if (radius == 0) {
+		return source->readSlice(z, out);
+	}
+	const size_t width = getWidth(), height = getHeight();
+	const size_t paddedWidth = width + 2 * radius;
+	const long long r = (long long)radius;
+	const bool loaded = ring.load(z, [&](size_t inputZ, float* dst) {
+		input.resize(width * height);
+		if (!source->readSlice(inputZ, input.data())) {
+			return false;
+		}
+		for (size_t y = 0; y < height; ++y) {
+			padRow(&input[y * width], width, radius, &dst[y * paddedWidth]);
+		}
+		return true;
+	});
+	if (!loaded) {
+		return false;
+	}
+
+	// Forgetful selection keeps half of the box plus 2 values, in slots of CHUNK voxels of a row
+	constexpr size_t CHUNK = 256;
+	const size_t k = 2 * radius + 1;
+	const size_t n = k * k * k;
+	const size_t kept = n / 2 + 2;
+	taps.resize(n);
+	work.resize(kept * CHUNK);
+	for (size_t y = 0; y < height; ++y) {
+
+		// Each value of the box around the voxels of the row is a padded input row, shifted along X
+		size_t t = 0;
+		for (long long dz = -r; dz <= r; ++dz) {
+			const float* slice = ring.get(z, dz);
+			for (long long dy = -r; dy <= r; ++dy) {
+				const long long neighbour = std::min(std::max((long long)y + dy, 0LL), (long long)height - 1);
+				const float* row = &slice[(size_t)neighbour * paddedWidth];
+				for (size_t dx = 0; dx < k; ++dx) taps[t++] = row + dx;
+			}
+		}
+
+		for (size_t x0 = 0; x0 < width; x0 += CHUNK) {
+			const size_t len = std::min(CHUNK, width - x0);
+			for (size_t s = 0; s < kept; ++s) {
+				std::copy(taps[s] + x0, taps[s] + x0 + len, &work[s * CHUNK]);
+			}
+			for (size_t count = kept, next = kept;; --count) {
+
+				// Minimum to the first slot, then maximum to the last one
+				float* first = &work[0];
+				float* last = &work[(count - 1) * CHUNK];
+				for (size_t s = 1; s < count; ++s) {
+					float* other = &work[s * CHUNK];
+					for (size_t e = 0; e < len; ++e) {
+						const float a = first[e], b = other[e];
+						first[e] = std::min(a, b);
+						other[e] = std::max(a, b);
+					}
+				}
+				for (size_t s = 1; s + 1 < count; ++s) {
+					float* other = &work[s * CHUNK];
+					for (size_t e = 0; e < len; ++e) {
+						const float a = other[e], b = last[e];
+						other[e] = std::min(a, b);
+						last[e] = std::max(a, b);
+					}
+				}
+				if (next == n) break;
+
+				// Drop both, replacing the minimum with the next value
+				std::copy(taps[next] + x0, taps[next] + x0 + len, first);
+				++next;
+			}
+			std::copy(&work[CHUNK], &work[CHUNK] + len, &out[y * width + x0]);
+		}
+	}
+	return true;
+}
+
+SliceSource* MedianFilter::clone() const {
+	SliceSource* sourceClone = source->clone();
+	if (!sourceClone) return nullptr;
+	MedianFilter* stage = new MedianFilter(*sourceClone, radius);
+	stage->ownedSource.reset(sourceClone);
+	return stage;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <algorithm>
+
+#include "SliceSource.h"
+
+
+/// Slices [z - radius, z + radius] around the last slice loaded, each produced once while z increases; slices beyond the volume repeat the border slice
+class SliceRing {
+
+	size_t len, depth, radius;
+
+	/// Slice z is kept in slot z % (2 radius + 1); held is the slice in each slot, -1 for none
+	std::vector<float> slots;
+	std::vector<long long> held;
+
+public:
+	SliceRing(size_t len, size_t depth, size_t radius) : len(len), depth(depth), radius(radius), slots((2 * radius + 1) * len), held(2 * radius + 1, -1) {}
+
+	/// Makes the slices around z available, calling produce(z, float* dst) for those not held yet; returns false if produce fails
+	template<typename Produce>
+	bool load(size_t z, Produce produce) {
+		const size_t k = 2 * radius + 1;
+		for (size_t zi = z > radius ? z - radius : 0; zi <= z + radius && zi < depth; ++zi) {
+			const size_t slot = zi % k;
+			if (held[slot] == (long long)zi) continue;
+			held[slot] = -1;
+			if (!produce(zi, &slots[slot * len])) return false;
+			held[slot] = (long long)zi;
+		}
+		return true;
+	}
+
+	/// Slice z + offset of the last window loaded around z, clamped to the volume
+	inline const float* get(size_t z, long long offset) const {
+		const long long zi = std::min(std::max((long long)z + offset, 0LL), (long long)depth - 1);
+		return &slots[(size_t)(zi % (long long)(2 * radius + 1)) * len];
+	}
+};
+
+
+/// Separable 3D Gaussian blur; voxels beyond the volume repeat the nearest border voxel
+/// Each slice is filtered along X and Y as it's read, then combined along Z over a ring of filtered slices; every pass runs over whole rows, which the compiler vectorises across X
+class GaussianFilter : public SliceSource {
+
+	/// Values being filtered; owned when this stage was cloned
+	SliceSource* source;
+	std::unique_ptr<SliceSource> ownedSource;
+
+	float sigma;
+	size_t radius;
+
+	/// Normalised weights of offsets -radius .. radius
+	std::vector<float> weights;
+
+	SliceRing ring;
+	std::vector<float> input, padded, rows;
+
+public:
+	/// The kernel extends to 3 sigma on each side
+	GaussianFilter(SliceSource& source, float sigma);
+
+	size_t getWidth() const override { return source->getWidth(); }
+	size_t getHeight() const override { return source->getHeight(); }
+	size_t getDepth() const override { return source->getDepth(); }
+
+	bool readSlice(size_t z, float* out) override;
+	SliceSource* clone() const override;
+};
+
+
+/// Median over a (2 radius + 1)^3 box, 3^3 or 5^3 in practice; voxels beyond the volume repeat the nearest border voxel
+/// Each voxel's median is found by forgetful selection: starting from the first half of the box plus 2 values, the minimum and maximum are dropped and
+/// the next value added until 3 are left, whose middle one is the median; the min/max exchanges run over chunks of a row at once, vectorised across X
+/// NaN values are unordered and may take the place of their neighbours, so volumes should be finite
+class MedianFilter : public SliceSource {
+
+	/// Values being filtered; owned when this stage was cloned
+	SliceSource* source;
+	std::unique_ptr<SliceSource> ownedSource;
+
+	size_t radius;
+
+	/// Ring of input slices, each row padded by radius voxels on either side
+	SliceRing ring;
+	std::vector<float> input, work;
+	std::vector<const float*> taps;
+
+public:
+	MedianFilter(SliceSource& source, size_t radius);
+
+	size_t getWidth() const override { return source->getWidth(); }
+	size_t getHeight() const override { return source->getHeight(); }
+	size_t getDepth() const override { return source->getDepth(); }
+
+	bool readSlice(size_t z, float* out) override;
+	SliceSource* clone() const override;
+};
@@ -0,0 +1,209 @@
+#include "MaskSource.h"
+
+#include <memory>
+#include <algorithm>
+
+#include "SliceSource.h"
+#include "ThreadPool.h"
+
+
+bool masks::findBounds(MaskSource& mask, size_t begin[3], size_t end[3]) {
+	const size_t depth = mask.getDepth();
+
+	// Each slab finds the box of its slices, growing it row by row from the first and last set words
+	struct Box {
+		size_t begin[3], end[3];
+		bool found = false;
+	};
+	ThreadPool& pool = ThreadPool::Global();
+	SlabSources<MaskSource> sources(&mask);
+	const size_t slabCount = pool.getSlabCount(depth, sources.isCloneable());
+	std::vector<Box> boxes(slabCount);
+	bool found = false;
+	const bool success = pool.forEachSlab(0, depth, slabCount, [&](const ThreadPool::Slab& slab) {
+		return sources.clone(slab);
+	}, [&](const ThreadPool::Slab& slab) {
+		MaskSource& source = *sources.get(slab);
+		Box& box = boxes[slab.index];
+		BitSlice slice;
+		for (size_t z = slab.begin; z < slab.end; ++z) {
+			if (!source.readMask(z, slice)) return false;
+			for (size_t y = 0; y < slice.height; ++y) {
+				const uint64_t* row = slice.row(y);
+				size_t first = 0;
+				while (first < slice.wordsPerRow && !row[first]) ++first;
+				if (first == slice.wordsPerRow) continue;
+				size_t last = slice.wordsPerRow - 1;
+				while (!row[last]) --last;
+				const size_t xBegin = first * 64 + bits::countTrailingZeros(row[first]);
+				const size_t xEnd = last * 64 + 64 - bits::countLeadingZeros(row[last]);
+				const size_t b[3] = { xBegin, y, z }, e[3] = { xEnd, y + 1, z + 1 };
+				for (int axis = 0; axis < 3; ++axis) {
+					box.begin[axis] = box.found ? std::min(box.begin[axis], b[axis]) : b[axis];
+					box.end[axis] = box.found ? std::max(box.end[axis], e[axis]) : e[axis];
+				}
+				box.found = true;
+			}
+		}
+		sources.release(slab);
+		return true;
+	}, [&](const ThreadPool::Slab& slab) {
+		const Box& box = boxes[slab.index];
+		if (box.found) {
+			for (int axis = 0; axis < 3; ++axis) {
+				begin[axis] = found ? std::min(begin[axis], box.begin[axis]) : box.begin[axis];
+				end[axis] = found ? std::max(end[axis], box.end[axis]) : box.end[axis];
+			}
+			found = true;
+		}
+		return true;
+	});
+	if (!found) {
+		std::fill(begin, begin + 3, 0);
+		std::fill(end, end + 3, 0);
+	}
+	return success;
+}
+
+
+ThresholdMask::ThresholdMask(SliceSource& source, float threshold) : source(&source), threshold(threshold) {}
+
+ThresholdMask::~ThresholdMask() {}
+
+size_t ThresholdMask::getWidth() const { return source->getWidth(); }
+size_t ThresholdMask::getHeight() const { return source->getHeight(); }
+size_t ThresholdMask::getDepth() const { return source->getDepth(); }
+
+bool ThresholdMask::readMask(size_t z, BitSlice& out) {
+	const size_t width = getWidth(), height = getHeight();
+	out.resize(width, height);
+
+	// Fill the bands of rows known to be on one side of the threshold, and read the runs of bands in between in one go
+	size_t pending = 0;
+	auto readPending = [&](size_t yEnd) {
+		if (pending == yEnd) return true;
+		values.resize(width * (yEnd - pending));
+		const bool read = pending == 0 && yEnd == height ? source->readSlice(z, values.data()) : source->readRows(z, pending, yEnd, values.data());
+		if (!read) return false;
+		thresholdRows(values.data(), pending, yEnd, threshold, out);
+		return true;
+	};
+	const size_t brickCount = (width + BRICK_COLUMNS - 1) / BRICK_COLUMNS;
+	brickSides.resize(brickCount);
+	for (size_t yBegin = 0; yBegin < height; yBegin += BAND_ROWS) {
+		const size_t yEnd = std::min(height, yBegin + BAND_ROWS);
+		float min, max;
+		if (!source->getValueBounds(z, 0, width, yBegin, yEnd, min, max)) {
+			continue;
+		}
+		if (max < threshold || min >= threshold) {
+			if (!readPending(yBegin)) return false;
+			if (min >= threshold) {
+				for (size_t y = yBegin; y < yEnd; ++y) out.setRange(y, 0, width);
+			}
+			pending = yEnd;
+			continue;
+		}
+
+		// Bands through the object usually still hold air (or solid bone) on either side of it: fill the bricks known to be, and read the runs of bricks between
+		bool anyKnown = false;
+		for (size_t brick = 0; brick < brickCount; ++brick) {
+			const size_t xBegin = brick * BRICK_COLUMNS, xEnd = std::min(width, xBegin + BRICK_COLUMNS);
+			brickSides[brick] = !source->getValueBounds(z, xBegin, xEnd, yBegin, yEnd, min, max) ? 0 : max < threshold ? -1 : min >= threshold ? 1 : 0;
+			anyKnown = anyKnown || brickSides[brick] != 0;
+		}
+		if (!anyKnown) {
+			continue;
+		}
+		if (!readPending(yBegin)) return false;
+		for (size_t brick = 0; brick < brickCount;) {
+			const size_t xBegin = brick * BRICK_COLUMNS;
+			if (brickSides[brick] != 0) {
+				if (brickSides[brick] > 0) {
+					for (size_t y = yBegin; y < yEnd; ++y) out.setRange(y, xBegin, std::min(width, xBegin + BRICK_COLUMNS));
+				}
+				++brick;
+				continue;
+			}
+			while (brick < brickCount && brickSides[brick] == 0) ++brick;
+			const size_t xEnd = std::min(width, brick * BRICK_COLUMNS);
+			values.resize((xEnd - xBegin) * (yEnd - yBegin));
+			if (!source->readBlock(z, xBegin, xEnd, yBegin, yEnd, values.data())) return false;
+			thresholdBlock(values.data(), xBegin, xEnd, yBegin, yEnd, threshold, out);
+		}
+		pending = yEnd;
+	}
+	return readPending(height);
+}
+
+MaskSource* ThresholdMask::clone() const {
+	SliceSource* sourceClone = source->clone();
+	if (!sourceClone) return nullptr;
+	ThresholdMask* mask = new ThresholdMask(*sourceClone, threshold);
+	mask->ownedSource.reset(sourceClone);
+	return mask;
+}
+
+void ThresholdMask::thresholdSlice(const float* values, size_t width, size_t height, float threshold, BitSlice& out) {
+	out.resize(width, height);
+	thresholdRows(values, 0, height, threshold, out);
+}
+
+void ThresholdMask::thresholdRows(const float* values, size_t yBegin, size_t yEnd, float threshold, BitSlice& out) {
+	const size_t width = out.width;
+	for (size_t y = yBegin; y < yEnd; ++y) {
+		const float* rowValues = &values[(y - yBegin) * width];
+		uint64_t* rowBits = out.row(y);
+		for (size_t w = 0; w < out.wordsPerRow; ++w) {
+			const size_t x0 = w * 64, x1 = std::min(width, x0 + 64);
+			uint64_t word = 0;
+			for (size_t x = x0; x < x1; ++x) {
+				word |= uint64_t(rowValues[x] >= threshold) << (x - x0);
+			}
+			rowBits[w] = word;
+		}
+	}
+}
+
+void ThresholdMask::thresholdBlock(const float* values, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float threshold, BitSlice& out) {
+	if (xBegin >= xEnd) return;
+	const size_t columns = xEnd - xBegin;
+	for (size_t y = yBegin; y < yEnd; ++y) {
+		const float* rowValues = &values[(y - yBegin) * columns];
+		uint64_t* rowBits = out.row(y);
+		for (size_t w = xBegin / 64; w <= (xEnd - 1) / 64; ++w) {
+			const size_t x0 = std::max(xBegin, w * 64), x1 = std::min(xEnd, w * 64 + 64);
+			uint64_t word = 0;
+			for (size_t x = x0; x < x1; ++x) {
+				word |= uint64_t(rowValues[x - xBegin] >= threshold) << (x & 63);
+			}
+			rowBits[w] |= word;
+		}
+	}
+}
+
+
+InvertedMask::InvertedMask(MaskSource& source) : source(&source) {}
+
+bool InvertedMask::readMask(size_t z, BitSlice& out) {
+	if (!source->readMask(z, out)) {
+		return false;
+	}
+	const uint64_t lastMask = out.lastWordMask();
+	for (size_t y = 0; y < out.height; ++y) {
+		uint64_t* row = out.row(y);
+		for (size_t w = 0; w < out.wordsPerRow; ++w) {
+			row[w] = ~row[w];
+		}
+		if (out.wordsPerRow) row[out.wordsPerRow - 1] &= lastMask; // keep padding bits clear
+	}
+	return true;
+}
+
+MaskSource* InvertedMask::clone() const {
+	MaskSource* sourceClone = source->clone();
+	if (!sourceClone) return nullptr;
+	InvertedMask* mask = new InvertedMask(*sourceClone);
+	mask->ownedSource.reset(sourceClone);
+	return mask;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+
+#include "BitSlice.h"
+
+class SliceSource;
+
+
+/// Produces bit-packed occupancy slices of a volume, to be consumed by the mesher and other threshold-based operations
+/// Slices are expected to be requested in increasing z order; implementations may allow stepping back by a slice or two
+class MaskSource {
+public:
+	virtual ~MaskSource() {}
+
+	/// Size of the masks produced, in voxels
+	virtual size_t getWidth() const = 0;
+	virtual size_t getHeight() const = 0;
+	virtual size_t getDepth() const = 0;
+
+	/// Fills out with the occupancy of slice z, resizing it as needed
+	virtual bool readMask(size_t z, BitSlice& out) = 0;
+
+	/// Returns an independent source over the same mask that can be read from another thread, or nullptr if the source can only be streamed once
+	virtual MaskSource* clone() const { return nullptr; }
+};
+
+
+namespace masks {
+
+	/// Finds the bounding box [begin, end) of the set voxels in one read pass, reading Z slabs concurrently when the mask can be cloned; returns false if reading fails
+	/// An empty mask yields an empty box (begin == end == 0)
+	bool findBounds(MaskSource& mask, size_t begin[3], size_t end[3]);
+
+}
+
+
+/// Occupancy of the voxels of a slice source that are greater than or equal to a threshold
+/// Bands of rows that the source can bound entirely below or above the threshold get filled without being read; within the other bands, so do the columns of
+/// bricks it can bound, only the runs of columns in between being read
+class ThresholdMask : public MaskSource {
+
+	/// Rows per band, and columns per brick within a band, checked against the source's value bounds
+	static constexpr size_t BAND_ROWS = 16;
+	static constexpr size_t BRICK_COLUMNS = 32;
+
+	/// Values being thresholded; owned when this mask was cloned
+	SliceSource* source;
+	std::unique_ptr<SliceSource> ownedSource;
+
+	float threshold;
+
+	/// Downscaled slice buffer
+	std::vector<float> values;
+
+	/// Side of the threshold each brick of the current band lies on: -1 below, 1 above, 0 on both or unknown
+	std::vector<signed char> brickSides;
+
+public:
+	ThresholdMask(SliceSource& source, float threshold);
+	virtual ~ThresholdMask();
+
+	size_t getWidth() const override;
+	size_t getHeight() const override;
+	size_t getDepth() const override;
+
+	bool readMask(size_t z, BitSlice& out) override;
+	MaskSource* clone() const override;
+
+	/// Thresholds width x height values into out, 64 voxels at a time
+	static void thresholdSlice(const float* values, size_t width, size_t height, float threshold, BitSlice& out);
+
+	/// Thresholds the width x (yEnd - yBegin) values of rows [yBegin, yEnd) into those rows of out, which must already be sized
+	static void thresholdRows(const float* values, size_t yBegin, size_t yEnd, float threshold, BitSlice& out);
+
+	/// Sets the voxels of columns [xBegin, xEnd) of rows [yBegin, yEnd) of out whose (xEnd - xBegin) x (yEnd - yBegin) values reach the threshold, leaving the
+	/// others as they are; out must already be sized
+	static void thresholdBlock(const float* values, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float threshold, BitSlice& out);
+};
+
+
+/// Complement of another mask: voxels of the volume that are not set in it
+class InvertedMask : public MaskSource {
+
+	/// Mask being inverted; owned when this mask was cloned
+	MaskSource* source;
+	std::unique_ptr<MaskSource> ownedSource;
+
+public:
+	InvertedMask(MaskSource& source);
+
+	size_t getWidth() const override { return source->getWidth(); }
+	size_t getHeight() const override { return source->getHeight(); }
+	size_t getDepth() const override { return source->getDepth(); }
+
+	bool readMask(size_t z, BitSlice& out) override;
+	MaskSource* clone() const override;
+};
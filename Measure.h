@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "MaskSource.h"
+
+
+/// Physical size of a (downscaled) voxel along each axis; all 1 to measure in voxels
+struct VoxelSpacing {
+	double x = 1.0, y = 1.0, z = 1.0;
+};
+
+
+/// Counts of the 2x2x2 voxel configurations around every corner of the voxel lattice (voxels beyond the volume are empty), from which the measurements are derived
+/// Bit (dx + 2 dy + 4 dz) of a configuration is the voxel on the positive side of the corner along the axes where d is 1
+struct Measurements {
+	uint64_t voxels = 0;
+	uint64_t configurations[256] = {};
+
+	/// Voxel faces between the mask and its outside, perpendicular to the given axis (0 to 2), or all of them
+	uint64_t getExposedFaces(int axis) const;
+	uint64_t getExposedFaces() const;
+
+	/// Area of the exposed faces, as in the cubified mesh
+	double getFaceArea(const VoxelSpacing& spacing) const;
+
+	/// Estimate of the area of the underlying smooth surface: the marching cubes surface through the midpoints between set and empty voxel centres, with the area
+	/// of each configuration weighted to be about unbiased over plane orientations (2.6% RMS error per plane); digitised spheres come out up to 1% large, and
+	/// boxes short by their bevelled edges, 1.7% for a 40 voxel cube
+	double getSurfaceArea(const VoxelSpacing& spacing) const;
+
+	/// Euler characteristic of the mask with 26-connected voxels (and 6-connected background): components - tunnels + cavities
+	long long getEulerCharacteristic() const;
+
+	inline double getVolume(const VoxelSpacing& spacing) const { return voxels * spacing.x * spacing.y * spacing.z; }
+};
+
+
+namespace measure {
+
+	/// Counts the configurations in a single read pass over pairs of slices, with Z slabs read concurrently when the mask can be cloned
+	bool compute(MaskSource& mask, Measurements& measurements);
+
+	/// Prints the measurements and writes them to a json file
+	bool report(const Measurements& measurements, const VoxelSpacing& spacing, std::string filename);
+
+}
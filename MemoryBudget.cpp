@@ -0,0 +1,110 @@
+#include "MemoryBudget.h"
+
+#include <cstdio>
+#include <algorithm>
+
+#include "colours.h"
+
+
+uint64_t MemoryBudget::globalTotal = 0;
+
+/// Budget set by the innermost Scope of this thread, if any
+static thread_local MemoryBudget* currentBudget = nullptr;
+
+
+MemoryBudget::MemoryBudget(uint64_t total, MemoryBudget* parent) : total(total), parent(parent) {
+	if (parent) parent->acquire(total);
+}
+
+MemoryBudget::~MemoryBudget() {
+	if (parent) parent->release(total);
+}
+
+MemoryBudget& MemoryBudget::Global() {
+	static MemoryBudget budget(globalTotal);
+	return budget;
+}
+
+MemoryBudget& MemoryBudget::Current() {
+	return currentBudget ? *currentBudget : Global();
+}
+
+MemoryBudget::Scope::Scope(MemoryBudget& budget) : previous(currentBudget) {
+	currentBudget = &budget;
+}
+
+MemoryBudget::Scope::~Scope() {
+	currentBudget = previous;
+}
+
+void MemoryBudget::SetGlobalTotal(uint64_t total) {
+	globalTotal = total;
+}
+
+void MemoryBudget::acquire(uint64_t bytes) {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (total > 0) {
+		condition.wait(lock, [&] { return used == 0 || used + bytes <= total; });
+	}
+	used += bytes;
+	peak = std::max(peak, used);
+}
+
+bool MemoryBudget::tryAcquire(uint64_t bytes) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (total > 0 && used + bytes > total) {
+		return false;
+	}
+	used += bytes;
+	peak = std::max(peak, used);
+	return true;
+}
+
+void MemoryBudget::release(uint64_t bytes) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		used -= bytes;
+	}
+	condition.notify_all();
+}
+
+uint64_t MemoryBudget::getUsed() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return used;
+}
+
+uint64_t MemoryBudget::getPeak() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return peak;
+}
+
+uint64_t MemoryBudget::getAvailable() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return total == 0 ? UINT64_MAX : total > used ? total - used : 0;
+}
+
+void MemoryBudget::printExceeded(const char* what, uint64_t bytes) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	printf(RED "Memory budget exceeded: %s needs %.1f MB, with %.1f MB of the %.1f MB budget already in use; raise -memoryBudget or lower -threads.\n" WHITE,
+		what, bytes / (1024.0 * 1024.0), used / (1024.0 * 1024.0), total / (1024.0 * 1024.0));
+}
+
+
+MemoryBudget::Reservation::Reservation(MemoryBudget* budget, uint64_t bytes) : budget(budget), bytes(bytes) {
+	if (budget) budget->acquire(bytes);
+}
+
+MemoryBudget::Reservation::~Reservation() {
+	if (budget) budget->release(bytes);
+}
+
+bool MemoryBudget::Reservation::resize(uint64_t newBytes) {
+	if (budget && newBytes > bytes && !budget->tryAcquire(newBytes - bytes)) {
+		return false;
+	}
+	if (budget && newBytes < bytes) {
+		budget->release(bytes - newBytes);
+	}
+	bytes = newBytes;
+	return true;
+}
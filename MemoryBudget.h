@@ -0,0 +1,80 @@
+#pragma once
+
+#include <mutex>
+#include <cstdint>
+#include <condition_variable>
+
+
+/// Memory shared by concurrent users, each reserving what it needs before allocating it, and releasing it once freed
+/// Slice windows, meshes and image buffers draw from the current budget with tryAcquire, failing when it runs out; the jobs of a batch each get a budget of
+/// their own, carved out of the global one with acquire (waiting for room) once they know what they need
+class MemoryBudget {
+	uint64_t total, used = 0, peak = 0;
+	MemoryBudget* parent;
+	mutable std::mutex mutex;
+	std::condition_variable condition;
+
+	/// Total of the global budget, in bytes
+	static uint64_t globalTotal;
+
+public:
+	/// A total of 0 puts no limit on reservations, which are still tracked; with a parent, the total is reserved from it (waiting for room) for the lifetime of
+	/// the budget
+	explicit MemoryBudget(uint64_t total = 0, MemoryBudget* parent = nullptr);
+	~MemoryBudget();
+
+	MemoryBudget(const MemoryBudget&) = delete;
+	MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+	/// Returns the budget of the whole process, as set by -memoryBudget
+	static MemoryBudget& Global();
+
+	/// Returns the budget that slice windows, meshes and exporters of the calling thread draw from: that of the innermost Scope, or the global one
+	static MemoryBudget& Current();
+
+	/// Makes a budget the current one of the calling thread for its lifetime; the thread pool carries it over to the tasks submitted within it
+	class Scope {
+		MemoryBudget* previous;
+	public:
+		explicit Scope(MemoryBudget& budget);
+		~Scope();
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+
+	/// Sets the total of the global budget in bytes (0 for no limit); only has an effect before its first use
+	static void SetGlobalTotal(uint64_t total);
+
+	/// Waits until bytes fit in the budget alongside the other reservations, then reserves them; a reservation larger than the whole budget waits for all others to be released
+	void acquire(uint64_t bytes);
+
+	/// Reserves bytes if they fit in the budget right now; returns false, reserving nothing, if they don't
+	bool tryAcquire(uint64_t bytes);
+	void release(uint64_t bytes);
+
+	/// Getters; available is what is left of the total (UINT64_MAX without a limit)
+	inline uint64_t getTotal() const { return total; }
+	inline bool isLimited() const { return total > 0; }
+	uint64_t getUsed() const;
+	uint64_t getPeak() const;
+	uint64_t getAvailable() const;
+
+	/// Prints that what could not get the bytes it asked for, along with the use of the budget
+	void printExceeded(const char* what, uint64_t bytes) const;
+
+	/// Holds bytes of a budget for its lifetime; does nothing without a budget
+	class Reservation {
+		MemoryBudget* budget;
+		uint64_t bytes;
+	public:
+		/// Waits for bytes to fit, as with acquire
+		Reservation(MemoryBudget* budget, uint64_t bytes);
+		~Reservation();
+		Reservation(const Reservation&) = delete;
+		Reservation& operator=(const Reservation&) = delete;
+
+		/// Grows or shrinks the reservation to bytes without waiting; returns false, keeping the previous size, if growing doesn't fit
+		bool resize(uint64_t bytes);
+		inline uint64_t getBytes() const { return bytes; }
+	};
+};
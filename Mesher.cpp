@@ -0,0 +1,400 @@
+#include "Mesher.h"
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+#include "colours.h"
+#include "BitSlice.h"
+#include "MaskSource.h"
+#include "ObjModel.h"
+#include "ThreadPool.h"
+#include "Metrics.h"
+#include "filesystem.h"
+
+
+/// Identifies partial mesh files, the last character being the format version
+static const char PARTIAL_MAGIC[8] = { 'S', 'V', 'M', 'E', 'S', 'H', 'P', '1' };
+
+void mesher::meshSlice(const BitSlice& prev, const BitSlice& curr, const BitSlice& next, size_t z, ObjModel& model) {
+	metrics::ScopedTimer timer(metrics::Stage::MESH);
+	const size_t dHeight = curr.height;
+	const size_t words = curr.wordsPerRow;
+	for (size_t y = 0; y < dHeight; ++y) {
+		const uint64_t* row = curr.row(y);
+		const uint64_t* rowPrevY = y > 0 ? curr.row(y - 1) : nullptr;
+		const uint64_t* rowNextY = y + 1 < dHeight ? curr.row(y + 1) : nullptr;
+		const uint64_t* rowPrevZ = prev.row(y);
+		const uint64_t* rowNextZ = next.row(y);
+
+		for (size_t w = 0; w < words; ++w) {
+			const uint64_t occ = row[w];
+			if (!occ) continue;
+
+			// A face is exposed where the voxel is set and its neighbour isn't; bits past the row bounds read as empty
+			const uint64_t posX = occ & ~((occ >> 1) | (w + 1 < words ? row[w + 1] << 63 : 0));
+			const uint64_t negX = occ & ~((occ << 1) | (w > 0 ? row[w - 1] >> 63 : 0));
+			const uint64_t posY = occ & ~(rowNextY ? rowNextY[w] : 0);
+			const uint64_t negY = occ & ~(rowPrevY ? rowPrevY[w] : 0);
+			const uint64_t posZ = occ & ~rowNextZ[w];
+			const uint64_t negZ = occ & ~rowPrevZ[w];
+
+			// Visit voxels in increasing x, emitting their faces in the same order as a per-voxel walk would
+			for (uint64_t exposed = posX | negX | posY | negY | posZ | negZ; exposed; exposed &= exposed - 1) {
+				const int bit = bits::countTrailingZeros(exposed);
+				const uint64_t mask = uint64_t(1) << bit;
+				const size_t x = w * 64 + bit;
+				if (posX & mask) model.addLatticeSquare(x, y, z, ObjModel::Direction::POS_X);
+				if (negX & mask) model.addLatticeSquare(x, y, z, ObjModel::Direction::NEG_X);
+				if (posY & mask) model.addLatticeSquare(x, y, z, ObjModel::Direction::POS_Y);
+				if (negY & mask) model.addLatticeSquare(x, y, z, ObjModel::Direction::NEG_Y);
+				if (posZ & mask) model.addLatticeSquare(x, y, z, ObjModel::Direction::POS_Z);
+				if (negZ & mask) model.addLatticeSquare(x, y, z, ObjModel::Direction::NEG_Z);
+			}
+		}
+	}
+}
+
+bool mesher::meshSlab(MaskSource& source, ObjModel& model, size_t zBegin, size_t zEnd) {
+
+	const size_t dDepth = source.getDepth();
+	const size_t dHeight = source.getHeight();
+
+	// Rolling window of masks for slices z - 1, z and z + 1; out of range slices stay empty, exposing the faces on the volume bounds
+	BitSlice prev, curr, next;
+	prev.resize(source.getWidth(), dHeight);
+	curr.resize(source.getWidth(), dHeight);
+	if (zBegin > 0 && !source.readMask(zBegin - 1, prev)) {
+		printf(RED "Cannot read mask slice %zu out of %zu, aborting.\n" WHITE, zBegin - 1, dDepth);
+		return false;
+	}
+	if (zBegin < dDepth && !source.readMask(zBegin, curr)) {
+		printf(RED "Cannot read mask slice %zu out of %zu, aborting.\n" WHITE, zBegin, dDepth);
+		return false;
+	}
+
+	// Iterate over voxels, slice by slice
+	for (size_t z = zBegin; z < zEnd; ++z) {
+
+		// Read in the next slice; the current and previous ones are already available
+		if (z + 1 < dDepth) {
+			if (!source.readMask(z + 1, next)) {
+				printf(RED "Cannot read mask slice %zu out of %zu, aborting.\n" WHITE, z + 1, dDepth);
+				return false;
+			}
+		} else {
+			next.resize(curr.width, curr.height);
+		}
+
+		meshSlice(prev, curr, next, z, model);
+
+		// Slide the window along, recycling the previous slice's storage for the next one
+		std::swap(prev, curr);
+		std::swap(curr, next);
+	}
+
+	return true;
+}
+
+/// Longest slab meshed at once under a limited memory budget, so that slabs get merged (and the mesh flushed) often
+static constexpr size_t BUDGET_SLAB_SLICES = 32;
+
+/// Slices meshed on their own to estimate the exposed surface of a range under a limited memory budget
+static constexpr size_t SURFACE_SAMPLES = 8;
+
+/// Estimates the bytes of faces a slab holds per slice of mask slices [zBegin, zEnd), from the densest of a few evenly spread slices meshed on their own (with
+/// twice that to spare, as the surface varies between them); returns 0 if even a single sampled slice doesn't fit in the budget
+static size_t estimateSliceBytes(MaskSource& source, size_t zBegin, size_t zEnd, size_t latticeBytes) {
+	const size_t samples = std::min(SURFACE_SAMPLES, zEnd - zBegin);
+	SlabSources<MaskSource> sources(&source);
+	std::vector<size_t> sliceBytes(samples, 0);
+	std::atomic<bool> exceeded{ false };
+	const bool sampled = ThreadPool::Global().forEachSlab(0, samples, samples, [&](const ThreadPool::Slab& slab) {
+		return sources.clone(slab);
+	}, [&](const ThreadPool::Slab& slab) {
+		const size_t z = zBegin + (2 * slab.index + 1) * (zEnd - zBegin) / (2 * samples);
+		ObjModel model;
+		model.setLatticeSize(source.getWidth(), source.getHeight());
+		const bool meshed = mesher::meshSlab(*sources.get(slab), model, z, z + 1);
+		sources.release(slab);
+		MemoryBudget::Reservation memory(&MemoryBudget::Current(), 0);
+		const size_t bytes = model.getMemoryBytes();
+		if (meshed && !memory.resize(bytes)) {
+			if (!exceeded.exchange(true)) {
+				MemoryBudget::Current().printExceeded("a single-slice mesh slab", bytes);
+			}
+			return false;
+		}
+		sliceBytes[slab.index] = bytes > latticeBytes ? bytes - latticeBytes : 0;
+		return meshed;
+	}, nullptr);
+	return sampled ? 2 * std::max<size_t>(1, *std::max_element(sliceBytes.begin(), sliceBytes.end())) : 0;
+}
+
+/// Meshes mask slices [zBegin, zEnd) into model, splitting them into Z slabs meshed concurrently when the source can be cloned
+/// The model is handed to writer (if any) as it grows; under a limited memory budget, the length of the slabs and how many are held at once are sized from the
+/// exposed surface of sampled slices, so that the faces they hold until merged fit in a quarter of what is left of the budget (or in a single slab of a slice)
+static bool meshRange(MaskSource& source, ObjModel& model, size_t zBegin, size_t zEnd, MeshWriter* writer = nullptr) {
+
+	const size_t dDepth = source.getDepth();
+	const size_t slices = zEnd - zBegin;
+
+	// Each slab gets its own source, slice window and model
+	ThreadPool& pool = ThreadPool::Global();
+	SlabSources<MaskSource> sources(&source);
+	size_t slabCount = pool.getSlabCount(slices, sources.isCloneable());
+	size_t inFlight = 0;
+	MemoryBudget& budget = MemoryBudget::Current();
+	if (slabCount > 1 && budget.isLimited()) {
+		const size_t latticeBytes = 2 * (source.getWidth() + 1) * (source.getHeight() + 1) * sizeof(uint32_t);
+		const size_t sliceBytes = estimateSliceBytes(source, zBegin, zEnd, latticeBytes);
+		if (sliceBytes == 0) {
+			return false;
+		}
+		const uint64_t available = budget.getAvailable();
+		if (latticeBytes + sliceBytes > available / 2) {
+			budget.printExceeded("a single-slice mesh slab alongside the slice windows", latticeBytes + sliceBytes);
+			return false;
+		}
+		const uint64_t slabBudget = std::max<uint64_t>(available / 4, latticeBytes + sliceBytes);
+		inFlight = (size_t)std::min<uint64_t>(pool.getThreadCount() * 2, slabBudget / (latticeBytes + sliceBytes));
+		const size_t slabSlices = std::min<size_t>(std::max<size_t>(1, (size_t)((slabBudget / inFlight - latticeBytes) / sliceBytes)), BUDGET_SLAB_SLICES);
+		slabCount = std::max(slabCount, (slices + slabSlices - 1) / slabSlices);
+		printf(BLUE "Meshing %zu slabs of up to %zu slices, %zu at once, within the memory budget.\n" WHITE, slabCount, slabSlices, inFlight);
+	}
+	metrics::Progress progress(dDepth, zBegin);
+	if (slabCount <= 1) {
+		if (!mesher::meshSlab(source, model, zBegin, zEnd)) {
+			return false;
+		}
+		progress.update(zEnd);
+		return !writer || writer->update();
+	}
+	struct Slab {
+		ObjModel model;
+		MemoryBudget::Reservation memory{ &MemoryBudget::Current(), 0 };
+	};
+	std::vector<Slab> slabs(slabCount);
+	std::atomic<bool> exceeded{ false };
+
+	// Slabs are merged in order as they complete, which yields the same vertices and faces in the same order as meshing serially
+	return pool.forEachSlab(zBegin, zEnd, slabCount, [&](const ThreadPool::Slab& slab) {
+		slabs[slab.index].model.setLatticeSize(source.getWidth(), source.getHeight());
+		return sources.clone(slab);
+	}, [&](const ThreadPool::Slab& slab) {
+		metrics::TraceSpan span("mesh_slab");
+		Slab& state = slabs[slab.index];
+		const bool meshed = mesher::meshSlab(*sources.get(slab), state.model, slab.begin, slab.end);
+		sources.release(slab);
+
+		// The slab's faces are held until it gets merged
+		const size_t bytes = state.model.getMemoryBytes();
+		if (meshed && !state.memory.resize(bytes)) {
+			if (!exceeded.exchange(true)) {
+				MemoryBudget::Current().printExceeded("a mesh slab", bytes);
+			}
+			return false;
+		}
+		return meshed;
+	}, [&](const ThreadPool::Slab& slab) {
+		metrics::TraceSpan span("merge_slab");
+		Slab& state = slabs[slab.index];
+		model.mergeLatticeSlab(state.model, slab.begin, slab.end);
+		progress.update(slab.end);
+		state.model = ObjModel(); // free slab memory early
+		state.memory.resize(0);
+		return !writer || writer->update();
+	}, inFlight);
+}
+
+bool mesher::exportObj(MaskSource& source, std::string filename, float scale, const DecimateParams& decimate, const float* offset) {
+
+	// Vertices are deduplicated on the voxel corner lattice, scale only gets applied when writing out
+	ObjModel model;
+	model.scale = scale;
+	if (offset) std::copy(offset, offset + 3, model.offset);
+	model.setLatticeSize(source.getWidth(), source.getHeight());
+	MeshWriter writer(model, filename, decimate);
+	if (!meshRange(source, model, 0, source.getDepth(), &writer)) {
+		return false;
+	}
+	return writer.finish();
+}
+
+/// Writes the elements of an array, preceded by their count
+template<typename T>
+static void writeArray(std::ofstream& file, const std::vector<T>& array) {
+	const uint64_t count = array.size();
+	file.write((const char*)&count, sizeof(count));
+	file.write((const char*)array.data(), count * sizeof(T));
+}
+
+/// Reads an array written by writeArray
+template<typename T>
+static bool readArray(std::ifstream& file, std::vector<T>& array) {
+	uint64_t count;
+	if (!file.read((char*)&count, sizeof(count))) return false;
+	array.resize(count);
+	return (bool)file.read((char*)array.data(), count * sizeof(T));
+}
+
+bool mesher::exportPartialObj(MaskSource& source, std::string filename, float scale, size_t zBegin, size_t zEnd, const float* offset) {
+	ObjModel model;
+	model.setLatticeSize(source.getWidth(), source.getHeight());
+	if (!meshRange(source, model, zBegin, zEnd)) {
+		return false;
+	}
+
+	metrics::ScopedTimer timer(metrics::Stage::WRITE_OBJ);
+	std::ofstream file(filename, std::ios::binary);
+	const uint64_t header[5] = { source.getWidth(), source.getHeight(), source.getDepth(), zBegin, zEnd };
+	const float placement[4] = { scale, offset ? offset[0] : 0.0f, offset ? offset[1] : 0.0f, offset ? offset[2] : 0.0f };
+	file.write(PARTIAL_MAGIC, sizeof(PARTIAL_MAGIC));
+	file.write((const char*)header, sizeof(header));
+	file.write((const char*)placement, sizeof(placement));
+	writeArray(file, model.positions);
+	writeArray(file, model.normals);
+	writeArray(file, model.positionIndices);
+	writeArray(file, model.normalIndices);
+	if (!file) {
+		printf(RED "Cannot write partial mesh to file %s, aborting.\n" WHITE, filename.c_str());
+		return false;
+	}
+	metrics::add(metrics::Counter::BYTES_WRITTEN, (uint64_t)file.tellp());
+	return true;
+}
+
+bool mesher::mergePartialObjs(const std::vector<std::string>& partFilenames, std::string filename, const DecimateParams& decimate) {
+	ObjModel model;
+	size_t width = 0, height = 0, depth = 0, zEnd = 0;
+	std::unique_ptr<metrics::Progress> progress;
+	MeshWriter writer(model, filename, decimate);
+	for (const std::string& partFilename : partFilenames) {
+		std::ifstream file(partFilename, std::ios::binary);
+		char magic[sizeof(PARTIAL_MAGIC)];
+		uint64_t header[5];
+		float placement[4];
+		ObjModel part;
+		if (!file || !file.read(magic, sizeof(magic)) || std::memcmp(magic, PARTIAL_MAGIC, sizeof(PARTIAL_MAGIC)) != 0 || !file.read((char*)header, sizeof(header)) || !file.read((char*)placement, sizeof(placement)) ||
+			!readArray(file, part.positions) || !readArray(file, part.normals) || !readArray(file, part.positionIndices) || !readArray(file, part.normalIndices)) {
+			printf(RED "Cannot read partial mesh %s, aborting.\n" WHITE, partFilename.c_str());
+			return false;
+		}
+
+		// Parts must cover the volume in order, each starting where the previous one ended
+		if (depth == 0) {
+			width = header[0];
+			height = header[1];
+			depth = header[2];
+			model.scale = placement[0];
+			std::copy(placement + 1, placement + 4, model.offset);
+			model.setLatticeSize(width, height);
+			progress = std::make_unique<metrics::Progress>(depth);
+		}
+		if (header[0] != width || header[1] != height || header[2] != depth || header[3] != zEnd) {
+			printf(RED "Partial mesh %s does not continue the previous part (slices %llu to %llu of %llu, expected from %zu of %zu), aborting.\n" WHITE, partFilename.c_str(),
+				(unsigned long long)header[3], (unsigned long long)header[4], (unsigned long long)header[2], zEnd, depth);
+			return false;
+		}
+		part.setLatticeSize(width, height);
+		model.mergeLatticeSlab(part, header[3], header[4]);
+		zEnd = header[4];
+		progress->update(zEnd);
+		if (!writer.update()) {
+			return false;
+		}
+	}
+	if (zEnd != depth || depth == 0) {
+		printf(RED "Partial meshes end at slice %zu of %zu, aborting.\n" WHITE, zEnd, depth);
+		return false;
+	}
+	return writer.finish();
+}
+
+bool mesher::writeObj(ObjModel& model, std::string filename, const DecimateParams& decimate) {
+
+	if (decimate.enabled()) {
+
+		// Rough working memory of the simplifier: a quadric, candidate edges and stamps per vertex, and references per face
+		MemoryBudget::Reservation working(&MemoryBudget::Current(), 0);
+		const size_t workingBytes = model.positions.size() / 3 * 160 + model.positionIndices.size() / 3 * 32;
+		if (!working.resize(workingBytes)) {
+			MemoryBudget::Current().printExceeded("decimating the mesh", workingBytes);
+			return false;
+		}
+		metrics::ScopedTimer timer(metrics::Stage::DECIMATE);
+		if (!decimator::simplify(model, decimate)) {
+			return false;
+		}
+	}
+
+	// Write out to wavefront file
+	if (!model.writeToFile(filename)) {
+		printf(RED "Cannot write obj model to file %s, aborting.\n" WHITE, filename.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+
+MeshWriter::MeshWriter(ObjModel& model, std::string filename, const DecimateParams& decimate) :
+	model(model), filename(filename), streamFilename(filename + ".tmp"), decimate(decimate), streaming(MemoryBudget::Current().isLimited() && !decimate.enabled()),
+	memory(&MemoryBudget::Current(), 0), start(std::chrono::steady_clock::now()) {
+	if (streaming) {
+		file.open(streamFilename, std::ios::binary);
+		flushBytes = std::max<size_t>(MemoryBudget::Current().getAvailable() / 4, 1 << 20);
+	}
+}
+
+MeshWriter::~MeshWriter() {
+	if (streaming && !finished) {
+		file.close();
+		fs::removeAll(streamFilename);
+	}
+}
+
+bool MeshWriter::update() {
+	size_t bytes = model.getMemoryBytes();
+	bool fits = bytes <= flushBytes && memory.resize(bytes);
+	if (streaming && !fits) {
+		if (!file || !model.flush(file, bytesWritten)) {
+			printf(RED "Cannot write obj model to file %s, aborting.\n" WHITE, streamFilename.c_str());
+			return false;
+		}
+		bytes = model.getMemoryBytes();
+	}
+	if (!fits && !memory.resize(bytes)) {
+		MemoryBudget::Current().printExceeded(decimate.enabled() ? "the mesh, kept whole for decimation" : "the mesh", bytes);
+		return false;
+	}
+	return true;
+}
+
+bool MeshWriter::finish() {
+	if (!update()) {
+		return false;
+	}
+	if (!streaming) {
+		return mesher::writeObj(model, filename, decimate);
+	}
+
+	// Write out the rest of the model after what was flushed, then put the file in place
+	if (!file || !model.flush(file, bytesWritten) || (file.close(), !file)) {
+		printf(RED "Cannot write obj model to file %s, aborting.\n" WHITE, streamFilename.c_str());
+		return false;
+	}
+	if (!fs::renameFile(streamFilename, filename)) {
+		printf(RED "Cannot move obj model from %s to %s, aborting.\n" WHITE, streamFilename.c_str(), filename.c_str());
+		return false;
+	}
+	finished = true;
+	memory.resize(model.getMemoryBytes());
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const double megabytes = bytesWritten / (1024.0 * 1024.0);
+	printf("Wrote %.1f MB to %s in %.2f s (%.1f MB/s).\n", megabytes, filename.c_str(), seconds, seconds > 0 ? megabytes / seconds : 0.0);
+	return true;
+}
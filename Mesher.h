@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fstream>
+
+#include "Decimator.h"
+#include "MemoryBudget.h"
+
+class MaskSource;
+struct ObjModel;
+struct BitSlice;
+
+
+/// Writes a mesh out as it gets built, holding what it keeps in memory in the global memory budget
+/// With a limited budget and no decimation, the model gets flushed to file whenever it holds more than a quarter of what was left of the budget when writing
+/// began, or when what it holds no longer fits, so that only the faces added since are kept; the flushed file only replaces filename once finished, so that a
+/// failed run leaves no truncated mesh behind. Otherwise the whole model is kept, and written (simplified if needed) at the end
+class MeshWriter {
+	ObjModel& model;
+	std::string filename, streamFilename;
+	DecimateParams decimate;
+	bool streaming, finished = false;
+	std::ofstream file;
+	size_t flushBytes = SIZE_MAX, bytesWritten = 0;
+	MemoryBudget::Reservation memory;
+	std::chrono::steady_clock::time_point start;
+
+public:
+	MeshWriter(ObjModel& model, std::string filename, const DecimateParams& decimate = DecimateParams());
+
+	/// Deletes the flushed file if the mesh never got finished
+	~MeshWriter();
+	MeshWriter(const MeshWriter&) = delete;
+	MeshWriter& operator=(const MeshWriter&) = delete;
+
+	/// Accounts for what the model gained, flushing it if it holds too much; returns false if it doesn't fit in the budget or cannot be written
+	bool update();
+
+	/// Writes what the model holds, simplifying the whole of it first if decimation is enabled
+	bool finish();
+};
+
+namespace mesher {
+
+	/// Adds the faces of the occupied voxels of mask slice z (curr) exposed to empty space in it or in slices z - 1 (prev) and z + 1 (next) to model
+	void meshSlice(const BitSlice& prev, const BitSlice& curr, const BitSlice& next, size_t z, ObjModel& model);
+
+	/// Adds the faces of the occupied voxels of mask slices [zBegin, zEnd) exposed to empty space (or the volume bounds) to model
+	/// Slices zBegin - 1 and zEnd are read as well to resolve the faces on the slab's seams
+	bool meshSlab(MaskSource& source, ObjModel& model, size_t zBegin, size_t zEnd);
+
+	/// Converts the entire mask to cubified polygon mesh, meshing Z slabs concurrently when the source can be cloned
+	/// The mesh is simplified before being written out if decimate is enabled
+	bool exportObj(MaskSource& source, std::string filename, float scale, const DecimateParams& decimate = DecimateParams(), const float* offset = nullptr);
+
+	/// Meshes mask slices [zBegin, zEnd) as exportObj would, and writes the faces to a partial mesh file for mergePartialObjs; slices zBegin - 1 and zEnd are read for the seams
+	bool exportPartialObj(MaskSource& source, std::string filename, float scale, size_t zBegin, size_t zEnd, const float* offset = nullptr);
+
+	/// Joins partial meshes covering the volume in increasing z into the mesh exportObj would have written, sharing the vertices on the seams
+	bool mergePartialObjs(const std::vector<std::string>& partFilenames, std::string filename, const DecimateParams& decimate = DecimateParams());
+
+	/// Simplifies model if decimate is enabled, then writes it to a wavefront file
+	bool writeObj(ObjModel& model, std::string filename, const DecimateParams& decimate = DecimateParams());
+
+}
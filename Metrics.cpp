@@ -0,0 +1,259 @@
+#include "Metrics.h"
+
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+
+#include "Bench.h"
+#include "MemoryBudget.h"
+#include "colours.h"
+
+
+std::atomic<bool> metrics::enabled{ false }, metrics::tracing{ false };
+
+/// Names of counters and stages in reports, in enum order
+static const char* COUNTER_NAMES[(size_t)metrics::Counter::COUNT] = { "bytes_read", "slices_loaded", "slices_evicted", "voxels_sampled", "faces_emitted", "hash_probes", "bytes_written" };
+static const char* STAGE_NAMES[(size_t)metrics::Stage::COUNT] = { "load_slice", "downscale", "mesh", "decimate", "write_obj", "write_png", "write_vol" };
+
+/// Totals of every thread that counted anything; kept until the process exits, so that the counts of finished threads still add up
+static std::mutex registryMutex;
+static std::vector<std::unique_ptr<metrics::ThreadMetrics>> registry;
+static std::chrono::steady_clock::time_point enabledAt, tracingAt;
+
+/// Totals of the calling thread, once it has counted anything, and the name it gets in traces
+static thread_local metrics::ThreadMetrics* threadMetrics = nullptr;
+static thread_local std::string threadName;
+
+metrics::ThreadMetrics::~ThreadMetrics() {
+	for (TraceChunk* chunk = firstChunk; chunk;) {
+		TraceChunk* next = chunk->next.load(std::memory_order_relaxed);
+		delete chunk;
+		chunk = next;
+	}
+}
+
+void metrics::enable() {
+	std::lock_guard<std::mutex> lock(registryMutex);
+	if (!enabled) {
+		enabledAt = std::chrono::steady_clock::now();
+		enabled = true;
+	}
+}
+
+void metrics::enableTracing() {
+	enable();
+	std::lock_guard<std::mutex> lock(registryMutex);
+	if (!tracing) {
+		tracingAt = std::chrono::steady_clock::now();
+		tracing = true;
+	}
+}
+
+void metrics::setThreadName(std::string name) {
+	threadName = name;
+	if (threadMetrics) {
+		std::lock_guard<std::mutex> lock(registryMutex);
+		threadMetrics->name = name;
+	}
+}
+
+metrics::ThreadMetrics& metrics::local() {
+	if (!threadMetrics) {
+		std::lock_guard<std::mutex> lock(registryMutex);
+		registry.emplace_back(new ThreadMetrics());
+		threadMetrics = registry.back().get();
+		threadMetrics->id = registry.size();
+		threadMetrics->name = threadName.empty() ? "thread " + std::to_string(threadMetrics->id) : threadName;
+	}
+	return *threadMetrics;
+}
+
+/// Appends a span to the calling thread's trace; spans that began before tracing are left out
+static void record(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+	if (start < tracingAt) return;
+	metrics::ThreadMetrics& thread = metrics::local();
+	const size_t index = thread.eventCount.load(std::memory_order_relaxed);
+	if (index % metrics::TraceChunk::SIZE == 0) {
+		metrics::TraceChunk* chunk = new metrics::TraceChunk();
+		if (thread.lastChunk) {
+			thread.lastChunk->next.store(chunk, std::memory_order_relaxed);
+		} else {
+			thread.firstChunk = chunk;
+		}
+		thread.lastChunk = chunk;
+	}
+	metrics::TraceEvent& event = thread.lastChunk->events[index % metrics::TraceChunk::SIZE];
+	event.name = name;
+	event.begin = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(start - tracingAt).count();
+	event.end = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - tracingAt).count();
+	thread.eventCount.store(index + 1, std::memory_order_release);
+}
+
+metrics::ScopedTimer::ScopedTimer(Stage stage) : stage(stage), active(isEnabled()) {
+	if (active) start = std::chrono::steady_clock::now();
+}
+
+metrics::ScopedTimer::~ScopedTimer() {
+	if (!active) return;
+	const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	if (tracing.load(std::memory_order_acquire)) {
+		record(STAGE_NAMES[(size_t)stage], start, end);
+	}
+	const uint64_t elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	ThreadMetrics& metrics = local();
+	std::atomic<uint64_t>& nanoseconds = metrics.nanoseconds[(size_t)stage];
+	std::atomic<uint64_t>& calls = metrics.calls[(size_t)stage];
+	nanoseconds.store(nanoseconds.load(std::memory_order_relaxed) + elapsed, std::memory_order_relaxed);
+	calls.store(calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+metrics::TraceSpan::TraceSpan(const char* name) : name(name), active(tracing.load(std::memory_order_acquire)) {
+	if (active) start = std::chrono::steady_clock::now();
+}
+
+metrics::TraceSpan::~TraceSpan() {
+	if (active) record(name, start, std::chrono::steady_clock::now());
+}
+
+uint64_t metrics::total(Counter counter) {
+	std::lock_guard<std::mutex> lock(registryMutex);
+	uint64_t sum = 0;
+	for (const auto& threadMetrics : registry) {
+		sum += threadMetrics->counts[(size_t)counter].load(std::memory_order_relaxed);
+	}
+	return sum;
+}
+
+/// Sums of the time and calls of a stage over all threads
+static void stageTotals(metrics::Stage stage, double& seconds, uint64_t& calls) {
+	std::lock_guard<std::mutex> lock(registryMutex);
+	uint64_t nanoseconds = 0;
+	calls = 0;
+	for (const auto& threadMetrics : registry) {
+		nanoseconds += threadMetrics->nanoseconds[(size_t)stage].load(std::memory_order_relaxed);
+		calls += threadMetrics->calls[(size_t)stage].load(std::memory_order_relaxed);
+	}
+	seconds = nanoseconds * 1e-9;
+}
+
+static double wallSeconds() {
+	return metrics::isEnabled() ? std::chrono::duration<double>(std::chrono::steady_clock::now() - enabledAt).count() : 0.0;
+}
+
+
+metrics::Progress::Progress(size_t total, size_t begin, std::string label) : total(total), begin(begin), label(label), start(std::chrono::steady_clock::now()) {
+	startRead = isEnabled() ? metrics::total(Counter::BYTES_READ) : 0;
+	startWritten = isEnabled() ? metrics::total(Counter::BYTES_WRITTEN) : 0;
+}
+
+void metrics::Progress::update(size_t done) {
+	if (!isEnabled()) {
+		printf("%s%zu of %zu\n", label.c_str(), done, total);
+		return;
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const double read = (metrics::total(Counter::BYTES_READ) - startRead) / (1024.0 * 1024.0);
+	const double written = (metrics::total(Counter::BYTES_WRITTEN) - startWritten) / (1024.0 * 1024.0);
+	const double perSecond = seconds > 0.0 ? 1.0 / seconds : 0.0;
+	if (done > begin && done < total) {
+		printf("%s%zu of %zu: read %.1f MB (%.1f MB/s), wrote %.1f MB (%.1f MB/s), %.1f s elapsed, about %.1f s left\n", label.c_str(), done, total,
+			read, read * perSecond, written, written * perSecond, seconds, seconds * (total - done) / (done - begin));
+	} else {
+		printf("%s%zu of %zu: read %.1f MB (%.1f MB/s), wrote %.1f MB (%.1f MB/s), %.1f s elapsed\n", label.c_str(), done, total,
+			read, read * perSecond, written, written * perSecond, seconds);
+	}
+}
+
+
+void metrics::print() {
+	const double wall = wallSeconds();
+	printf(BLUE "Metrics over %.2f s:\n" WHITE, wall);
+	for (size_t i = 0; i < (size_t)Counter::COUNT; ++i) {
+		printf("  %-16s %llu\n", COUNTER_NAMES[i], (unsigned long long)total((Counter)i));
+	}
+	for (size_t i = 0; i < (size_t)Stage::COUNT; ++i) {
+		double seconds;
+		uint64_t calls;
+		stageTotals((Stage)i, seconds, calls);
+		if (calls > 0) {
+			printf("  %-16s %.3f s over %llu calls (thread time)\n", STAGE_NAMES[i], seconds, (unsigned long long)calls);
+		}
+	}
+	const double read = total(Counter::BYTES_READ) / (1024.0 * 1024.0), written = total(Counter::BYTES_WRITTEN) / (1024.0 * 1024.0);
+	printf(BLUE "Read %.1f MB (%.1f MB/s), wrote %.1f MB (%.1f MB/s), peak memory %.1f MB.\n" WHITE, read, wall > 0.0 ? read / wall : 0.0, written, wall > 0.0 ? written / wall : 0.0,
+		bench::getPeakRss() / (1024.0 * 1024.0));
+}
+
+bool metrics::writeJson(std::string filename) {
+	std::ofstream file(filename);
+	if (!file) {
+		printf(RED "Cannot write metrics to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	const double wall = wallSeconds();
+	file << "{\n";
+	file << "  \"wall_seconds\": " << wall << ",\n";
+	file << "  \"peak_rss_bytes\": " << bench::getPeakRss() << ",\n";
+	file << "  \"budget_peak_bytes\": " << MemoryBudget::Current().getPeak() << ",\n";
+	file << "  \"budget_total_bytes\": " << MemoryBudget::Current().getTotal() << ",\n";
+	file << "  \"counters\": { ";
+	for (size_t i = 0; i < (size_t)Counter::COUNT; ++i) {
+		file << '"' << COUNTER_NAMES[i] << "\": " << total((Counter)i) << (i + 1 < (size_t)Counter::COUNT ? ", " : " },\n");
+	}
+	file << "  \"stages\": {\n";
+	for (size_t i = 0; i < (size_t)Stage::COUNT; ++i) {
+		double seconds;
+		uint64_t calls;
+		stageTotals((Stage)i, seconds, calls);
+		file << "    \"" << STAGE_NAMES[i] << "\": { \"thread_seconds\": " << seconds << ", \"calls\": " << calls << " }" << (i + 1 < (size_t)Stage::COUNT ? ",\n" : "\n");
+	}
+	file << "  },\n";
+	const double read = total(Counter::BYTES_READ) / (1024.0 * 1024.0), written = total(Counter::BYTES_WRITTEN) / (1024.0 * 1024.0);
+	file << "  \"read_mb_per_s\": " << (wall > 0.0 ? read / wall : 0.0) << ",\n";
+	file << "  \"written_mb_per_s\": " << (wall > 0.0 ? written / wall : 0.0) << ",\n";
+	file << "  \"voxels_per_s\": " << (wall > 0.0 ? total(Counter::VOXELS_SAMPLED) / wall : 0.0) << "\n";
+	file << "}\n";
+	return true;
+}
+
+bool metrics::writeTrace(std::string filename) {
+	std::ofstream file(filename);
+	if (!file) {
+		printf(RED "Cannot write trace to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(registryMutex);
+	file << "{\n\"displayTimeUnit\": \"ms\",\n\"traceEvents\": [\n";
+	file << "{ \"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": { \"name\": \"seals-vol\" } }";
+	std::vector<TraceEvent> events;
+	for (const auto& threadMetrics : registry) {
+		file << ",\n{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << threadMetrics->id << ", \"args\": { \"name\": \"" << threadMetrics->name << "\" } }";
+
+		// Only events published through eventCount are complete; the thread may still be adding more
+		const size_t count = threadMetrics->eventCount.load(std::memory_order_acquire);
+		events.clear();
+		const TraceChunk* chunk = threadMetrics->firstChunk;
+		for (size_t i = 0; i < count; ++i) {
+			if (i > 0 && i % TraceChunk::SIZE == 0) chunk = chunk->next.load(std::memory_order_relaxed);
+			events.push_back(chunk->events[i % TraceChunk::SIZE]);
+		}
+
+		// Spans are recorded as they end, so nested ones come first; viewers expect them by start time, enclosing spans first
+		std::sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) { return a.begin != b.begin ? a.begin < b.begin : a.end > b.end; });
+		char line[256];
+		for (const TraceEvent& event : events) {
+			snprintf(line, sizeof(line), ",\n{ \"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f }",
+				event.name, threadMetrics->id, event.begin * 1e-3, (event.end - event.begin) * 1e-3);
+			file << line;
+		}
+	}
+	file << "\n]\n}\n";
+	if (!file) {
+		printf(RED "Cannot write trace to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	return true;
+}
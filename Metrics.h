@@ -0,0 +1,141 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+
+/// Counters and stage timers of a run, kept per thread and summed when reported, and optionally a trace of the spans each thread spent in stages
+/// Everything is off until enable() gets called; until then, counting and timing cost a relaxed load of a flag
+namespace metrics {
+
+	enum class Counter {
+		BYTES_READ,			// volume data read from disk
+		SLICES_LOADED,		// full-resolution slices read into a VolIterator
+		SLICES_EVICTED,		// full-resolution slices dropped from a VolIterator
+		VOXELS_SAMPLED,		// full-resolution voxels summed into downscaled values
+		FACES_EMITTED,		// mesh triangles added, before merging or decimation
+		HASH_PROBES,		// lookups in the position and normal maps of obj models
+		BYTES_WRITTEN,		// meshes, slice images and volumes written out
+		COUNT
+	};
+
+	enum class Stage {
+		LOAD_SLICE,			// reading full-resolution slices
+		DOWNSCALE,			// averaging loaded slices into downscaled values
+		MESH,				// adding the faces of mask slices to a mesh
+		DECIMATE,			// simplifying meshes
+		WRITE_OBJ,			// formatting and writing meshes
+		WRITE_PNG,			// remapping and encoding slice images
+		WRITE_VOL,			// writing volumes
+		COUNT
+	};
+
+	/// Span of time a thread spent in a stage, in nanoseconds since tracing began; name is a string literal
+	struct TraceEvent {
+		const char* name;
+		uint64_t begin, end;
+	};
+
+	/// Fixed block of trace events; blocks of a thread are chained as it fills them
+	struct TraceChunk {
+		static constexpr size_t SIZE = 4096;
+		TraceEvent events[SIZE];
+		std::atomic<TraceChunk*> next{ nullptr };
+	};
+
+	/// Per-thread totals and trace; only the owning thread writes them, others read them when reporting
+	struct ThreadMetrics {
+		std::atomic<uint64_t> counts[(size_t)Counter::COUNT] = {};
+		std::atomic<uint64_t> nanoseconds[(size_t)Stage::COUNT] = {};
+		std::atomic<uint64_t> calls[(size_t)Stage::COUNT] = {};
+
+		/// Index and name of the thread in traces
+		size_t id = 0;
+		std::string name;
+
+		/// Events are written into the last chunk before eventCount gets raised past them, so readers only see complete events up to eventCount
+		TraceChunk* firstChunk = nullptr;
+		TraceChunk* lastChunk = nullptr;
+		std::atomic<size_t> eventCount{ 0 };
+
+		ThreadMetrics() = default;
+		ThreadMetrics(const ThreadMetrics&) = delete;
+		ThreadMetrics& operator=(const ThreadMetrics&) = delete;
+		~ThreadMetrics();
+	};
+
+	extern std::atomic<bool> enabled, tracing;
+
+	/// Turns counting and timing on for the rest of the process; the wall time of reports starts with the first call
+	void enable();
+	inline bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+	/// Turns metrics on, along with recording the spans of stages (and of the named spans below) for writeTrace; spans start from the first call
+	void enableTracing();
+	inline bool isTracing() { return tracing.load(std::memory_order_relaxed); }
+
+	/// Names the calling thread in traces (e.g. "worker 3"); threads are otherwise numbered in the order they first counted anything
+	void setThreadName(std::string name);
+
+	/// Totals of the calling thread, created on first use
+	ThreadMetrics& local();
+
+	/// Adds to a counter of the calling thread; a plain load and store, as no other thread writes it
+	inline void add(Counter counter, uint64_t amount = 1) {
+		if (isEnabled()) {
+			std::atomic<uint64_t>& count = local().counts[(size_t)counter];
+			count.store(count.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+		}
+	}
+
+	/// Times its scope as a call of stage; nested timers of other stages are counted in both
+	class ScopedTimer {
+		Stage stage;
+		bool active;
+		std::chrono::steady_clock::time_point start;
+	public:
+		explicit ScopedTimer(Stage stage);
+		~ScopedTimer();
+		ScopedTimer(const ScopedTimer&) = delete;
+		ScopedTimer& operator=(const ScopedTimer&) = delete;
+	};
+
+	/// Records its scope as a trace span named name (a string literal) when tracing, e.g. a slab task made of several stages
+	class TraceSpan {
+		const char* name;
+		bool active;
+		std::chrono::steady_clock::time_point start;
+	public:
+		explicit TraceSpan(const char* name);
+		~TraceSpan();
+		TraceSpan(const TraceSpan&) = delete;
+		TraceSpan& operator=(const TraceSpan&) = delete;
+	};
+
+	/// Prints "done of total" lines for a stage covering items [begin, total) as it progresses; with metrics enabled, the lines also show read and write throughput
+	/// since the stage began and an estimate of the time left
+	class Progress {
+		size_t total, begin;
+		std::string label;
+		std::chrono::steady_clock::time_point start;
+		uint64_t startRead, startWritten;
+	public:
+		explicit Progress(size_t total, size_t begin = 0, std::string label = "");
+		void update(size_t done);
+	};
+
+	/// Sum of a counter over all threads
+	uint64_t total(Counter counter);
+
+	/// Prints the counters and the time spent in each stage, summed over threads
+	void print();
+
+	/// Writes the counters, stage times, throughput and peak memory to a json file
+	bool writeJson(std::string filename);
+
+	/// Writes the spans recorded so far by every thread as a Chrome trace json file, which chrome://tracing and Perfetto can open
+	bool writeTrace(std::string filename);
+
+}
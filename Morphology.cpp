@@ -0,0 +1,115 @@
+#include "Morphology.h"
+
+#include <limits>
+#include <algorithm>
+
+
+BinaryMorphology::BinaryMorphology(MaskSource& source, bool dilate, size_t radius) :
+	source(&source), dilate(dilate), radius(radius),
+	window(((source.getWidth() + 63) / 64) * source.getHeight(), source.getDepth(), radius, dilate ? 0 : ~uint64_t(0), WordMorphologyOp{ dilate }) {}
+
+bool BinaryMorphology::readMask(size_t z, BitSlice& out) {
+	const size_t width = getWidth(), height = getHeight();
+	out.resize(width, height);
+	return window.get(z, out.words.data(), [&](size_t inputZ, uint64_t* dst) {
+		if (!source->readMask(inputZ, input)) {
+			return false;
+		}
+
+		// Along X, runs shrink or grow by the radius, except where they touch the volume bounds
+		rows.resize(width, height);
+		for (size_t y = 0; y < height; ++y) {
+			input.forEachRun(y, [&](size_t xBegin, size_t xEnd) {
+				if (dilate) {
+					rows.setRange(y, xBegin > radius ? xBegin - radius : 0, std::min(width, xEnd + radius));
+				} else {
+					const size_t begin = xBegin == 0 ? 0 : xBegin + radius, end = xEnd == width ? width : (xEnd > radius ? xEnd - radius : 0);
+					if (begin < end) rows.setRange(y, begin, end);
+				}
+			});
+		}
+
+		// Along Y, 64 columns at a time
+		vanherk::filter(rows.words.data(), dst, height, rows.wordsPerRow, radius, dilate ? 0 : ~uint64_t(0), WordMorphologyOp{ dilate }, g, h);
+		return true;
+	});
+}
+
+MaskSource* BinaryMorphology::clone() const {
+	MaskSource* sourceClone = source->clone();
+	if (!sourceClone) return nullptr;
+	BinaryMorphology* stage = new BinaryMorphology(*sourceClone, dilate, radius);
+	stage->ownedSource.reset(sourceClone);
+	return stage;
+}
+
+
+GreyMorphology::GreyMorphology(SliceSource& source, bool dilate, size_t radius) :
+	source(&source), dilate(dilate), radius(radius),
+	window(source.getWidth() * source.getHeight(), source.getDepth(), radius, dilate ? -std::numeric_limits<float>::infinity() : std::numeric_limits<float>::infinity(), ValueMorphologyOp{ dilate }) {}
+
+bool GreyMorphology::readSlice(size_t z, float* out) {
+	const size_t width = getWidth(), height = getHeight();
+	const float identity = dilate ? -std::numeric_limits<float>::infinity() : std::numeric_limits<float>::infinity();
+	return window.get(z, out, [&](size_t inputZ, float* dst) {
+		input.resize(width * height);
+		rows.resize(width * height);
+		if (!source->readSlice(inputZ, input.data())) {
+			return false;
+		}
+
+		// Along X one row at a time, then along Y on whole rows
+		for (size_t y = 0; y < height; ++y) {
+			vanherk::filter(&input[y * width], &rows[y * width], width, 1, radius, identity, ValueMorphologyOp{ dilate }, g, h);
+		}
+		vanherk::filter(rows.data(), dst, height, width, radius, identity, ValueMorphologyOp{ dilate }, g, h);
+		return true;
+	});
+}
+
+SliceSource* GreyMorphology::clone() const {
+	SliceSource* sourceClone = source->clone();
+	if (!sourceClone) return nullptr;
+	GreyMorphology* stage = new GreyMorphology(*sourceClone, dilate, radius);
+	stage->ownedSource.reset(sourceClone);
+	return stage;
+}
+
+
+bool morphology::parseOp(const std::string& name, MorphologyOp& op) {
+	if (name == "erode") op = MorphologyOp::ERODE;
+	else if (name == "dilate") op = MorphologyOp::DILATE;
+	else if (name == "open") op = MorphologyOp::OPEN;
+	else if (name == "close") op = MorphologyOp::CLOSE;
+	else return false;
+	return true;
+}
+
+/// Erosion and/or dilation steps making up op, in order
+static std::vector<bool> morphologySteps(MorphologyOp op) {
+	switch (op) {
+	case MorphologyOp::ERODE: return { false };
+	case MorphologyOp::DILATE: return { true };
+	case MorphologyOp::OPEN: return { false, true };
+	case MorphologyOp::CLOSE: return { true, false };
+	}
+	return {};
+}
+
+MaskSource& morphology::binary(MaskSource& source, MorphologyOp op, size_t radius, std::vector<std::unique_ptr<MaskSource>>& stages) {
+	MaskSource* last = &source;
+	for (bool dilate : morphologySteps(op)) {
+		stages.emplace_back(new BinaryMorphology(*last, dilate, radius));
+		last = stages.back().get();
+	}
+	return *last;
+}
+
+SliceSource& morphology::grey(SliceSource& source, MorphologyOp op, size_t radius, std::vector<std::unique_ptr<SliceSource>>& stages) {
+	SliceSource* last = &source;
+	for (bool dilate : morphologySteps(op)) {
+		stages.emplace_back(new GreyMorphology(*last, dilate, radius));
+		last = stages.back().get();
+	}
+	return *last;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+
+#include "BitSlice.h"
+#include "MaskSource.h"
+#include "SliceSource.h"
+#include "VanHerk.h"
+
+
+enum class MorphologyOp {
+	ERODE, DILATE, OPEN, CLOSE
+};
+
+
+/// Combines mask words: AND to erode, OR to dilate
+struct WordMorphologyOp {
+	bool dilate;
+	inline uint64_t operator()(uint64_t a, uint64_t b) const { return dilate ? a | b : a & b; }
+};
+
+/// Combines values: min to erode, max to dilate
+struct ValueMorphologyOp {
+	bool dilate;
+	inline float operator()(float a, float b) const { return dilate ? (a > b ? a : b) : (a < b ? a : b); }
+};
+
+
+/// Erodes or dilates a mask with a (2 radius + 1)^3 box; voxels outside the volume don't affect the result
+/// Each slice is filtered along X (on runs) and Y (on whole words), then along Z over a sliding window of slices
+class BinaryMorphology : public MaskSource {
+
+	/// Mask being filtered; owned when this stage was cloned
+	MaskSource* source;
+	std::unique_ptr<MaskSource> ownedSource;
+
+	bool dilate;
+	size_t radius;
+
+	ZWindow<uint64_t, WordMorphologyOp> window;
+	BitSlice input, rows;
+	std::vector<uint64_t> g, h;
+
+public:
+	BinaryMorphology(MaskSource& source, bool dilate, size_t radius);
+
+	size_t getWidth() const override { return source->getWidth(); }
+	size_t getHeight() const override { return source->getHeight(); }
+	size_t getDepth() const override { return source->getDepth(); }
+
+	bool readMask(size_t z, BitSlice& out) override;
+	MaskSource* clone() const override;
+};
+
+
+/// Greyscale erosion (min) or dilation (max) of slices with a (2 radius + 1)^3 box; voxels outside the volume don't affect the result
+/// Each slice is filtered along X and Y, then along Z over a sliding window of slices
+class GreyMorphology : public SliceSource {
+
+	/// Values being filtered; owned when this stage was cloned
+	SliceSource* source;
+	std::unique_ptr<SliceSource> ownedSource;
+
+	bool dilate;
+	size_t radius;
+
+	ZWindow<float, ValueMorphologyOp> window;
+	std::vector<float> input, rows, g, h;
+
+public:
+	GreyMorphology(SliceSource& source, bool dilate, size_t radius);
+
+	size_t getWidth() const override { return source->getWidth(); }
+	size_t getHeight() const override { return source->getHeight(); }
+	size_t getDepth() const override { return source->getDepth(); }
+
+	bool readSlice(size_t z, float* out) override;
+	SliceSource* clone() const override;
+};
+
+
+namespace morphology {
+
+	/// Reads "erode", "dilate", "open" or "close"; returns false for anything else
+	bool parseOp(const std::string& name, MorphologyOp& op);
+
+	/// Appends the erosion/dilation stages implementing op over source to stages (which own them), and returns the final stage
+	MaskSource& binary(MaskSource& source, MorphologyOp op, size_t radius, std::vector<std::unique_ptr<MaskSource>>& stages);
+	SliceSource& grey(SliceSource& source, MorphologyOp op, size_t radius, std::vector<std::unique_ptr<SliceSource>>& stages);
+
+}
@@ -3,15 +3,72 @@
 
 #include <fstream>
 #include <cassert>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
 
+#include "colours.h"
+#include "ThreadPool.h"
+#include "Metrics.h"
 
-size_t ObjModel::addPosition(float x, float y, float z) {
+
+/// Infers the normal and tangent for a face pointing towards direction; the bitangent is their cross-product
+static void directionBasis(ObjModel::Direction direction, int n[3], int t[3], int b[3]) {
+	n[0] = n[1] = n[2] = t[0] = t[1] = t[2] = 0;
+	switch (direction) {
+	case ObjModel::Direction::POS_X:
+		n[0] = 1;
+		t[1] = 1;
+		break;
+	case ObjModel::Direction::NEG_X:
+		n[0] = -1;
+		t[1] = 1;
+		break;
+	case ObjModel::Direction::POS_Y:
+		n[1] = 1;
+		t[0] = 1;
+		break;
+	case ObjModel::Direction::NEG_Y:
+		n[1] = -1;
+		t[0] = 1;
+		break;
+	case ObjModel::Direction::POS_Z:
+		n[2] = 1;
+		t[1] = 1;
+		break;
+	case ObjModel::Direction::NEG_Z:
+		n[2] = -1;
+		t[1] = 1;
+		break;
+	default:
+		assert(false);
+		break;
+	}
+
+	// cross-product to find bitangent
+	b[0] = n[1] * t[2] - n[2] * t[1];
+	b[1] = n[2] * t[0] - n[0] * t[2];
+	b[2] = n[0] * t[1] - n[1] * t[0];
+}
+
+/// Returns the index the next vertex appended to values will have, after flushed ones, checking that it still fits into 32 bits
+static uint32_t nextIndex(const std::vector<float>& values, size_t flushed) {
+	size_t idx = flushed + values.size() / 3;
+	if (idx >= ObjModel::NO_INDEX) {
+		printf(RED "Obj model exceeds %u vertices, cannot index any more.\n" WHITE, ObjModel::NO_INDEX);
+		exit(1);
+	}
+	return (uint32_t)idx;
+}
+
+uint32_t ObjModel::addPosition(float x, float y, float z) {
 	float3 key = { x, y, z };
+	metrics::add(metrics::Counter::HASH_PROBES);
 	auto found = knownPositions.find(key);
 	if (found != knownPositions.end()) {
 		return found->second;
 	}
-	const size_t idx = positions.size() / 3;
+	const uint32_t idx = nextIndex(positions, flushedPositions);
 	positions.push_back(x);
 	positions.push_back(y);
 	positions.push_back(z);
@@ -19,13 +76,14 @@ size_t ObjModel::addPosition(float x, float y, float z) {
 	return idx;
 }
 
-size_t ObjModel::addNormal(float x, float y, float z) {
+uint32_t ObjModel::addNormal(float x, float y, float z) {
 	float3 key = { x, y, z };
+	metrics::add(metrics::Counter::HASH_PROBES);
 	auto found = knownNormals.find(key);
 	if (found != knownNormals.end()) {
 		return found->second;
 	}
-	size_t idx = normals.size() / 3;
+	uint32_t idx = nextIndex(normals, flushedNormals);
 	normals.push_back(x);
 	normals.push_back(y);
 	normals.push_back(z);
@@ -33,7 +91,8 @@ size_t ObjModel::addNormal(float x, float y, float z) {
 	return idx;
 }
 
-void ObjModel::addTri(size_t a, size_t b, size_t c, size_t na, size_t nb, size_t nc) {
+void ObjModel::addTri(uint32_t a, uint32_t b, uint32_t c, uint32_t na, uint32_t nb, uint32_t nc) {
+	metrics::add(metrics::Counter::FACES_EMITTED);
 	positionIndices.push_back(a);
 	positionIndices.push_back(b);
 	positionIndices.push_back(c);
@@ -45,42 +104,11 @@ void ObjModel::addTri(size_t a, size_t b, size_t c, size_t na, size_t nb, size_t
 void ObjModel::addAASquare(float x, float y, float z, ObjModel::Direction direction, float hsize) {
 	
 	// infer normal and tangent/bitangent
-	float nx, ny, nz, tx, ty, tz, bx, by, bz;
-	nx = ny = nz = tx = ty = tz = bx = by = bz = 0.0f;
-	switch (direction) {
-	case ObjModel::Direction::POS_X:
-		nx = 1.0f;
-		ty = 1.0f;
-		break;
-	case ObjModel::Direction::NEG_X:
-		nx = -1.0f;
-		ty = 1.0f;
-		break;
-	case ObjModel::Direction::POS_Y:
-		ny = 1.0f;
-		tx = 1.0f;
-		break;
-	case ObjModel::Direction::NEG_Y:
-		ny = -1.0f;
-		tx = 1.0f;
-		break;
-	case ObjModel::Direction::POS_Z:
-		nz = 1.0f;
-		ty = 1.0f;
-		break;
-	case ObjModel::Direction::NEG_Z:
-		nz = -1.0f;
-		ty = 1.0f;
-		break;
-	default:
-		assert(false);
-		break;
-	}
-
-	// cross-product to find bitangent
-	bx = ny * tz - nz * ty;
-	by = nz * tx - nx * tz;
-	bz = nx * ty - ny * tx;
+	int n[3], t[3], b[3];
+	directionBasis(direction, n, t, b);
+	float nx = (float)n[0], ny = (float)n[1], nz = (float)n[2];
+	float tx = (float)t[0], ty = (float)t[1], tz = (float)t[2];
+	float bx = (float)b[0], by = (float)b[1], bz = (float)b[2];
 
 	// add 4 new vertices
 	//
@@ -89,40 +117,263 @@ void ObjModel::addAASquare(float x, float y, float z, ObjModel::Direction direct
 	//		|	\  |
 	//	  A ._____\. C
 	//
-	size_t a = addPosition(x - hsize * tx - hsize * bx, y - hsize * ty - hsize * by, z - hsize * tz - hsize * bz);
-	size_t b = addPosition(x + hsize * tx - hsize * bx, y + hsize * ty - hsize * by, z + hsize * tz - hsize * bz);
-	size_t c = addPosition(x - hsize * tx + hsize * bx, y - hsize * ty + hsize * by, z - hsize * tz + hsize * bz);
-	size_t d = addPosition(x + hsize * tx + hsize * bx, y + hsize * ty + hsize * by, z + hsize * tz + hsize * bz);
-	size_t n = addNormal(nx, ny, nz);
+	uint32_t va = addPosition(x - hsize * tx - hsize * bx, y - hsize * ty - hsize * by, z - hsize * tz - hsize * bz);
+	uint32_t vb = addPosition(x + hsize * tx - hsize * bx, y + hsize * ty - hsize * by, z + hsize * tz - hsize * bz);
+	uint32_t vc = addPosition(x - hsize * tx + hsize * bx, y - hsize * ty + hsize * by, z - hsize * tz + hsize * bz);
+	uint32_t vd = addPosition(x + hsize * tx + hsize * bx, y + hsize * ty + hsize * by, z + hsize * tz + hsize * bz);
+	uint32_t vn = addNormal(nx, ny, nz);
 
-	addTri(a, b, c, n, n, n);
-	addTri(c, b, d, n, n, n);
+	addTri(va, vb, vc, vn, vn, vn);
+	addTri(vc, vb, vd, vn, vn, vn);
 
 }
 
-bool ObjModel::writeToFile(std::string filename) {
+void ObjModel::setLatticeSize(size_t width, size_t height) {
+	latticeWidth = width;
+	latticeHeight = height;
+	latticeZ = 0;
+	for (auto& plane : latticePlanes) {
+		plane.assign((width + 1) * (height + 1), NO_INDEX);
+	}
+}
 
-	std::ofstream file(filename);
+uint32_t ObjModel::addLatticePosition(size_t cx, size_t cy, size_t cz) {
+	assert(cx <= latticeWidth && cy <= latticeHeight);
+	assert(cz == latticeZ || cz == latticeZ + 1);
+	uint32_t& known = latticePlanes[cz - latticeZ][cy * (latticeWidth + 1) + cx];
+	if (known == NO_INDEX) {
+		known = nextIndex(positions, flushedPositions);
+		positions.push_back(cx - 0.5f);
+		positions.push_back(cy - 0.5f);
+		positions.push_back(cz - 0.5f);
+	}
+	return known;
+}
 
-	// Write positions
-	for (size_t i = 0, s = positions.size(); i < s; i += 3) {
-		file << "v " << positions[i] << ' ' << positions[i + 1] << ' ' << positions[i + 2] << "\n";
+void ObjModel::addLatticeSquare(size_t x, size_t y, size_t z, ObjModel::Direction direction) {
+
+	// Slide the window of corner planes so that it covers z and z + 1
+	if (z != latticeZ) {
+		if (z == latticeZ + 1) {
+			std::swap(latticePlanes[0], latticePlanes[1]);
+			std::fill(latticePlanes[1].begin(), latticePlanes[1].end(), NO_INDEX);
+		} else {
+			for (auto& plane : latticePlanes) {
+				std::fill(plane.begin(), plane.end(), NO_INDEX);
+			}
+		}
+		latticeZ = z;
 	}
 
-	// Write normals
-	for (size_t i = 0, s = normals.size(); i < s; i += 3) {
-		file << "vn " << normals[i] << ' ' << normals[i + 1] << ' ' << normals[i + 2] << "\n";
+	int n[3], t[3], b[3];
+	directionBasis(direction, n, t, b);
+
+	// Same corners as addAASquare, in doubled coordinates so that face centres and corners are all integers
+	// The voxel centre {x, y, z} is at doubled lattice coordinate {2x + 1, 2y + 1, 2z + 1}
+	const long long cx = 2 * (long long)x + 1 + n[0], cy = 2 * (long long)y + 1 + n[1], cz = 2 * (long long)z + 1 + n[2];
+	auto corner = [&](int st, int sb) {
+		return addLatticePosition(
+			(size_t)((cx + st * t[0] + sb * b[0]) / 2),
+			(size_t)((cy + st * t[1] + sb * b[1]) / 2),
+			(size_t)((cz + st * t[2] + sb * b[2]) / 2));
+	};
+	uint32_t va = corner(-1, -1);
+	uint32_t vb = corner(1, -1);
+	uint32_t vc = corner(-1, 1);
+	uint32_t vd = corner(1, 1);
+
+	uint32_t& vn = directionNormals[(int)direction];
+	if (vn == NO_INDEX) {
+		vn = addNormal((float)n[0], (float)n[1], (float)n[2]);
+	}
+
+	addTri(va, vb, vc, vn, vn, vn);
+	addTri(vc, vb, vd, vn, vn, vn);
+}
+
+void ObjModel::mergeLatticeSlab(ObjModel& slab, size_t zBegin, size_t zEnd) {
+	assert(slab.latticeWidth == latticeWidth && slab.latticeHeight == latticeHeight);
+	assert(slab.flushedPositions == 0 && slab.flushedNormals == 0);
+
+	// latticePlanes[0] holds the global indices of corner plane latticeZ, the top of the previously merged slab
+	if (latticeZ != zBegin) {
+		std::fill(latticePlanes[0].begin(), latticePlanes[0].end(), NO_INDEX);
+	}
+	auto cornerOf = [&](size_t i, size_t& cx, size_t& cy, size_t& cz) {
+		cx = (size_t)(slab.positions[i * 3] + 0.5f);
+		cy = (size_t)(slab.positions[i * 3 + 1] + 0.5f);
+		cz = (size_t)(slab.positions[i * 3 + 2] + 0.5f);
+	};
+
+	// Remap slab vertices, reusing the ones on the seam; slab vertices were created in face order, so new ones keep the serial order
+	const size_t slabVertices = slab.positions.size() / 3;
+	std::vector<uint32_t> remap(slabVertices);
+	positions.reserve(positions.size() + slab.positions.size());
+	for (size_t i = 0; i < slabVertices; ++i) {
+		size_t cx, cy, cz;
+		cornerOf(i, cx, cy, cz);
+		uint32_t known = cz == zBegin ? latticePlanes[0][cy * (latticeWidth + 1) + cx] : NO_INDEX;
+		if (known == NO_INDEX) {
+			known = nextIndex(positions, flushedPositions);
+			positions.insert(positions.end(), &slab.positions[i * 3], &slab.positions[i * 3 + 3]);
+		}
+		remap[i] = known;
+	}
+
+	// Record the top corner plane for the next slab
+	std::fill(latticePlanes[0].begin(), latticePlanes[0].end(), NO_INDEX);
+	std::fill(latticePlanes[1].begin(), latticePlanes[1].end(), NO_INDEX);
+	for (size_t i = 0; i < slabVertices; ++i) {
+		size_t cx, cy, cz;
+		cornerOf(i, cx, cy, cz);
+		if (cz == zEnd) {
+			latticePlanes[0][cy * (latticeWidth + 1) + cx] = remap[i];
+		}
+	}
+	latticeZ = zEnd;
+
+	// Remap normals and faces
+	std::vector<uint32_t> normalRemap(slab.normals.size() / 3);
+	for (size_t i = 0; i < normalRemap.size(); ++i) {
+		normalRemap[i] = addNormal(slab.normals[i * 3], slab.normals[i * 3 + 1], slab.normals[i * 3 + 2]);
+	}
+	positionIndices.reserve(positionIndices.size() + slab.positionIndices.size());
+	normalIndices.reserve(normalIndices.size() + slab.normalIndices.size());
+	for (uint32_t idx : slab.positionIndices) {
+		positionIndices.push_back(remap[idx]);
+	}
+	for (uint32_t idx : slab.normalIndices) {
+		normalIndices.push_back(normalRemap[idx]);
+	}
+
+	slab = ObjModel();
+}
+
+/// Formats count records in chunks of chunkRecords on the thread pool, each into its own buffer, and appends the buffers to file in order
+/// format(i, cursor) writes record i (at most maxRecordSize chars) starting at cursor and returns the new cursor
+template<typename Formatter>
+static bool writeBlock(std::ofstream& file, size_t count, size_t maxRecordSize, const Formatter& format, size_t& bytesWritten) {
+	constexpr size_t chunkRecords = 1 << 16;
+	ThreadPool& pool = ThreadPool::Global();
+	const size_t chunks = (count + chunkRecords - 1) / chunkRecords;
+	const size_t batchChunks = pool.getThreadCount() * 2; // bounds the memory held by formatted text at any one time
+	std::vector<std::vector<char>> buffers(std::min(chunks, batchChunks));
+	std::vector<size_t> lengths(buffers.size());
+
+	for (size_t batch = 0; batch < chunks; batch += batchChunks) {
+		const size_t batchEnd = std::min(chunks, batch + batchChunks);
+		pool.parallelFor(batch, batchEnd, 1, [&](size_t chunkBegin, size_t chunkEnd) {
+			for (size_t chunk = chunkBegin; chunk < chunkEnd; ++chunk) {
+				std::vector<char>& buffer = buffers[chunk - batch];
+				const size_t first = chunk * chunkRecords, last = std::min(count, first + chunkRecords);
+				buffer.resize((last - first) * maxRecordSize);
+				char* cursor = buffer.data();
+				for (size_t i = first; i < last; ++i) {
+					cursor = format(i, cursor);
+				}
+				lengths[chunk - batch] = cursor - buffer.data();
+			}
+		});
+		for (size_t chunk = batch; chunk < batchEnd; ++chunk) {
+			file.write(buffers[chunk - batch].data(), (std::streamsize)lengths[chunk - batch]);
+			bytesWritten += lengths[chunk - batch];
+		}
+		if (!file) return false;
 	}
+	return true;
+}
+
+/// Writes a float at cursor with 6 significant digits, matching the default ostream formatting; at most 16 chars
+static inline char* writeNumber(char* cursor, float value) {
+	return std::to_chars(cursor, cursor + 16, value, std::chars_format::general, 6).ptr;
+}
+
+/// Writes an integer at cursor; at most 20 chars
+static inline char* writeNumber(char* cursor, uint64_t value) {
+	return std::to_chars(cursor, cursor + 20, value).ptr;
+}
+
+bool ObjModel::flush(std::ofstream& file, size_t& bytesWritten) {
+
+	metrics::ScopedTimer timer(metrics::Stage::WRITE_OBJ);
+	const size_t startBytes = bytesWritten;
+
+	// Write positions
+	bool success = writeBlock(file, positions.size() / 3, 64, [&](size_t i, char* cursor) {
+		const float* p = &positions[i * 3];
+		*cursor++ = 'v';
+		*cursor++ = ' ';
+		cursor = writeNumber(cursor, (p[0] + offset[0]) * scale);
+		*cursor++ = ' ';
+		cursor = writeNumber(cursor, (p[1] + offset[1]) * scale);
+		*cursor++ = ' ';
+		cursor = writeNumber(cursor, (p[2] + offset[2]) * scale);
+		*cursor++ = '\n';
+		return cursor;
+	}, bytesWritten);
+
+	// Write normals
+	success = success && writeBlock(file, normals.size() / 3, 64, [&](size_t i, char* cursor) {
+		const float* n = &normals[i * 3];
+		*cursor++ = 'v';
+		*cursor++ = 'n';
+		*cursor++ = ' ';
+		cursor = writeNumber(cursor, n[0]);
+		*cursor++ = ' ';
+		cursor = writeNumber(cursor, n[1]);
+		*cursor++ = ' ';
+		cursor = writeNumber(cursor, n[2]);
+		*cursor++ = '\n';
+		return cursor;
+	}, bytesWritten);
 
 	// Write faces
 	assert(positionIndices.size() == normalIndices.size());
-	for (size_t i = 0, s = positionIndices.size(); i < s; i += 3) {
-		file << "f " << positionIndices[i]+1 << "//" << normalIndices[i]+1 << ' '
-					 << positionIndices[i + 1]+1 << "//" << normalIndices[i + 1]+1 << ' '
-					 << positionIndices[i + 2]+1 << "//" << normalIndices[i + 2]+1 << "\n";
-	}
+	success = success && writeBlock(file, positionIndices.size() / 3, 128, [&](size_t i, char* cursor) {
+		*cursor++ = 'f';
+		for (size_t v = i * 3; v < i * 3 + 3; ++v) {
+			*cursor++ = ' ';
+			cursor = writeNumber(cursor, (uint64_t)positionIndices[v] + 1);
+			*cursor++ = '/';
+			*cursor++ = '/';
+			cursor = writeNumber(cursor, (uint64_t)normalIndices[v] + 1);
+		}
+		*cursor++ = '\n';
+		return cursor;
+	}, bytesWritten);
+	metrics::add(metrics::Counter::BYTES_WRITTEN, bytesWritten - startBytes);
 
+	// Free what was written; the lattice and the maps of known positions and normals keep their indices
+	flushedPositions += positions.size() / 3;
+	flushedNormals += normals.size() / 3;
+	std::vector<float>().swap(positions);
+	std::vector<float>().swap(normals);
+	std::vector<uint32_t>().swap(positionIndices);
+	std::vector<uint32_t>().swap(normalIndices);
+	return success;
+}
+
+bool ObjModel::writeToFile(std::string filename) {
+
+	auto start = std::chrono::steady_clock::now();
+	std::ofstream file(filename, std::ios::binary);
+	if (!file) return false;
+	size_t bytesWritten = 0;
+	const bool success = flush(file, bytesWritten);
 	file.close();
+	if (!success || !file) return false;
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double megabytes = bytesWritten / (1024.0 * 1024.0);
+	printf("Wrote %.1f MB to %s in %.2f s (%.1f MB/s).\n", megabytes, filename.c_str(), seconds, seconds > 0 ? megabytes / seconds : 0.0);
 
 	return true;
 }
+
+size_t ObjModel::getMemoryBytes() const {
+
+	// Hash map nodes hold a key, an index, a next pointer and the cached hash, on top of a bucket pointer each
+	const size_t mapEntryBytes = sizeof(float3) + sizeof(uint32_t) + 2 * sizeof(void*) + sizeof(size_t);
+	return positions.capacity() * sizeof(float) + normals.capacity() * sizeof(float) + positionIndices.capacity() * sizeof(uint32_t) + normalIndices.capacity() * sizeof(uint32_t) +
+		(latticePlanes[0].capacity() + latticePlanes[1].capacity()) * sizeof(uint32_t) + (knownPositions.size() + knownNormals.size()) * mapEntryBytes;
+}
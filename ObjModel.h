@@ -2,21 +2,34 @@
 
 #include <vector>
 #include <string>
+#include <fstream>
+#include <cstdint>
 #include <unordered_map>
 
-// @todo: should allow flushing contents of indices & vertices into the file every now and then to prevent keeping too much in RAM
 struct ObjModel {
 
 	enum class Direction {
 		POS_X, NEG_X, POS_Y, NEG_Y, POS_Z, NEG_Z
 	};
 
-	// Stride = 3 on all 4 arrays below
-	std::vector<size_t> positionIndices;
+	/// Index value used to mark lattice corners that have no vertex yet
+	static constexpr uint32_t NO_INDEX = UINT32_MAX;
+
+	/// Uniform scale applied to positions when writing out; positions are kept unscaled until then
+	float scale = 1.0f;
+
+	/// Translation applied to positions before scaling when writing out, e.g. the corner of a cropped region
+	float offset[3] = { 0.0f, 0.0f, 0.0f };
+
+	// Stride = 3 on all 4 arrays below; they only hold what was added since the last flush
+	std::vector<uint32_t> positionIndices;
 	std::vector<float> positions;
-	std::vector<size_t> normalIndices;
+	std::vector<uint32_t> normalIndices;
 	std::vector<float> normals;
 
+	// Positions and normals already flushed to file; indices count them, so the first held position has index flushedPositions
+	size_t flushedPositions = 0, flushedNormals = 0;
+
 	struct float3 {
 		float x, y, z;
 		inline bool operator==(const float3& other) const {
@@ -30,19 +43,48 @@ struct ObjModel {
 		}
 	};
 
-	// Maps position -> index in positions
-	std::unordered_map<float3, size_t, float3_hash> knownPositions;
+	// Maps position -> index in positions (only used by addPosition; lattice vertices are tracked separately below)
+	std::unordered_map<float3, uint32_t, float3_hash> knownPositions;
 	// Maps normal -> index in normals
-	std::unordered_map<float3, size_t, float3_hash> knownNormals;
+	std::unordered_map<float3, uint32_t, float3_hash> knownNormals;
+
+	// Lattice of voxel corners, (latticeWidth + 1) x (latticeHeight + 1) per plane
+	// Only the two corner planes touched by the current voxel slice (latticeZ and latticeZ + 1) are kept, each mapping corner -> index in positions
+	size_t latticeWidth = 0, latticeHeight = 0, latticeZ = 0;
+	std::vector<uint32_t> latticePlanes[2];
+	// Index in normals for each of the 6 directions, filled in on first use
+	uint32_t directionNormals[6] = { NO_INDEX, NO_INDEX, NO_INDEX, NO_INDEX, NO_INDEX, NO_INDEX };
 
 	/// Adds a vertex to the mesh with a position and normal and return the position and normal indices
-	size_t addPosition(float x, float y, float z);
-	size_t addNormal(float x, float y, float z);
-	void addTri(size_t a, size_t b, size_t c, size_t na, size_t nb, size_t nc);
+	uint32_t addPosition(float x, float y, float z);
+	uint32_t addNormal(float x, float y, float z);
+	void addTri(uint32_t a, uint32_t b, uint32_t c, uint32_t na, uint32_t nb, uint32_t nc);
 
 	/// Adds an axis-aligned square face to the model, centred at {x, y, z} with normal along direction, and with half-side-length hsize
 	void addAASquare(float x, float y, float z, Direction direction, float hsize);
 
+	/// Sets the size in voxels of the slices passed to addLatticeSquare, and resets the lattice window
+	void setLatticeSize(size_t width, size_t height);
+
+	/// Returns the index of the vertex at lattice corner {cx, cy, cz}, adding it if needed; corner {cx, cy, cz} sits at {cx - 0.5, cy - 0.5, cz - 0.5}
+	/// cz must be latticeZ or latticeZ + 1
+	uint32_t addLatticePosition(size_t cx, size_t cy, size_t cz);
+
+	/// Adds the face of unit voxel {x, y, z} pointing towards direction; same geometry as addAASquare(x, y, z, direction, 0.5) without hashing
+	/// Voxels should be added in increasing z order, as vertices are only shared with the previous slice
+	void addLatticeSquare(size_t x, size_t y, size_t z, Direction direction);
+
+	/// Appends the faces of slab, a model built with addLatticeSquare over voxel slices [zBegin, zEnd) of the same lattice
+	/// Vertices on corner plane zBegin are shared with the previously merged slab, which must have ended at zBegin; the slab is emptied
+	void mergeLatticeSlab(ObjModel& slab, size_t zBegin, size_t zEnd);
+
+	/// Appends the positions, normals and faces held to an obj file, then drops them to free memory; faces added afterwards can still use the vertices written
+	/// A model written in one flush is the same file writeToFile writes
+	bool flush(std::ofstream& file, size_t& bytesWritten);
+
 	/// Writes the obj model out to a file
 	bool writeToFile(std::string filename);
+
+	/// Estimate of the memory held by the model, in bytes
+	size_t getMemoryBytes() const;
 };
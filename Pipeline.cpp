@@ -0,0 +1,261 @@
+#include "Pipeline.h"
+
+#include <cmath>
+#include <cstdio>
+#include <atomic>
+#include <future>
+#include <limits>
+#include <algorithm>
+
+#include "SliceSource.h"
+#include "MaskSource.h"
+#include "Mesher.h"
+#include "ThreadPool.h"
+#include "Metrics.h"
+#include "colours.h"
+
+
+PngSink::PngSink(std::function<std::string(size_t)> filename, size_t step, float minThreshold, float maxThreshold, bool useValues, bool useMask) :
+	filename(filename), step(std::max<size_t>(1, step)), minThreshold(minThreshold), maxThreshold(maxThreshold), useValues(useValues), useMask(useMask) {}
+
+bool PngSink::consume(const SliceWindow& window) {
+	if (window.z % step != 0) {
+		return true;
+	}
+	return slices::writePng(useValues ? window.values : nullptr, useMask ? window.mask : nullptr, window.width, window.height, filename(window.z), minThreshold, maxThreshold);
+}
+
+
+ObjSink::ObjSink(std::string filename, size_t width, size_t height, float scale, const DecimateParams& decimate, const float* offset) : filename(filename), decimate(decimate), writer(model, filename, decimate) {
+	model.scale = scale;
+	if (offset) std::copy(offset, offset + 3, model.offset);
+	model.setLatticeSize(width, height);
+}
+
+bool ObjSink::consume(const SliceWindow& window) {
+	mesher::meshSlice(*window.prevMask, *window.mask, *window.nextMask, window.z, model);
+	return writer.update();
+}
+
+bool ObjSink::finish() {
+	return writer.finish();
+}
+
+
+StatsSink::StatsSink(float threshold, double voxelVolume, std::string csvFilename, std::string jsonFilename) :
+	threshold(threshold), voxelVolume(voxelVolume), csvFilename(csvFilename), jsonFilename(jsonFilename) {}
+
+bool StatsSink::consume(const SliceWindow& window) {
+	slices.resize(window.depth);
+	slices[window.z].add(window.values, window.width * window.height, threshold);
+	return true;
+}
+
+bool StatsSink::finish() {
+	stats::print(slices, voxelVolume);
+	return stats::writeCsv(slices, csvFilename) && stats::writeJson(slices, threshold, voxelVolume, jsonFilename);
+}
+
+
+HistogramSink::HistogramSink(size_t bins, float min, float max, std::string filename) : min(min), max(max), filename(filename), counts(std::max<size_t>(1, bins), 0) {}
+
+bool HistogramSink::consume(const SliceWindow& window) {
+	const size_t bins = counts.size();
+	const double scale = bins / ((double)max - min);
+	for (size_t i = 0, s = window.width * window.height; i < s; ++i) {
+		const float v = window.values[i];
+		if (v < min) {
+			++below;
+		} else if (v >= max) {
+			++above;
+		} else if (v == v) {
+			++counts[std::min(bins - 1, (size_t)((v - min) * scale))];
+		} else {
+			++nan;
+		}
+	}
+	return true;
+}
+
+bool HistogramSink::finish() {
+	std::ofstream file(filename);
+	if (!file) {
+		printf(RED "Cannot write value histogram to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	const size_t bins = counts.size();
+	file << "value_from,value_to,voxels\n";
+	file << "-inf," << min << ',' << below << "\n";
+	for (size_t bin = 0; bin < bins; ++bin) {
+		file << min + ((double)max - min) * bin / bins << ',' << min + ((double)max - min) * (bin + 1) / bins << ',' << counts[bin] << "\n";
+	}
+	file << max << ",inf," << above << "\n";
+	if (nan > 0) {
+		printf(YELLOW "%llu NaN values left out of the histogram.\n" WHITE, nan);
+	}
+	return true;
+}
+
+
+ProjectionSink::ProjectionSink(std::string prefix) : prefix(prefix) {}
+
+bool ProjectionSink::consume(const SliceWindow& window) {
+	const size_t z = window.z;
+	if (alongZ.empty()) {
+		width = window.width;
+		height = window.height;
+		depth = window.depth;
+		alongX.assign(height * depth, -std::numeric_limits<float>::infinity());
+		alongY.assign(width * depth, -std::numeric_limits<float>::infinity());
+		alongZ.assign(width * height, -std::numeric_limits<float>::infinity());
+	}
+
+	// Comparisons are false for NaN, which leaves it out of every maximum
+	float* rowY = &alongY[z * width];
+	for (size_t y = 0; y < height; ++y) {
+		const float* row = &window.values[y * width];
+		float* rowZ = &alongZ[y * width];
+		float maxX = -std::numeric_limits<float>::infinity();
+		for (size_t x = 0; x < width; ++x) {
+			const float v = row[x];
+			maxX = v > maxX ? v : maxX;
+			rowY[x] = v > rowY[x] ? v : rowY[x];
+			rowZ[x] = v > rowZ[x] ? v : rowZ[x];
+		}
+		alongX[z * height + y] = maxX;
+	}
+	return true;
+}
+
+bool ProjectionSink::writeProjection(const std::vector<float>& projection, size_t width, size_t height, std::string filename) const {
+	float lo = std::numeric_limits<float>::infinity(), hi = -std::numeric_limits<float>::infinity();
+	for (float v : projection) {
+		if (std::isfinite(v)) {
+			lo = std::min(lo, v);
+			hi = std::max(hi, v);
+		}
+	}
+
+	// A flat projection comes out white wherever it has values
+	if (lo > hi) lo = hi = 0.0f;
+	if (lo == hi) lo = hi - 1.0f;
+	return slices::writePng(projection.data(), nullptr, width, height, filename, lo, hi);
+}
+
+bool ProjectionSink::finish() {
+	return writeProjection(alongX, height, depth, prefix + "x.png") && writeProjection(alongY, width, depth, prefix + "y.png") && writeProjection(alongZ, width, height, prefix + "z.png");
+}
+
+
+VolSink::VolSink(std::string filename) : filename(filename), file(filename, std::ios::binary) {}
+
+bool VolSink::consume(const SliceWindow& window) {
+	metrics::ScopedTimer timer(metrics::Stage::WRITE_VOL);
+	if (!file.write((const char*)window.values, window.width * window.height * sizeof(float))) {
+		printf(RED "Cannot write volume to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	metrics::add(metrics::Counter::BYTES_WRITTEN, window.width * window.height * sizeof(float));
+	return true;
+}
+
+bool VolSink::finish() {
+	file.close();
+	if (!file) {
+		printf(RED "Cannot write volume to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+
+bool pipeline::run(SliceSource* values, MaskSource* mask, const std::vector<SliceSink*>& sinks) {
+	bool readValues = false, readMask = false, readNeighbours = false;
+	for (SliceSink* sink : sinks) {
+		readValues = readValues || sink->needsValues();
+		readMask = readMask || sink->needsMask() || sink->needsMaskNeighbours();
+		readNeighbours = readNeighbours || sink->needsMaskNeighbours();
+	}
+	if ((readValues && !values) || (readMask && !mask) || (!values && !mask)) {
+		printf(RED "Missing values or mask for the selected outputs, aborting.\n" WHITE);
+		return false;
+	}
+	const size_t width = values ? values->getWidth() : mask->getWidth();
+	const size_t height = values ? values->getHeight() : mask->getHeight();
+	const size_t depth = values ? values->getDepth() : mask->getDepth();
+
+	// Two value slices and four mask slices, so that slice z + 1 (and the mask of slice z + 2) can be read while the sinks consume slice z with the masks around it
+	std::vector<float> valueSlots[2];
+	BitSlice maskSlots[4], empty;
+	if (readValues) {
+		valueSlots[0].resize(width * height);
+		valueSlots[1].resize(width * height);
+	}
+	empty.resize(width, height);
+	auto readMaskSlice = [&](size_t z) {
+		if (!mask->readMask(z, maskSlots[z % 4])) {
+			printf(RED "Cannot read mask slice %zu out of %zu, aborting.\n" WHITE, z, depth);
+			return false;
+		}
+		return true;
+	};
+	if (readNeighbours && depth > 0 && !readMaskSlice(0)) {
+		return false;
+	}
+
+	ThreadPool& pool = ThreadPool::Global();
+	metrics::Progress progress(depth);
+	std::future<void> consumed;
+	std::atomic<bool> failed{ false };
+	for (size_t z = 0; z < depth; ++z) {
+		{
+			metrics::TraceSpan span("read_slice");
+			if (readValues && !values->readSlice(z, valueSlots[z % 2].data())) {
+				failed = true;
+			} else if (readMask && (readNeighbours ? z + 1 < depth && !readMaskSlice(z + 1) : !readMaskSlice(z))) {
+				failed = true;
+			}
+		}
+
+		// The sinks of the previous slice are done with the slots the next read goes to once they're waited on
+		if (consumed.valid()) {
+			pool.wait(consumed);
+		}
+		if (failed) {
+			break;
+		}
+		SliceWindow window;
+		window.z = z;
+		window.width = width;
+		window.height = height;
+		window.depth = depth;
+		window.values = readValues ? valueSlots[z % 2].data() : nullptr;
+		window.mask = readMask ? &maskSlots[z % 4] : nullptr;
+		window.prevMask = readNeighbours ? z > 0 ? &maskSlots[(z - 1) % 4] : &empty : nullptr;
+		window.nextMask = readNeighbours ? z + 1 < depth ? &maskSlots[(z + 1) % 4] : &empty : nullptr;
+		consumed = pool.submit([window, &sinks, &failed, &pool] {
+			metrics::TraceSpan span("consume_slice");
+			pool.parallelFor(0, sinks.size(), 1, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i) {
+					if (!sinks[i]->consume(window)) failed = true;
+				}
+			});
+		});
+		if ((z + 1) * 16 / depth != z * 16 / depth) {
+			progress.update(z + 1);
+		}
+	}
+	if (consumed.valid()) {
+		pool.wait(consumed);
+	}
+	if (failed) {
+		return false;
+	}
+
+	for (SliceSink* sink : sinks) {
+		if (!sink->finish()) {
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <functional>
+
+#include "BitSlice.h"
+#include "ObjModel.h"
+#include "Decimator.h"
+#include "Mesher.h"
+#include "Stats.h"
+
+class SliceSource;
+class MaskSource;
+
+
+/// Slice z of a sweep: its values and mask, and the masks of the slices on either side (empty beyond the volume)
+/// Members a sink didn't ask for may be null
+struct SliceWindow {
+	size_t z;
+	size_t width, height, depth;
+	const float* values;
+	const BitSlice* mask;
+	const BitSlice* prevMask;
+	const BitSlice* nextMask;
+};
+
+
+/// Output of a sweep, fed every slice in increasing z; different sinks of a sweep may be fed the same slice concurrently
+class SliceSink {
+public:
+	virtual ~SliceSink() {}
+
+	/// What the sink reads from each window
+	virtual bool needsValues() const { return false; }
+	virtual bool needsMask() const { return false; }
+	virtual bool needsMaskNeighbours() const { return false; }
+
+	virtual bool consume(const SliceWindow& window) = 0;
+
+	/// Writes out what was gathered, once every slice was consumed
+	virtual bool finish() { return true; }
+};
+
+
+/// Every step-th slice as a png image, as slices::exportPng does (or slices::exportMaskPng without values)
+class PngSink : public SliceSink {
+	std::function<std::string(size_t)> filename;
+	size_t step;
+	float minThreshold, maxThreshold;
+	bool useValues, useMask;
+
+public:
+	PngSink(std::function<std::string(size_t)> filename, size_t step, float minThreshold, float maxThreshold, bool useValues, bool useMask);
+
+	bool needsValues() const override { return useValues; }
+	bool needsMask() const override { return useMask; }
+	bool consume(const SliceWindow& window) override;
+};
+
+
+/// Cubified mesh of the mask, as mesher::exportObj writes it
+class ObjSink : public SliceSink {
+	std::string filename;
+	DecimateParams decimate;
+	ObjModel model;
+	MeshWriter writer;
+
+public:
+	ObjSink(std::string filename, size_t width, size_t height, float scale, const DecimateParams& decimate, const float* offset = nullptr);
+
+	bool needsMask() const override { return true; }
+	bool needsMaskNeighbours() const override { return true; }
+	bool consume(const SliceWindow& window) override;
+	bool finish() override;
+};
+
+
+/// Per-slice and whole-volume value statistics, as stats::compute gathers them
+class StatsSink : public SliceSink {
+	float threshold;
+	double voxelVolume;
+	std::string csvFilename, jsonFilename;
+	std::vector<ValueStats> slices;
+
+public:
+	StatsSink(float threshold, double voxelVolume, std::string csvFilename, std::string jsonFilename);
+
+	bool needsValues() const override { return true; }
+	bool consume(const SliceWindow& window) override;
+	bool finish() override;
+};
+
+
+/// Histogram of the values, in equal bins over [min, max) plus one bin for each side of it; NaN values are counted apart
+class HistogramSink : public SliceSink {
+	float min, max;
+	std::string filename;
+	std::vector<unsigned long long> counts;
+	unsigned long long below = 0, above = 0, nan = 0;
+
+public:
+	HistogramSink(size_t bins, float min, float max, std::string filename);
+
+	bool needsValues() const override { return true; }
+	bool consume(const SliceWindow& window) override;
+	bool finish() override;
+};
+
+
+/// Maximum intensity projections of the values along X, Y and Z, written as png images with the range of each projection mapped to black..white
+/// Files are named <prefix>x.png, <prefix>y.png and <prefix>z.png; rows of the X and Y projections run along Z
+class ProjectionSink : public SliceSink {
+	std::string prefix;
+	size_t width = 0, height = 0, depth = 0;
+
+	/// Along X: height x depth; along Y: width x depth; along Z: width x height
+	std::vector<float> alongX, alongY, alongZ;
+
+	/// Writes one projection, remapped over its finite range
+	bool writeProjection(const std::vector<float>& projection, size_t width, size_t height, std::string filename) const;
+
+public:
+	ProjectionSink(std::string prefix);
+
+	bool needsValues() const override { return true; }
+	bool consume(const SliceWindow& window) override;
+	bool finish() override;
+};
+
+
+/// Values written to a raw .vol file of floats, as slices::exportVol writes them
+class VolSink : public SliceSink {
+	std::string filename;
+	std::ofstream file;
+
+public:
+	VolSink(std::string filename);
+
+	bool needsValues() const override { return true; }
+	bool consume(const SliceWindow& window) override;
+	bool finish() override;
+};
+
+
+namespace pipeline {
+
+	/// Feeds every slice of values and mask to all of sinks in one sweep, then finishes them; values or mask may be null when no sink reads them
+	/// Slices are read in increasing z on the calling thread, while the sinks consume the slice before on the thread pool
+	/// To read the volume only once, mask should be computed from a SliceCache over values, large enough to hold the slices the mask reads ahead
+	bool run(SliceSource* values, MaskSource* mask, const std::vector<SliceSink*>& sinks);
+
+}
@@ -0,0 +1,219 @@
+#include "RegionGrowing.h"
+
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <algorithm>
+
+#include "ThreadPool.h"
+#include "colours.h"
+
+
+bool GrowParams::parseSeeds(const std::string& text, std::vector<std::array<size_t, 3>>& seeds) {
+	std::stringstream list(text);
+	std::string item;
+	while (std::getline(list, item, ';')) {
+		if (item.empty()) continue;
+		unsigned long long x, y, z;
+		char trailing;
+		if (std::sscanf(item.c_str(), "%llu,%llu,%llu%c", &x, &y, &z, &trailing) != 3) {
+			return false;
+		}
+		seeds.push_back({ (size_t)x, (size_t)y, (size_t)z });
+	}
+	return true;
+}
+
+
+RegionGrowing::RegionGrowing(SliceSource& source, const GrowParams& params) :
+	source(&source), params(params), width(source.getWidth()), height(source.getHeight()), depth(source.getDepth()) {}
+
+bool RegionGrowing::findCandidates(SliceSource& values, size_t zBegin, size_t zEnd) {
+	const size_t sliceSize = width * height;
+	const bool useGradient = params.maxGradient > 0.0f;
+	const float maxGradient2 = params.maxGradient * params.maxGradient;
+	std::vector<float> prev(sliceSize), curr(sliceSize), next(sliceSize);
+
+	// Sliding window of 3 slices when gradients are needed; slices beyond the volume repeat the border slice
+	if (useGradient) {
+		if (!values.readSlice(zBegin > 0 ? zBegin - 1 : zBegin, curr.data())) return false;
+		if (!values.readSlice(zBegin, next.data())) return false;
+	}
+	for (size_t z = zBegin; z < zEnd; ++z) {
+		const float* back = nullptr;
+		const float* front = nullptr;
+		if (useGradient) {
+			std::swap(prev, curr);
+			std::swap(curr, next);
+			if (z + 1 < depth && !values.readSlice(z + 1, next.data())) return false;
+			back = z > 0 ? prev.data() : curr.data();
+			front = z + 1 < depth ? next.data() : curr.data();
+		} else if (!values.readSlice(z, curr.data())) {
+			return false;
+		}
+		const float dz = (z > 0 && z + 1 < depth) ? 2.0f : (depth > 1 ? 1.0f : 0.0f);
+
+		BitSlice& out = candidates[z];
+		out.resize(width, height);
+		for (size_t y = 0; y < height; ++y) {
+			const size_t ym = y > 0 ? y - 1 : y, yp = y + 1 < height ? y + 1 : y;
+			const float dy = float(yp - ym);
+			for (size_t x = 0; x < width; ++x) {
+				const float v = curr[y * width + x];
+				if (!(v >= params.minValue && v <= params.maxValue)) continue;
+				if (useGradient) {
+					const size_t xm = x > 0 ? x - 1 : x, xp = x + 1 < width ? x + 1 : x;
+					const float dx = float(xp - xm);
+					const float gx = dx > 0.0f ? (curr[y * width + xp] - curr[y * width + xm]) / dx : 0.0f;
+					const float gy = dy > 0.0f ? (curr[yp * width + x] - curr[ym * width + x]) / dy : 0.0f;
+					const float gz = dz > 0.0f ? (front[y * width + x] - back[y * width + x]) / dz : 0.0f;
+					if (gx * gx + gy * gy + gz * gz > maxGradient2) continue;
+				}
+				out.set(x, y);
+			}
+		}
+	}
+	return true;
+}
+
+/// Sets the whole of every run of candidate on row y that overlaps the region
+static void expandRuns(const BitSlice& candidate, BitSlice& region, size_t y) {
+	const uint64_t* regionRow = region.row(y);
+	candidate.forEachRun(y, [&](size_t xBegin, size_t xEnd) {
+		for (size_t w = xBegin >> 6, wEnd = (xEnd + 63) >> 6; w < wEnd; ++w) {
+			uint64_t bits = regionRow[w];
+			if (w == xBegin >> 6) bits &= ~uint64_t(0) << (xBegin & 63);
+			if (w == (xEnd - 1) >> 6 && (xEnd & 63)) bits &= (uint64_t(1) << (xEnd & 63)) - 1;
+			if (bits) {
+				region.setRange(y, xBegin, xEnd);
+				return;
+			}
+		}
+	});
+}
+
+bool RegionGrowing::growSlice(size_t z) {
+	const BitSlice& candidate = candidates[z];
+	BitSlice& slice = (*region)[z];
+	const size_t before = slice.count();
+
+	// Seed from the neighbouring slices
+	for (int side = -1; side <= 1; side += 2) {
+		if ((side < 0 && z == 0) || (side > 0 && z + 1 == depth)) continue;
+		const BitSlice& neighbour = (*region)[z + side];
+		for (size_t i = 0; i < slice.words.size(); ++i) {
+			slice.words[i] |= candidate.words[i] & neighbour.words[i];
+		}
+	}
+
+	// Flood within the slice: sweep down then up, spreading across rows and along candidate runs, until a sweep adds nothing (the region only ever grows)
+	size_t count = slice.count(), previous;
+	do {
+		previous = count;
+		for (int pass = 0; pass < 2; ++pass) {
+			for (size_t i = 0; i < height; ++i) {
+				const size_t y = pass == 0 ? i : height - 1 - i;
+				if (pass == 0 ? y > 0 : y + 1 < height) {
+					uint64_t* row = slice.row(y);
+					const uint64_t* from = slice.row(pass == 0 ? y - 1 : y + 1);
+					const uint64_t* candidateRow = candidate.row(y);
+					for (size_t w = 0; w < slice.wordsPerRow; ++w) {
+						row[w] |= candidateRow[w] & from[w];
+					}
+				}
+				expandRuns(candidate, slice, y);
+			}
+		}
+		count = slice.count();
+	} while (count != previous);
+	return count != before;
+}
+
+bool RegionGrowing::grow() {
+	ThreadPool& pool = ThreadPool::Global();
+	candidates.assign(depth, BitSlice());
+	region = std::make_shared<std::vector<BitSlice>>(depth);
+	for (BitSlice& slice : *region) {
+		slice.resize(width, height);
+	}
+
+	// Candidates, in Z slabs read concurrently when the source can be cloned
+	SlabSources<SliceSource> sources(source);
+	const bool success = pool.forEachSlab(0, depth, pool.getSlabCount(depth, sources.isCloneable()), [&](const ThreadPool::Slab& slab) {
+		return sources.clone(slab);
+	}, [&](const ThreadPool::Slab& slab) {
+		const bool found = findCandidates(*sources.get(slab), slab.begin, slab.end);
+		sources.release(slab);
+		return found;
+	}, nullptr);
+	if (!success) {
+		return false;
+	}
+
+	// Seeds
+	std::vector<bool> dirty(depth, false);
+	for (const auto& seed : params.seeds) {
+		if (seed[0] >= width || seed[1] >= height || seed[2] >= depth) {
+			printf(YELLOW "Warning: seed %zu,%zu,%zu is outside of the volume, ignoring it.\n" WHITE, seed[0], seed[1], seed[2]);
+		} else if (!candidates[seed[2]].get(seed[0], seed[1])) {
+			printf(YELLOW "Warning: seed %zu,%zu,%zu does not satisfy the growing constraints, ignoring it.\n" WHITE, seed[0], seed[1], seed[2]);
+		} else {
+			(*region)[seed[2]].set(seed[0], seed[1]);
+			for (size_t z = seed[2] > 0 ? seed[2] - 1 : 0; z <= seed[2] + 1 && z < depth; ++z) {
+				dirty[z] = true;
+			}
+		}
+	}
+
+	// Rounds over the dirty slices of one parity at a time, which only read the slices of the other parity
+	size_t rounds = 0;
+	while (std::find(dirty.begin(), dirty.end(), true) != dirty.end()) {
+		for (size_t parity = 0; parity < 2; ++parity) {
+			std::vector<size_t> batch;
+			for (size_t z = parity; z < depth; z += 2) {
+				if (dirty[z]) {
+					batch.push_back(z);
+					dirty[z] = false;
+				}
+			}
+			std::vector<char> grown(batch.size(), 0);
+			pool.parallelFor(0, batch.size(), 1, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i) {
+					grown[i] = growSlice(batch[i]);
+				}
+			});
+			for (size_t i = 0; i < batch.size(); ++i) {
+				if (!grown[i]) continue;
+				if (batch[i] > 0) dirty[batch[i] - 1] = true;
+				if (batch[i] + 1 < depth) dirty[batch[i] + 1] = true;
+			}
+		}
+		++rounds;
+	}
+	printf("Region grown in %zu rounds.\n", rounds);
+
+	candidates.clear();
+	candidates.shrink_to_fit();
+	return true;
+}
+
+uint64_t RegionGrowing::getVoxelCount() const {
+	uint64_t count = 0;
+	if (region) {
+		for (const BitSlice& slice : *region) count += slice.count();
+	}
+	return count;
+}
+
+bool RegionGrowing::readMask(size_t z, BitSlice& out) {
+	if (!region || z >= depth) {
+		printf(RED "Cannot read region slice %zu; the region has not been grown.\n" WHITE, z);
+		return false;
+	}
+	out = (*region)[z];
+	return true;
+}
+
+MaskSource* RegionGrowing::clone() const {
+	return region ? new RegionGrowing(*this) : nullptr;
+}
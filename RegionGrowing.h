@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "BitSlice.h"
+#include "MaskSource.h"
+#include "SliceSource.h"
+
+
+/// Constraints on the voxels a region may grow into
+struct GrowParams {
+
+	/// Starting voxels, in (downscaled) voxel coordinates
+	std::vector<std::array<size_t, 3>> seeds;
+
+	/// Voxels must have values within [minValue, maxValue]
+	float minValue = -std::numeric_limits<float>::infinity();
+	float maxValue = std::numeric_limits<float>::infinity();
+
+	/// Voxels must have a gradient magnitude (central differences, in values per voxel) of at most this; 0 for no limit
+	float maxGradient = 0.0f;
+
+	/// Reads seeds written as "x,y,z" separated by semicolons; returns false on a malformed list
+	static bool parseSeeds(const std::string& text, std::vector<std::array<size_t, 3>>& seeds);
+};
+
+
+/// Mask of the voxels 6-connected to the seeds through voxels satisfying GrowParams
+/// grow() first thresholds every slice into a bit-packed candidate set (slabs read concurrently), then floods the region through it:
+/// each slice is filled along its candidate runs and rows, and slices whose region changed wake up their neighbours, in rounds over even then odd slices run in parallel
+/// Both sets take a bit per voxel, and the region is kept once grown
+class RegionGrowing : public MaskSource {
+
+	SliceSource* source;
+	GrowParams params;
+	size_t width, height, depth;
+
+	std::vector<BitSlice> candidates;
+
+	/// Region grown, shared with clones
+	std::shared_ptr<std::vector<BitSlice>> region;
+
+	/// Thresholds slices [zBegin, zEnd) into candidates
+	bool findCandidates(SliceSource& values, size_t zBegin, size_t zEnd);
+
+	/// Adds the candidates of slice z touching the region in the neighbouring slices, then fills the region within the slice; returns whether it grew
+	bool growSlice(size_t z);
+
+public:
+	RegionGrowing(SliceSource& source, const GrowParams& params);
+
+	/// Computes the region, needs to be called once before reading masks
+	bool grow();
+
+	/// Number of voxels in the region
+	uint64_t getVoxelCount() const;
+
+	size_t getWidth() const override { return width; }
+	size_t getHeight() const override { return height; }
+	size_t getDepth() const override { return depth; }
+
+	bool readMask(size_t z, BitSlice& out) override;
+	MaskSource* clone() const override;
+};
@@ -0,0 +1,254 @@
+#include "SliceSource.h"
+
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#include "colours.h"
+#include "VolIterator.h"
+#include "MaskSource.h"
+#include "ThreadPool.h"
+#include "Metrics.h"
+#include "MemoryBudget.h"
+#include "filesystem.h"
+
+
+bool SliceSource::readRows(size_t z, size_t yBegin, size_t yEnd, float* out) {
+	std::vector<float> values(getWidth() * getHeight());
+	if (!readSlice(z, values.data())) {
+		return false;
+	}
+	std::copy(values.begin() + yBegin * getWidth(), values.begin() + yEnd * getWidth(), out);
+	return true;
+}
+
+bool SliceSource::readBlock(size_t z, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float* out) {
+	const size_t width = getWidth();
+	std::vector<float> rows(width * (yEnd - yBegin));
+	if (!readRows(z, yBegin, yEnd, rows.data())) {
+		return false;
+	}
+	for (size_t y = 0; y < yEnd - yBegin; ++y) {
+		std::copy(&rows[y * width + xBegin], &rows[y * width + xEnd], &out[y * (xEnd - xBegin)]);
+	}
+	return true;
+}
+
+
+VolSlices::VolSlices(VolIterator& vol) : vol(&vol) {}
+
+VolSlices::~VolSlices() {}
+
+size_t VolSlices::getWidth() const { return vol->getDownscaledWidth(); }
+size_t VolSlices::getHeight() const { return vol->getDownscaledHeight(); }
+size_t VolSlices::getDepth() const { return vol->getDownscaledDepth(); }
+
+bool VolSlices::readSlice(size_t z, float* out) {
+	return vol->readSlice(z, out);
+}
+
+bool VolSlices::readRows(size_t z, size_t yBegin, size_t yEnd, float* out) {
+	return vol->readRows(z, yBegin, yEnd, out);
+}
+
+bool VolSlices::readBlock(size_t z, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float* out) {
+	return vol->readBlock(z, xBegin, xEnd, yBegin, yEnd, out);
+}
+
+bool VolSlices::getValueBounds(size_t z, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float& min, float& max) {
+	return vol->getValueBounds(z, xBegin, xEnd, yBegin, yEnd, min, max);
+}
+
+SliceSource* VolSlices::clone() const {
+	VolIterator* volClone = vol->clone();
+	if (!volClone) return nullptr;
+	VolSlices* slices = new VolSlices(*volClone);
+	slices->ownedVol.reset(volClone);
+	return slices;
+}
+
+SliceCache::SliceCache(SliceSource& source, size_t capacity) :
+	source(&source), capacity(std::max<size_t>(1, capacity)), slots(this->capacity * source.getWidth() * source.getHeight()), held(this->capacity, -1) {}
+
+size_t SliceCache::getWidth() const { return source->getWidth(); }
+size_t SliceCache::getHeight() const { return source->getHeight(); }
+size_t SliceCache::getDepth() const { return source->getDepth(); }
+
+const float* SliceCache::getSlice(size_t z) {
+	const size_t slot = z % capacity;
+	float* slice = &slots[slot * getWidth() * getHeight()];
+	if (held[slot] != (long long)z) {
+		held[slot] = -1;
+		if (!source->readSlice(z, slice)) return nullptr;
+		held[slot] = (long long)z;
+	}
+	return slice;
+}
+
+bool SliceCache::readSlice(size_t z, float* out) {
+	const float* slice = getSlice(z);
+	if (!slice) return false;
+	std::copy(slice, slice + getWidth() * getHeight(), out);
+	return true;
+}
+
+bool SliceCache::readRows(size_t z, size_t yBegin, size_t yEnd, float* out) {
+	const float* slice = getSlice(z);
+	if (!slice) return false;
+	std::copy(slice + yBegin * getWidth(), slice + yEnd * getWidth(), out);
+	return true;
+}
+
+SliceSource* SliceCache::clone() const {
+	SliceSource* sourceClone = source->clone();
+	if (!sourceClone) return nullptr;
+	SliceCache* cache = new SliceCache(*sourceClone, capacity);
+	cache->ownedSource.reset(sourceClone);
+	return cache;
+}
+
+bool slices::writePng(const float* values, const BitSlice* mask, size_t width, size_t height, std::string filename, float minThreshold, float maxThreshold) {
+	metrics::ScopedTimer timer(metrics::Stage::WRITE_PNG);
+
+	// The 8-bit image, plus about as much again for the filtered rows and compressed stream of the encoder
+	MemoryBudget::Reservation memory(&MemoryBudget::Current(), 0);
+	if (!memory.resize(2 * width * height)) {
+		MemoryBudget::Current().printExceeded("a slice image", 2 * width * height);
+		return false;
+	}
+
+	// Convert slice to 8-bit greyscale image
+	std::vector<unsigned char> pixels(width * height);
+	if (values) {
+		for (size_t i = 0, s = width * height; i < s; ++i) {
+			float val = (values[i] - minThreshold) / (maxThreshold - minThreshold); // 0..1 remap
+			pixels[i] = val < 0.0f ? 0 : val > 1.0f ? 255 : int(val * 255); // clamp & write
+		}
+	}
+	if (mask) {
+		for (size_t y = 0; y < height; ++y) {
+			for (size_t x = 0; x < width; ++x) {
+				if (!mask->get(x, y)) pixels[y * width + x] = 0;
+				else if (!values) pixels[y * width + x] = 255;
+			}
+		}
+	}
+
+	// Write out png file
+	if (!stbi_write_png(filename.c_str(), (int)width, (int)height, 1 /* greyscale */, pixels.data(), 0)) {
+		printf(RED "Error writing to %zu x %zu png file %s.\n" WHITE, width, height, filename.c_str());
+		return false;
+	}
+	if (metrics::isEnabled()) {
+		metrics::add(metrics::Counter::BYTES_WRITTEN, fs::fileSize(filename));
+	}
+
+	return true;
+}
+
+bool slices::exportPng(SliceSource& source, size_t z, std::string filename, float minThreshold, float maxThreshold, MaskSource* mask) {
+
+	if (z >= source.getDepth()) {
+		printf(RED "Invalid slice %zu on volume of size %zu x %zu x %zu.\n" WHITE, z, source.getWidth(), source.getHeight(), source.getDepth());
+		return false;
+	}
+
+	const size_t dWidth = source.getWidth(), dHeight = source.getHeight();
+	std::vector<float> values(dWidth * dHeight);
+	if (!source.readSlice(z, values.data())) {
+		return false;
+	}
+	BitSlice bits;
+	if (mask && !mask->readMask(z, bits)) {
+		return false;
+	}
+	return writePng(values.data(), mask ? &bits : nullptr, dWidth, dHeight, filename, minThreshold, maxThreshold);
+}
+
+bool slices::exportMaskPng(MaskSource& mask, size_t z, std::string filename) {
+
+	if (z >= mask.getDepth()) {
+		printf(RED "Invalid slice %zu on volume of size %zu x %zu x %zu.\n" WHITE, z, mask.getWidth(), mask.getHeight(), mask.getDepth());
+		return false;
+	}
+
+	BitSlice bits;
+	if (!mask.readMask(z, bits)) {
+		return false;
+	}
+	return writePng(nullptr, &bits, mask.getWidth(), mask.getHeight(), filename, 0.0f, 1.0f);
+}
+
+bool slices::exportPngs(SliceSource* values, MaskSource* mask, size_t step, float minThreshold, float maxThreshold, const std::function<std::string(size_t)>& filename, size_t zBegin, size_t zEnd) {
+	const size_t depth = values ? values->getDepth() : mask->getDepth();
+	step = std::max<size_t>(1, step);
+	zEnd = std::min(zEnd, depth);
+
+	// Slices first * step, (first + 1) * step... up to zEnd get exported
+	const size_t first = (std::min(zBegin, zEnd) + step - 1) / step;
+	const size_t exported = (zEnd + step - 1) / step - first;
+
+	// Split the exported slices into Z slabs, each with its own sources; sources that cannot both be cloned are exported in one go
+	ThreadPool& pool = ThreadPool::Global();
+	SlabSources<SliceSource> valueSources(values);
+	SlabSources<MaskSource> maskSources(mask);
+	metrics::Progress progress(depth, zBegin);
+	return pool.forEachSlab(first, first + exported, pool.getSlabCount(exported, valueSources.isCloneable() && maskSources.isCloneable()), [&](const ThreadPool::Slab& slab) {
+		return valueSources.clone(slab) && maskSources.clone(slab);
+	}, [&](const ThreadPool::Slab& slab) {
+		metrics::TraceSpan span("png_slab");
+		SliceSource* slabValues = valueSources.get(slab);
+		MaskSource* slabMask = maskSources.get(slab);
+		for (size_t z = slab.begin * step; z < std::min(zEnd, slab.end * step); z += step) {
+			if (slabValues ? !exportPng(*slabValues, z, filename(z), minThreshold, maxThreshold, slabMask) : !exportMaskPng(*slabMask, z, filename(z))) return false;
+		}
+		valueSources.release(slab);
+		maskSources.release(slab);
+		return true;
+	}, [&](const ThreadPool::Slab& slab) {
+		progress.update(std::min(zEnd, slab.end * step));
+		return true;
+	});
+}
+
+bool slices::exportVol(SliceSource& source, std::string filename) {
+	const size_t width = source.getWidth(), height = source.getHeight(), depth = source.getDepth();
+	const std::streamoff sliceBytes = (std::streamoff)(width * height * sizeof(float));
+	if (!std::ofstream(filename, std::ios::binary)) {
+		printf(RED "Cannot write volume to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+
+	// Split the volume into Z slabs, each with its own source and its own handle writing at the slab's offset
+	ThreadPool& pool = ThreadPool::Global();
+	SlabSources<SliceSource> sources(&source);
+	metrics::Progress progress(depth);
+	const bool success = pool.forEachSlab(0, depth, pool.getSlabCount(depth, sources.isCloneable()), [&](const ThreadPool::Slab& slab) {
+		return sources.clone(slab);
+	}, [&](const ThreadPool::Slab& slab) {
+		metrics::TraceSpan span("vol_slab");
+		std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+		if (!file) return false;
+		SliceSource& slabSource = *sources.get(slab);
+		file.seekp(slab.begin * sliceBytes);
+		std::vector<float> slice(width * height);
+		for (size_t z = slab.begin; z < slab.end; ++z) {
+			if (!slabSource.readSlice(z, slice.data())) return false;
+			metrics::ScopedTimer timer(metrics::Stage::WRITE_VOL);
+			file.write((const char*)slice.data(), sliceBytes);
+			metrics::add(metrics::Counter::BYTES_WRITTEN, sliceBytes);
+		}
+		sources.release(slab);
+		return (bool)file;
+	}, [&](const ThreadPool::Slab& slab) {
+		progress.update(slab.end);
+		return true;
+	});
+	if (!success) {
+		printf(RED "Cannot write volume to %s.\n" WHITE, filename.c_str());
+	}
+	return success;
+}
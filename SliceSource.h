@@ -0,0 +1,114 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+class VolIterator;
+class MaskSource;
+struct BitSlice;
+
+
+/// Produces (downscaled) slices of float values, to be thresholded, filtered or exported
+/// Slices are expected to be requested in increasing z order; implementations may allow stepping back by a slice or two
+class SliceSource {
+public:
+	virtual ~SliceSource() {}
+
+	/// Size of the slices produced, in voxels
+	virtual size_t getWidth() const = 0;
+	virtual size_t getHeight() const = 0;
+	virtual size_t getDepth() const = 0;
+
+	/// Fills out with the width x height values of slice z
+	virtual bool readSlice(size_t z, float* out) = 0;
+
+	/// Fills out with the width x (yEnd - yBegin) values of rows [yBegin, yEnd) of slice z; by default reads the whole slice
+	virtual bool readRows(size_t z, size_t yBegin, size_t yEnd, float* out);
+
+	/// Fills out with the (xEnd - xBegin) x (yEnd - yBegin) values of columns [xBegin, xEnd) of rows [yBegin, yEnd) of slice z; by default reads the rows
+	virtual bool readBlock(size_t z, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float* out);
+
+	/// Bounds [min, max] of the values of columns [xBegin, xEnd) of rows [yBegin, yEnd) of slice z, when known without reading them; returns false otherwise
+	/// NaN values are not bounded, as they fail any threshold
+	virtual bool getValueBounds(size_t z, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float& min, float& max) { return false; }
+
+	/// Returns an independent source over the same values that can be read from another thread, or nullptr if the source can only be streamed once
+	virtual SliceSource* clone() const { return nullptr; }
+};
+
+
+/// Downscaled slices of a volume file
+class VolSlices : public SliceSource {
+
+	/// Volume being read; owned when these slices were cloned
+	VolIterator* vol;
+	std::unique_ptr<VolIterator> ownedVol;
+
+public:
+	VolSlices(VolIterator& vol);
+	virtual ~VolSlices();
+
+	size_t getWidth() const override;
+	size_t getHeight() const override;
+	size_t getDepth() const override;
+
+	bool readSlice(size_t z, float* out) override;
+	bool readRows(size_t z, size_t yBegin, size_t yEnd, float* out) override;
+	bool readBlock(size_t z, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float* out) override;
+	bool getValueBounds(size_t z, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float& min, float& max) override;
+	SliceSource* clone() const override;
+};
+
+
+/// Keeps the last slices read from a source, so that several readers of the same slices (such as a mask and the outputs of the values it thresholds) share one read
+/// Slices are always read in full, and slice z is kept in slot z % capacity
+class SliceCache : public SliceSource {
+
+	/// Values being cached; owned when this cache was cloned
+	SliceSource* source;
+	std::unique_ptr<SliceSource> ownedSource;
+
+	size_t capacity;
+	std::vector<float> slots;
+	std::vector<long long> held;
+
+public:
+	SliceCache(SliceSource& source, size_t capacity);
+
+	size_t getWidth() const override;
+	size_t getHeight() const override;
+	size_t getDepth() const override;
+
+	/// Returns slice z, reading it if it isn't held; the pointer stays valid until slice z + capacity is read, nullptr if reading fails
+	const float* getSlice(size_t z);
+
+	bool readSlice(size_t z, float* out) override;
+	bool readRows(size_t z, size_t yBegin, size_t yEnd, float* out) override;
+	SliceSource* clone() const override;
+};
+
+
+namespace slices {
+
+	/// Writes a width x height png image, remapping values in [minThreshold, maxThreshold] to black..white; voxels outside of mask (if given) are left black
+	/// Without values, the voxels of mask are white
+	bool writePng(const float* values, const BitSlice* mask, size_t width, size_t height, std::string filename, float minThreshold, float maxThreshold);
+
+	/// Exports a png image of a slice, remapping [minThreshold, maxThreshold] to black..white; voxels outside of mask (if given) are left black
+	bool exportPng(SliceSource& source, size_t z, std::string filename, float minThreshold, float maxThreshold, MaskSource* mask = nullptr);
+
+	/// Exports a png image of a mask slice, set voxels in white
+	bool exportMaskPng(MaskSource& mask, size_t z, std::string filename);
+
+	/// Exports every step-th slice (of those in [zBegin, zEnd)) as exportPng does (or as exportMaskPng when values is null) to filename(z), with Z slabs exported
+	/// concurrently when the sources can be cloned
+	bool exportPngs(SliceSource* values, MaskSource* mask, size_t step, float minThreshold, float maxThreshold, const std::function<std::string(size_t)>& filename,
+		size_t zBegin = 0, size_t zEnd = SIZE_MAX);
+
+	/// Writes every slice to a raw .vol file of floats, with Z slabs computed and written concurrently when the source can be cloned
+	bool exportVol(SliceSource& source, std::string filename);
+
+}
@@ -0,0 +1,246 @@
+#include "Stats.h"
+
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+#include "ThreadPool.h"
+#include "Metrics.h"
+#include "colours.h"
+
+
+/// Identifies partial statistics files, the last character being the format version
+static const char PARTIAL_MAGIC[8] = { 'S', 'V', 'S', 'T', 'A', 'T', 'P', '1' };
+
+
+double ValueStats::stdDev() const {
+	if (!finite) return 0.0;
+	const double m = mean();
+	return std::sqrt(std::max(0.0, sumSquares / finite - m * m));
+}
+
+void ValueStats::add(const float* values, size_t count, float threshold) {
+
+	// Branch-free pass over independent lanes, which the compiler can vectorise; NaN or infinite values spoil the sums and fall back to the checked pass below
+	constexpr size_t LANES = 8;
+	double sums[LANES] = {}, squares[LANES] = {};
+	float mins[LANES], maxs[LANES];
+	uint64_t aboves[LANES] = {};
+	std::fill(mins, mins + LANES, std::numeric_limits<float>::infinity());
+	std::fill(maxs, maxs + LANES, -std::numeric_limits<float>::infinity());
+	const size_t blocked = count - count % LANES;
+	for (size_t i = 0; i < blocked; i += LANES) {
+		for (size_t j = 0; j < LANES; ++j) {
+			const float v = values[i + j];
+			sums[j] += v;
+			squares[j] += (double)v * v;
+			mins[j] = v < mins[j] ? v : mins[j];
+			maxs[j] = v > maxs[j] ? v : maxs[j];
+			aboves[j] += v >= threshold;
+		}
+	}
+
+	ValueStats part;
+	for (size_t j = 0; j < LANES; ++j) {
+		part.sum += sums[j];
+		part.sumSquares += squares[j];
+		part.above += aboves[j];
+	}
+	const bool fast = std::isfinite(part.sum) && std::isfinite(part.sumSquares);
+	if (fast) {
+		part.finite = blocked;
+		if (blocked) {
+			part.min = *std::min_element(mins, mins + LANES);
+			part.max = *std::max_element(maxs, maxs + LANES);
+		}
+	} else {
+		part = ValueStats();
+	}
+
+	// Checked pass over the remainder, or over everything if the fast pass hit non-finite values
+	for (size_t i = fast ? blocked : 0; i < count; ++i) {
+		const float v = values[i];
+		if (std::isnan(v)) {
+			++part.nan;
+		} else if (std::isinf(v)) {
+			++part.inf;
+		} else {
+			if (!part.finite || v < part.min) part.min = v;
+			if (!part.finite || v > part.max) part.max = v;
+			++part.finite;
+			part.sum += v;
+			part.sumSquares += (double)v * v;
+			part.above += v >= threshold;
+		}
+	}
+	add(part);
+}
+
+void ValueStats::add(const ValueStats& other) {
+	if (other.finite) {
+		min = finite ? std::min(min, other.min) : other.min;
+		max = finite ? std::max(max, other.max) : other.max;
+	}
+	finite += other.finite;
+	nan += other.nan;
+	inf += other.inf;
+	above += other.above;
+	sum += other.sum;
+	sumSquares += other.sumSquares;
+}
+
+
+bool stats::compute(SliceSource& values, float threshold, std::vector<ValueStats>& slices, size_t zBegin, size_t zEnd) {
+	const size_t width = values.getWidth(), height = values.getHeight(), depth = values.getDepth();
+	zEnd = std::min(zEnd, depth);
+	zBegin = std::min(zBegin, zEnd);
+	slices.assign(depth, ValueStats());
+
+	// Split the volume into Z slabs read concurrently, each with its own source, as when meshing
+	ThreadPool& pool = ThreadPool::Global();
+	SlabSources<SliceSource> sources(&values);
+	metrics::Progress progress(depth, zBegin);
+	return pool.forEachSlab(zBegin, zEnd, pool.getSlabCount(zEnd - zBegin, sources.isCloneable()), [&](const ThreadPool::Slab& slab) {
+		return sources.clone(slab);
+	}, [&](const ThreadPool::Slab& slab) {
+		metrics::TraceSpan span("stats_slab");
+		SliceSource& source = *sources.get(slab);
+		std::vector<float> buffer(width * height);
+		for (size_t z = slab.begin; z < slab.end; ++z) {
+			if (!source.readSlice(z, buffer.data())) return false;
+			slices[z].add(buffer.data(), buffer.size(), threshold);
+		}
+		sources.release(slab);
+		return true;
+	}, [&](const ThreadPool::Slab& slab) {
+		progress.update(slab.end);
+		return true;
+	});
+}
+
+bool stats::writePartial(const std::vector<ValueStats>& slices, size_t zBegin, size_t zEnd, float threshold, double voxelVolume, std::string filename) {
+	std::ofstream file(filename, std::ios::binary);
+	const uint64_t header[3] = { slices.size(), zBegin, zEnd };
+	file.write(PARTIAL_MAGIC, sizeof(PARTIAL_MAGIC));
+	file.write((const char*)header, sizeof(header));
+	file.write((const char*)&threshold, sizeof(threshold));
+	file.write((const char*)&voxelVolume, sizeof(voxelVolume));
+	file.write((const char*)&slices[zBegin], (zEnd - zBegin) * sizeof(ValueStats));
+	if (!file) {
+		printf(RED "Cannot write partial statistics to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool stats::mergePartials(const std::vector<std::string>& partFilenames, std::vector<ValueStats>& slices, float& threshold, double& voxelVolume) {
+	size_t zEnd = 0;
+	for (const std::string& partFilename : partFilenames) {
+		std::ifstream file(partFilename, std::ios::binary);
+		char magic[sizeof(PARTIAL_MAGIC)];
+		uint64_t header[3];
+		if (!file || !file.read(magic, sizeof(magic)) || std::memcmp(magic, PARTIAL_MAGIC, sizeof(PARTIAL_MAGIC)) != 0 || !file.read((char*)header, sizeof(header)) ||
+			!file.read((char*)&threshold, sizeof(threshold)) || !file.read((char*)&voxelVolume, sizeof(voxelVolume))) {
+			printf(RED "Cannot read partial statistics %s.\n" WHITE, partFilename.c_str());
+			return false;
+		}
+
+		// Parts must cover the volume in order, each starting where the previous one ended
+		if (zEnd == 0) {
+			slices.assign(header[0], ValueStats());
+		}
+		if (header[0] != slices.size() || header[1] != zEnd || header[2] < header[1] || header[2] > header[0]) {
+			printf(RED "Partial statistics %s do not continue the previous part (slices %llu to %llu of %llu, expected from %zu of %zu).\n" WHITE, partFilename.c_str(),
+				(unsigned long long)header[1], (unsigned long long)header[2], (unsigned long long)header[0], zEnd, slices.size());
+			return false;
+		}
+		if (!file.read((char*)&slices[header[1]], (header[2] - header[1]) * sizeof(ValueStats))) {
+			printf(RED "Cannot read partial statistics %s.\n" WHITE, partFilename.c_str());
+			return false;
+		}
+		zEnd = header[2];
+	}
+	if (zEnd != slices.size() || slices.empty()) {
+		printf(RED "Partial statistics end at slice %zu of %zu.\n" WHITE, zEnd, slices.size());
+		return false;
+	}
+	return true;
+}
+
+bool stats::writeCsv(const std::vector<ValueStats>& slices, std::string filename) {
+	std::ofstream file(filename);
+	if (!file) {
+		printf(RED "Cannot write slice statistics to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	file << "z,finite,nan,inf,min,max,mean,std_dev,above_threshold\n";
+	for (size_t z = 0; z < slices.size(); ++z) {
+		const ValueStats& s = slices[z];
+		file << z << ',' << s.finite << ',' << s.nan << ',' << s.inf << ',' << s.min << ',' << s.max << ',' << s.mean() << ',' << s.stdDev() << ',' << s.above << "\n";
+	}
+	return true;
+}
+
+/// Writes the fields of s as json members, without braces
+static void writeJsonFields(std::ofstream& file, const ValueStats& s) {
+	file << "\"finite\": " << s.finite << ", \"nan\": " << s.nan << ", \"inf\": " << s.inf
+		<< ", \"min\": " << s.min << ", \"max\": " << s.max << ", \"mean\": " << s.mean() << ", \"std_dev\": " << s.stdDev()
+		<< ", \"above_threshold\": " << s.above;
+}
+
+bool stats::writeJson(const std::vector<ValueStats>& slices, float threshold, double voxelVolume, std::string filename) {
+	std::ofstream file(filename);
+	if (!file) {
+		printf(RED "Cannot write volume statistics to %s.\n" WHITE, filename.c_str());
+		return false;
+	}
+	ValueStats total;
+	for (const ValueStats& s : slices) total.add(s);
+
+	file << "{\n";
+	file << "  \"threshold\": " << threshold << ",\n";
+	file << "  \"slices\": " << slices.size() << ",\n";
+	if (voxelVolume > 0.0) {
+		file << "  \"voxel_volume\": " << voxelVolume << ",\n";
+		file << "  \"above_threshold_volume\": " << total.above * voxelVolume << ",\n";
+	}
+	file << "  \"total\": { ";
+	writeJsonFields(file, total);
+	file << " },\n";
+	file << "  \"per_slice\": [\n";
+	for (size_t z = 0; z < slices.size(); ++z) {
+		file << "    { \"z\": " << z << ", ";
+		writeJsonFields(file, slices[z]);
+		file << (z + 1 < slices.size() ? " },\n" : " }\n");
+	}
+	file << "  ]\n}\n";
+	return true;
+}
+
+void stats::print(const std::vector<ValueStats>& slices, double voxelVolume) {
+	ValueStats total;
+	for (const ValueStats& s : slices) total.add(s);
+
+	printf(BLUE "Volume: %llu finite voxels in [%g, %g], mean %g, std dev %g; %llu NaN, %llu infinite.\n" WHITE,
+		(unsigned long long)total.finite, total.min, total.max, total.mean(), total.stdDev(), (unsigned long long)total.nan, (unsigned long long)total.inf);
+	if (voxelVolume > 0.0) {
+		printf(BLUE "Above threshold: %llu voxels, volume %g.\n" WHITE, (unsigned long long)total.above, total.above * voxelVolume);
+	} else {
+		printf(BLUE "Above threshold: %llu voxels.\n" WHITE, (unsigned long long)total.above);
+	}
+
+	size_t listed = 0;
+	for (size_t z = 0; z < slices.size(); ++z) {
+		if (!slices[z].nan && !slices[z].inf) continue;
+		if (listed++ < 10) {
+			printf(YELLOW "  Slice %zu: %llu NaN, %llu infinite.\n" WHITE, z, (unsigned long long)slices[z].nan, (unsigned long long)slices[z].inf);
+		}
+	}
+	if (listed > 10) {
+		printf(YELLOW "  ... and %zu more slices with NaN or infinite values.\n" WHITE, listed - 10);
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "SliceSource.h"
+
+
+/// Value statistics over a slice or a whole volume; NaN and infinite values are counted apart and left out of everything else
+struct ValueStats {
+	uint64_t finite = 0, nan = 0, inf = 0;
+
+	/// Voxels greater than or equal to the threshold, as thresholded by ThresholdMask
+	uint64_t above = 0;
+
+	float min = 0.0f, max = 0.0f;
+	double sum = 0.0, sumSquares = 0.0;
+
+	inline double mean() const { return finite ? sum / finite : 0.0; }
+	double stdDev() const;
+
+	/// Accumulates count values, starting at values
+	void add(const float* values, size_t count, float threshold);
+
+	/// Accumulates another set of statistics
+	void add(const ValueStats& other);
+};
+
+
+namespace stats {
+
+	/// Computes the statistics of every slice (or of slices [zBegin, zEnd), leaving the others empty) in a single read pass, splitting the slices into slabs
+	/// read concurrently when the source can be cloned
+	bool compute(SliceSource& values, float threshold, std::vector<ValueStats>& slices, size_t zBegin = 0, size_t zEnd = SIZE_MAX);
+
+	/// Writes the statistics of slices [zBegin, zEnd) to a partial file for mergePartials, along with the threshold and voxel volume they were computed with
+	bool writePartial(const std::vector<ValueStats>& slices, size_t zBegin, size_t zEnd, float threshold, double voxelVolume, std::string filename);
+
+	/// Reads partial files covering the volume in increasing z into the statistics of every slice, and the threshold and voxel volume they were computed with
+	bool mergePartials(const std::vector<std::string>& partFilenames, std::vector<ValueStats>& slices, float& threshold, double& voxelVolume);
+
+	/// Writes per-slice statistics to a csv, one row per slice
+	bool writeCsv(const std::vector<ValueStats>& slices, std::string filename);
+
+	/// Writes volume totals and per-slice statistics to a json file; voxelVolume is the physical volume of a (downscaled) voxel, or 0 if unknown
+	bool writeJson(const std::vector<ValueStats>& slices, float threshold, double voxelVolume, std::string filename);
+
+	/// Prints the volume totals, and lists slices with NaN or infinite values
+	void print(const std::vector<ValueStats>& slices, double voxelVolume);
+
+}
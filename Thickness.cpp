@@ -0,0 +1,195 @@
+#include "Thickness.h"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+
+#include "ThreadPool.h"
+#include "Metrics.h"
+#include "colours.h"
+
+
+/// Returns floor(sqrt(value))
+static long long isqrt(long long value) {
+	long long root = (long long)std::sqrt((double)value);
+	while (root * root > value) --root;
+	while ((root + 1) * (root + 1) <= value) ++root;
+	return root;
+}
+
+
+LocalThickness::LocalThickness(DistanceMap& distances) :
+	distances(&distances), width(distances.getWidth()), height(distances.getHeight()), depth(distances.getDepth()),
+	reach((size_t)std::ceil(distances.getMaxDistance())) {}
+
+bool LocalThickness::addRidgeSlice() {
+	const size_t z = firstZ + ridges.size();
+	const size_t sliceSize = width * height;
+
+	// Slide the window of distances along, or reload it after a jump
+	if (loadedZ >= 0 && (long long)z == loadedZ + 1) {
+		std::swap(prev, curr);
+		std::swap(curr, next);
+	} else {
+		prev.assign(sliceSize, 0);
+		curr.resize(sliceSize);
+		if (z > 0 && !distances->readSquared(z - 1, prev.data())) return false;
+		if (!distances->readSquared(z, curr.data())) return false;
+	}
+	next.assign(sliceSize, 0);
+	if (z + 1 < depth && !distances->readSquared(z + 1, next.data())) return false;
+	loadedZ = z;
+
+	// A ball is dropped when a neighbour's ball contains it, i.e. when the neighbour's radius is at least this radius plus their distance
+	std::vector<std::vector<Ball>> rows(height);
+	const std::vector<uint32_t>* slices[3] = { &prev, &curr, &next };
+	ThreadPool::Global().parallelFor(0, height, 16, [&](size_t yBegin, size_t yEnd) {
+		for (size_t y = yBegin; y < yEnd; ++y) {
+			for (size_t x = 0; x < width; ++x) {
+				const uint32_t squared = curr[y * width + x];
+				if (!squared) continue;
+				const double radius = std::sqrt((double)squared);
+				bool covered = false;
+				for (int dz = -1; dz <= 1 && !covered; ++dz) {
+					const std::vector<uint32_t>& slice = *slices[dz + 1];
+					for (int dy = -1; dy <= 1 && !covered; ++dy) {
+						if ((dy < 0 && y == 0) || (dy > 0 && y + 1 == height)) continue;
+						for (int dx = -1; dx <= 1 && !covered; ++dx) {
+							if ((dx < 0 && x == 0) || (dx > 0 && x + 1 == width) || (!dx && !dy && !dz)) continue;
+							const uint32_t neighbour = slice[(y + dy) * width + x + dx];
+							covered = neighbour > squared && std::sqrt((double)neighbour) >= radius + std::sqrt((double)(dx * dx + dy * dy + dz * dz));
+						}
+					}
+				}
+				if (!covered) {
+					rows[y].push_back({ (uint32_t)x, (uint32_t)y, squared, 2.0f * (float)radius });
+				}
+			}
+		}
+	});
+
+	ridges.emplace_back();
+	for (std::vector<Ball>& row : rows) {
+		ridges.back().insert(ridges.back().end(), row.begin(), row.end());
+	}
+	return true;
+}
+
+bool LocalThickness::readSlice(size_t z, float* out) {
+
+	// Keep the ridge balls of slices [z - reach, z + reach], restarting when stepping back
+	const size_t windowBegin = z > reach ? z - reach : 0, windowEnd = std::min(depth, z + reach + 1);
+	if (windowBegin < firstZ || windowBegin >= firstZ + ridges.size()) {
+		ridges.clear();
+		firstZ = windowBegin;
+	}
+	while (firstZ < windowBegin) {
+		ridges.pop_front();
+		++firstZ;
+	}
+	while (firstZ + ridges.size() < windowEnd) {
+		if (!addRidgeSlice()) return false;
+	}
+
+	// Sort the balls cut by slice z into the bands of rows their cross-sections reach
+	bands.resize((height + BAND_ROWS - 1) / BAND_ROWS);
+	for (std::vector<Section>& band : bands) {
+		band.clear();
+	}
+	for (size_t i = 0; i < ridges.size(); ++i) {
+		const long long dz = (long long)(firstZ + i) - (long long)z;
+		for (const Ball& ball : ridges[i]) {
+			// Voxels strictly closer than the radius are inside the ball
+			const long long remaining = (long long)ball.squared - dz * dz - 1;
+			if (remaining < 0) continue;
+			const long long ry = isqrt(remaining);
+			const size_t bandBegin = (size_t)std::max<long long>((long long)ball.y - ry, 0) / BAND_ROWS;
+			const size_t bandEnd = (size_t)std::min<long long>((long long)ball.y + ry, (long long)height - 1) / BAND_ROWS;
+			for (size_t band = bandBegin; band <= bandEnd; ++band) {
+				bands[band].push_back({ &ball, remaining });
+			}
+		}
+	}
+
+	// Paint the cross-section of each ball with slice z, keeping the largest diameter; chunks of the rows line up with the bands
+	std::fill(out, out + width * height, 0.0f);
+	ThreadPool::Global().parallelFor(0, height, BAND_ROWS, [&](size_t yBegin, size_t yEnd) {
+		for (const Section& section : bands[yBegin / BAND_ROWS]) {
+			const Ball& ball = *section.ball;
+			const long long ry = isqrt(section.remaining);
+			const long long y0 = std::max<long long>((long long)ball.y - ry, (long long)yBegin);
+			const long long y1 = std::min<long long>((long long)ball.y + ry, (long long)yEnd - 1);
+			for (long long y = y0; y <= y1; ++y) {
+				const long long dy = y - (long long)ball.y;
+				const long long rx = isqrt(section.remaining - dy * dy);
+				const long long x0 = std::max<long long>((long long)ball.x - rx, 0);
+				const long long x1 = std::min<long long>((long long)ball.x + rx, (long long)width - 1);
+				float* row = &out[y * width];
+				for (long long x = x0; x <= x1; ++x) {
+					row[x] = std::max(row[x], ball.diameter);
+				}
+			}
+		}
+	});
+	return true;
+}
+
+
+bool thickness::exportThickness(SliceSource& thickness, std::string volFilename, std::string csvFilename) {
+	const size_t width = thickness.getWidth(), height = thickness.getHeight(), depth = thickness.getDepth();
+	std::ofstream volFile(volFilename, std::ios::binary);
+	if (!volFile) {
+		printf(RED "Cannot write thickness volume to %s.\n" WHITE, volFilename.c_str());
+		return false;
+	}
+
+	std::vector<float> slice(width * height);
+	std::vector<unsigned long long> histogram;
+	unsigned long long count = 0;
+	double sum = 0.0, sumSquares = 0.0;
+	float maxThickness = 0.0f;
+	metrics::Progress progress(depth);
+	for (size_t z = 0; z < depth; ++z) {
+		if (!thickness.readSlice(z, slice.data())) {
+			return false;
+		}
+		{
+			metrics::ScopedTimer timer(metrics::Stage::WRITE_VOL);
+			volFile.write((const char*)slice.data(), (std::streamsize)(slice.size() * sizeof(float)));
+			metrics::add(metrics::Counter::BYTES_WRITTEN, slice.size() * sizeof(float));
+		}
+		for (float value : slice) {
+			if (value <= 0.0f) continue;
+			const size_t bin = (size_t)value;
+			if (bin >= histogram.size()) histogram.resize(bin + 1, 0);
+			++histogram[bin];
+			++count;
+			sum += value;
+			sumSquares += (double)value * value;
+			maxThickness = std::max(maxThickness, value);
+		}
+		if ((z + 1) * 16 / depth != z * 16 / depth) {
+			progress.update(z + 1);
+		}
+	}
+	if (!volFile) {
+		printf(RED "Cannot write thickness volume to %s.\n" WHITE, volFilename.c_str());
+		return false;
+	}
+
+	const double mean = count ? sum / count : 0.0;
+	const double stdDev = count ? std::sqrt(std::max(0.0, sumSquares / count - mean * mean)) : 0.0;
+	printf(BLUE "Thickness over %llu voxels, in voxels: mean %.2f, std dev %.2f, max %.2f.\n" WHITE, count, mean, stdDev, maxThickness);
+
+	std::ofstream csvFile(csvFilename);
+	if (!csvFile) {
+		printf(RED "Cannot write thickness histogram to %s.\n" WHITE, csvFilename.c_str());
+		return false;
+	}
+	csvFile << "thickness_from,thickness_to,voxels\n";
+	for (size_t bin = 0; bin < histogram.size(); ++bin) {
+		csvFile << bin << ',' << bin + 1 << ',' << histogram[bin] << "\n";
+	}
+	return true;
+}
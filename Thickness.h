@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstdint>
+
+#include "SliceSource.h"
+#include "DistanceTransform.h"
+
+
+/// Local thickness (Hildebrand & Rüegsegger): diameter of the largest ball fitting inside the mask that contains each voxel, 0 outside, in voxels
+/// Each voxel centres a ball as wide as its distance to the outside; only balls not contained in a neighbour's (the distance ridge) are painted
+/// Slices are produced from a window of the ridge balls within reach of them, so memory depends on the ridge and the largest distance, not the volume
+class LocalThickness : public SliceSource {
+
+	struct Ball {
+		uint32_t x, y, squared;
+		float diameter;
+	};
+
+	/// Ball cut by the slice being painted, with the squared radius of its cross-section (minus one, as painting takes voxels strictly inside)
+	struct Section {
+		const Ball* ball;
+		long long remaining;
+	};
+
+	/// Slices are painted in bands of rows, each given the sections that reach into it
+	static constexpr size_t BAND_ROWS = 16;
+
+	DistanceMap* distances;
+	size_t width, height, depth;
+
+	/// Slices further than reach from a ball's centre cannot be touched by it
+	size_t reach;
+
+	/// Ridge balls of slices [firstZ, firstZ + ridges.size())
+	std::deque<std::vector<Ball>> ridges;
+	size_t firstZ = 0;
+
+	/// Squared distances of slices loadedZ - 1, loadedZ and loadedZ + 1 (zeros beyond the volume); loadedZ is -1 when nothing is loaded
+	std::vector<uint32_t> prev, curr, next;
+	long long loadedZ = -1;
+
+	/// Sections reaching into each band of rows of the slice being painted, kept to reuse their storage
+	std::vector<std::vector<Section>> bands;
+
+	/// Appends the ridge balls of slice z = firstZ + ridges.size()
+	bool addRidgeSlice();
+
+public:
+	/// distances must have been computed already
+	LocalThickness(DistanceMap& distances);
+
+	size_t getWidth() const override { return width; }
+	size_t getHeight() const override { return height; }
+	size_t getDepth() const override { return depth; }
+
+	bool readSlice(size_t z, float* out) override;
+};
+
+
+namespace thickness {
+
+	/// Writes every slice of thickness to a raw .vol file of floats and a histogram of thicknesses (1 voxel bins) to a csv, and prints summary statistics
+	bool exportThickness(SliceSource& thickness, std::string volFilename, std::string csvFilename);
+
+}
@@ -0,0 +1,247 @@
+#include "ThreadPool.h"
+
+#include <cstdio>
+#include <algorithm>
+
+#include "colours.h"
+#include "Metrics.h"
+#include "MemoryBudget.h"
+
+
+/// Pool and index of the worker running on this thread, if any
+static thread_local const ThreadPool* currentPool = nullptr;
+static thread_local long long currentWorker = -1;
+
+size_t ThreadPool::globalThreadCount = 0;
+
+
+ThreadPool::ThreadPool(size_t threadCount) {
+	if (threadCount == 0) {
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for (size_t i = 0; i < threadCount; ++i) {
+		workers.emplace_back(new Worker());
+	}
+	for (size_t i = 0; i < threadCount; ++i) {
+		threads.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+ThreadPool& ThreadPool::Global() {
+	static ThreadPool pool(globalThreadCount);
+	return pool;
+}
+
+void ThreadPool::SetGlobalThreadCount(size_t threadCount) {
+	globalThreadCount = threadCount;
+}
+
+long long ThreadPool::getWorkerIndex() const {
+	return currentPool == this ? currentWorker : -1;
+}
+
+void ThreadPool::push(std::function<void()> task) {
+	const long long self = getWorkerIndex();
+	Worker& worker = *workers[self >= 0 ? (size_t)self : nextWorker++ % workers.size()];
+
+	// Tasks draw from the memory budget of the job that submitted them, whichever thread ends up running them
+	MemoryBudget& budget = MemoryBudget::Current();
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		++pending; // counted before it can be taken, so that pending never falls below the tasks queued
+		worker.tasks.push_back([task = std::move(task), &budget] {
+			MemoryBudget::Scope scope(budget);
+			task();
+		});
+	}
+
+	// Taking the sleep lock orders this push before any worker's check of pending, so none can go to sleep having missed it
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+	}
+	condition.notify_one();
+}
+
+bool ThreadPool::take(long long self, std::function<void()>& task) {
+	if (pending == 0) {
+		return false;
+	}
+	if (self >= 0) {
+		Worker& own = *workers[(size_t)self];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			--pending;
+			return true;
+		}
+	}
+	const size_t count = workers.size();
+	const size_t start = self >= 0 ? (size_t)self + 1 : 0;
+	for (size_t i = 0; i < count; ++i) {
+		const size_t victim = (start + i) % count;
+		if ((long long)victim == self) continue;
+		Worker& other = *workers[victim];
+		std::lock_guard<std::mutex> lock(other.mutex);
+		if (!other.tasks.empty()) {
+			task = std::move(other.tasks.front());
+			other.tasks.pop_front();
+			--pending;
+			if (self >= 0) ++workers[(size_t)self]->stolen;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::workerLoop(size_t index) {
+	currentPool = this;
+	currentWorker = (long long)index;
+	metrics::setThreadName("worker " + std::to_string(index));
+	Worker& worker = *workers[index];
+	using Clock = std::chrono::steady_clock;
+	while (true) {
+		std::function<void()> task;
+		const Clock::time_point waitStart = Clock::now();
+		while (!take((long long)index, task)) {
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			condition.wait(lock, [this] { return stopping || pending > 0; });
+			if (stopping && pending == 0) return; // stopping, with nothing left to run
+		}
+		const Clock::time_point taskStart = Clock::now();
+		task();
+		worker.idle += std::chrono::duration_cast<std::chrono::nanoseconds>(taskStart - waitStart).count();
+		worker.busy += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - taskStart).count();
+		++worker.executed;
+	}
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task) {
+	auto packaged = std::make_shared<std::packaged_task<void()>>(std::move(task));
+	std::future<void> future = packaged->get_future();
+	push([packaged] { (*packaged)(); });
+	return future;
+}
+
+bool ThreadPool::runPendingTask() {
+	std::function<void()> task;
+	if (!take(getWorkerIndex(), task)) {
+		return false;
+	}
+	task();
+	return true;
+}
+
+void ThreadPool::parallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& fn) {
+	if (end <= begin) return;
+	if (grain == 0) grain = 1;
+	const size_t chunks = (end - begin + grain - 1) / grain;
+	if (chunks == 1) {
+		fn(begin, end);
+		return;
+	}
+
+	// Chunks are handed out through a shared counter; helpers that only get to run once everything is done simply find no work left
+	struct State {
+		std::atomic<size_t> next{ 0 };
+		size_t done = 0;
+		std::mutex mutex;
+		std::condition_variable condition;
+	};
+	auto state = std::make_shared<State>();
+	auto work = [state, begin, end, grain, chunks, &fn] {
+		size_t finished = 0;
+		for (size_t chunk = state->next++; chunk < chunks; chunk = state->next++) {
+			size_t chunkBegin = begin + chunk * grain;
+			fn(chunkBegin, std::min(end, chunkBegin + grain));
+			++finished;
+		}
+		if (finished > 0) {
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->done += finished;
+			if (state->done == chunks) state->condition.notify_all();
+		}
+	};
+
+	// fn is only referenced by helpers while chunks remain, which the caller waits on below
+	const size_t helpers = std::min(chunks - 1, workers.size());
+	for (size_t i = 0; i < helpers; ++i) {
+		push(work);
+	}
+	work();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->condition.wait(lock, [&] { return state->done == chunks; });
+}
+
+size_t ThreadPool::getSlabCount(size_t items, bool cloneable) const {
+	return cloneable ? std::max<size_t>(1, std::min(items, getThreadCount() * 2)) : 1;
+}
+
+bool ThreadPool::forEachSlab(size_t begin, size_t end, size_t slabCount, const std::function<bool(const Slab&)>& clone, const std::function<bool(const Slab&)>& body,
+	const std::function<bool(const Slab&)>& merge, size_t inFlight) {
+	slabCount = std::max<size_t>(1, slabCount);
+	const size_t items = end > begin ? end - begin : 0;
+	inFlight = inFlight > 0 ? inFlight : getThreadCount() * 2;
+	std::vector<Slab> slabs(slabCount);
+	std::vector<char> results(slabCount, false);
+	std::vector<std::future<void>> done(slabCount);
+	bool success = true;
+	auto start = [&](size_t i) {
+		Slab& slab = slabs[i];
+		slab = { i, slabCount, begin + items * i / slabCount, begin + items * (i + 1) / slabCount };
+		if (clone && !clone(slab)) {
+			success = false;
+			return;
+		}
+		char& result = results[i];
+		done[i] = submit([&slab, &result, &body] { result = !body || body(slab); });
+	};
+	for (size_t i = 0; i < std::min(slabCount, inFlight) && success; ++i) {
+		start(i);
+	}
+
+	// Slabs are merged in order as they complete; after a failure, those already running are only waited for
+	for (size_t i = 0; i < slabCount; ++i) {
+		if (!done[i].valid()) {
+			continue;
+		}
+		wait(done[i]);
+		success = success && results[i] && (!merge || merge(slabs[i]));
+		if (success && i + inFlight < slabCount) {
+			start(i + inFlight);
+		}
+	}
+	return success;
+}
+
+std::vector<ThreadPool::WorkerStats> ThreadPool::getStats() const {
+	std::vector<WorkerStats> stats;
+	for (const auto& worker : workers) {
+		stats.push_back({ worker->busy * 1e-9, worker->idle * 1e-9, worker->executed, worker->stolen });
+	}
+	return stats;
+}
+
+void ThreadPool::printStats() const {
+	double busy = 0.0, idle = 0.0;
+	const std::vector<WorkerStats> stats = getStats();
+	for (size_t i = 0; i < stats.size(); ++i) {
+		const WorkerStats& s = stats[i];
+		printf("  Worker %zu: busy %.3f s, idle %.3f s, %llu tasks (%llu stolen)\n", i, s.busySeconds, s.idleSeconds, (unsigned long long)s.tasks, (unsigned long long)s.steals);
+		busy += s.busySeconds;
+		idle += s.idleSeconds;
+	}
+	printf(BLUE "Thread pool: %zu workers, %.1f%% busy.\n" WHITE, stats.size(), busy + idle > 0.0 ? 100.0 * busy / (busy + idle) : 0.0);
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <future>
+
+
+/// Fixed-size pool of worker threads with work stealing
+/// Each worker has its own deque of tasks: tasks submitted from a worker go to the back of its deque, which it runs newest first (keeping nested work
+/// on the same slices hot in cache), while idle workers steal the oldest tasks from the front of the others' deques; tasks submitted from other threads
+/// are dealt out to the workers in turn
+class ThreadPool {
+
+	/// Deque and counters of one worker; times in nanoseconds
+	struct Worker {
+		std::deque<std::function<void()>> tasks;
+		std::mutex mutex;
+		std::atomic<uint64_t> busy{ 0 }, idle{ 0 }, executed{ 0 }, stolen{ 0 };
+	};
+
+	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<Worker>> workers;
+
+	/// Tasks queued in any deque, and the wake-up of idle workers
+	std::atomic<size_t> pending{ 0 };
+	std::mutex sleepMutex;
+	std::condition_variable condition;
+	bool stopping = false;
+
+	/// Deque that tasks submitted from outside the pool go to next
+	std::atomic<size_t> nextWorker{ 0 };
+
+	/// Thread count the global pool gets created with
+	static size_t globalThreadCount;
+
+	/// Loop run by each worker thread until the pool is destroyed
+	void workerLoop(size_t index);
+
+	/// Index of the calling thread's worker in this pool, or -1 for other threads
+	long long getWorkerIndex() const;
+
+	/// Queues a task on the calling worker's deque, or on the next worker's deque for other threads
+	void push(std::function<void()> task);
+
+	/// Takes a task, newest first from the given worker's own deque (if any), then oldest first from the others; returns false if all are empty
+	bool take(long long self, std::function<void()>& task);
+
+public:
+
+	/// Creates a pool with the given number of threads; 0 uses the number of hardware threads
+	explicit ThreadPool(size_t threadCount = 0);
+	virtual ~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/// Returns the pool shared by all export stages
+	static ThreadPool& Global();
+
+	/// Sets the thread count of the global pool (0 for the number of hardware threads); only has an effect before its first use
+	static void SetGlobalThreadCount(size_t threadCount);
+
+	/// Getters
+	inline size_t getThreadCount() const { return threads.size(); }
+
+	/// Queues a task, returning a future that becomes ready once it has run
+	std::future<void> submit(std::function<void()> task);
+
+	/// Runs one queued task on the calling thread, if there is any; returns whether one was run
+	bool runPendingTask();
+
+	/// Waits for a future, running queued tasks in the meantime, so that waiting from within a task cannot starve the pool
+	template<typename T>
+	T wait(std::future<T>& future) {
+		while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+			if (!runPendingTask()) {
+				future.wait();
+			}
+		}
+		return future.get();
+	}
+
+	/// Calls fn(chunkBegin, chunkEnd) over [begin, end) split into chunks of at most grain items, and returns once all chunks are done
+	/// The calling thread processes chunks as well, so this can safely be nested inside pool tasks
+	void parallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& fn);
+
+	/// Contiguous items [begin, end) of the index-th of count slabs
+	struct Slab {
+		size_t index, count, begin, end;
+	};
+
+	/// Number of slabs to split items into: a couple per thread, which evens out slabs that are denser than others, or a single one for sources that cannot be cloned
+	size_t getSlabCount(size_t items, bool cloneable = true) const;
+
+	/// Splits items [begin, end) into slabCount contiguous slabs (e.g. Z slabs of a volume), each set up by clone(slab) on the calling thread, run by body(slab) on
+	/// the pool and then passed to merge(slab) on the calling thread, in slab order; any of them may be empty, and any returning false fails the run
+	/// Slabs are started on a rolling window of inFlight (two per thread if 0) as earlier ones get merged, and none get started after a failure; returns whether all
+	/// slabs succeeded
+	bool forEachSlab(size_t begin, size_t end, size_t slabCount, const std::function<bool(const Slab&)>& clone, const std::function<bool(const Slab&)>& body,
+		const std::function<bool(const Slab&)>& merge, size_t inFlight = 0);
+
+	/// Time each worker spent running tasks and waiting for them, tasks it ran and how many of those it stole, since the pool started
+	struct WorkerStats {
+		double busySeconds, idleSeconds;
+		uint64_t tasks, steals;
+	};
+	std::vector<WorkerStats> getStats() const;
+
+	/// Prints the stats of each worker, and the utilisation of the pool
+	void printStats() const;
+};
+
+
+/// Per-slab clones of a source (a SliceSource or MaskSource) for the slabs of ThreadPool::forEachSlab
+/// The first clone is taken up front, to tell whether the source can be cloned at all; a single slab reads the source itself
+template<typename Source>
+class SlabSources {
+	Source* source;
+	std::unique_ptr<Source> probe;
+	std::vector<std::unique_ptr<Source>> clones;
+
+public:
+	/// source may be null, for an optional input
+	explicit SlabSources(Source* source) : source(source), probe(source ? source->clone() : nullptr) {}
+
+	inline bool isCloneable() const { return !source || probe; }
+
+	/// Clones the source for a slab, as a forEachSlab clone step; returns false if cloning failed
+	bool clone(const ThreadPool::Slab& slab) {
+		if (!source || slab.count == 1) {
+			return true;
+		}
+		if (clones.empty()) {
+			clones.resize(slab.count); // sized before the first slab starts, so running slabs never see it move
+		}
+		clones[slab.index].reset(probe ? probe.release() : source->clone());
+		return clones[slab.index] != nullptr;
+	}
+
+	/// Source slab reads from (null for a null source)
+	inline Source* get(const ThreadPool::Slab& slab) { return !source || slab.count == 1 ? source : clones[slab.index].get(); }
+
+	/// Frees the clone of a finished slab
+	inline void release(const ThreadPool::Slab& slab) {
+		if (source && slab.count > 1) clones[slab.index].reset();
+	}
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+// van Herk / Gil-Werman running min/max filters: the sequence is split into blocks of (2 radius + 1) elements,
+// and each window covering two blocks is the combination of a suffix of the first and a prefix of the second
+// Cost is 3 combines per element regardless of the radius; elements outside the sequence count as op's identity
+
+namespace vanherk {
+
+	/// Filters n elements of len values each (element i is in[i * len .. i * len + len)), combining each with the radius elements on either side
+	/// g and h are scratch buffers, resized as needed
+	template<typename T, typename Op>
+	void filter(const T* in, T* out, size_t n, size_t len, size_t radius, T identity, Op op, std::vector<T>& g, std::vector<T>& h) {
+		const size_t k = 2 * radius + 1;
+		const size_t padded = n + 2 * radius;
+		g.resize(padded * len);
+		h.resize(padded * len);
+		auto value = [&](size_t i, size_t e) { return i >= radius && i < n + radius ? in[(i - radius) * len + e] : identity; };
+
+		// Prefixes within each block, and suffixes within each block (the last block may be cut short)
+		for (size_t i = 0; i < padded; ++i) {
+			T* gi = &g[i * len];
+			if (i % k == 0) {
+				for (size_t e = 0; e < len; ++e) gi[e] = value(i, e);
+			} else {
+				const T* gp = gi - len;
+				for (size_t e = 0; e < len; ++e) gi[e] = op(gp[e], value(i, e));
+			}
+		}
+		for (size_t i = padded; i-- > 0;) {
+			T* hi = &h[i * len];
+			if (i % k == k - 1 || i == padded - 1) {
+				for (size_t e = 0; e < len; ++e) hi[e] = value(i, e);
+			} else {
+				const T* hn = hi + len;
+				for (size_t e = 0; e < len; ++e) hi[e] = op(value(i, e), hn[e]);
+			}
+		}
+
+		// Window [j - radius, j + radius] is padded range [j, j + 2 radius]
+		for (size_t j = 0; j < n; ++j) {
+			const T* hj = &h[j * len];
+			const T* gj = &g[(j + 2 * radius) * len];
+			T* o = &out[j * len];
+			for (size_t e = 0; e < len; ++e) o[e] = op(hj[e], gj[e]);
+		}
+	}
+
+}
+
+
+/// Streaming van Herk / Gil-Werman filter along Z, combining each slice of len values with the radius slices on either side
+/// Keeps 3 blocks of (2 radius + 1) slices: the raw slices and prefixes of the block being read, and the suffixes of the last complete one
+/// Slices are read in increasing z order; reading further ahead skips ahead, stepping back restarts from the block containing z
+template<typename T, typename Op>
+class ZWindow {
+
+	size_t len, depth, radius, k;
+	T identity;
+	Op op;
+
+	/// Index of the next slice to read, counting from -radius, and the block whose suffixes are held in h (-1 for none)
+	long long nextRead;
+	long long hBlock = -1;
+	std::vector<T> raw, g, h;
+
+public:
+
+	ZWindow(size_t len, size_t depth, size_t radius, T identity, Op op) : len(len), depth(depth), radius(radius), k(2 * radius + 1), identity(identity), op(op), nextRead(-(long long)radius) {
+		raw.resize(k * len);
+		g.resize(k * len);
+		h.resize(k * len);
+	}
+
+	/// Writes filtered slice z to out, calling read(z, T* dst) for the input slices needed; returns false if a read fails
+	template<typename Read>
+	bool get(size_t z, T* out, Read read) {
+		const long long r = (long long)radius, block = (long long)(z / k);
+		const long long blockStart = block * (long long)k - r;
+
+		// Resume reading where possible, otherwise (re)start at the beginning of z's block
+		if (hBlock != block) {
+			const long long filling = (nextRead + r) / (long long)k;
+			if (filling != block) {
+				nextRead = blockStart;
+			}
+		}
+
+		for (const long long last = (long long)z + r; nextRead <= last; ++nextRead) {
+			const size_t p = (size_t)((nextRead + r) % (long long)k);
+			T* slice = &raw[p * len];
+			if (nextRead < 0 || nextRead >= (long long)depth) {
+				std::fill(slice, slice + len, identity);
+			} else if (!read((size_t)nextRead, slice)) {
+				nextRead = blockStart; // forget partial progress
+				hBlock = -1;
+				return false;
+			}
+			T* gp = &g[p * len];
+			if (p == 0) {
+				std::copy(slice, slice + len, gp);
+			} else {
+				const T* prev = gp - len;
+				for (size_t e = 0; e < len; ++e) gp[e] = op(prev[e], slice[e]);
+			}
+
+			// Block complete: turn its raw slices into suffixes in place, and keep them
+			if (p == k - 1) {
+				for (size_t q = k - 1; q-- > 0;) {
+					T* hq = &raw[q * len];
+					const T* hn = hq + len;
+					for (size_t e = 0; e < len; ++e) hq[e] = op(hq[e], hn[e]);
+				}
+				std::swap(raw, h);
+				hBlock = (nextRead + r) / (long long)k;
+			}
+		}
+
+		// Window [z - radius, z + radius] is the suffix of z's block from z, combined with the prefix of the next block up to z + 2 radius
+		const size_t p = z % k;
+		const T* hz = &h[p * len];
+		if (p == 0) {
+			std::copy(hz, hz + len, out);
+		} else {
+			const T* gz = &g[((z + 2 * radius) % k) * len];
+			for (size_t e = 0; e < len; ++e) out[e] = op(hz[e], gz[e]);
+		}
+		return true;
+	}
+};
@@ -1,22 +1,45 @@
 
 #include "VolIterator.h"
 
+#include <cstdio>
 #include <fstream>
 #include <cassert>
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#include <cmath>
+#include <cfloat>
+#include <memory>
+#include <algorithm>
 
 #include "filesystem.h"
 #include "colours.h"
-#include "ObjModel.h"
+#include "SliceSource.h"
+#include "MaskSource.h"
+#include "Mesher.h"
+#include "BrickIndex.h"
+#include "Metrics.h"
+#include "MemoryBudget.h"
+
+
+bool VolRegion::parse(const std::string& text, VolRegion& region) {
+	unsigned long long v[6];
+	char trailing;
+	if (std::sscanf(text.c_str(), "%llu,%llu,%llu,%llu,%llu,%llu%c", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &trailing) != 6) {
+		return false;
+	}
+	for (int axis = 0; axis < 3; ++axis) {
+		region.begin[axis] = (size_t)v[axis];
+		region.end[axis] = (size_t)v[axis + 3];
+	}
+	return true;
+}
 
 
-VolIterator::VolIterator(std::string filename, size_t width, size_t height, size_t depth, const VolIteratorParams& params) : width(width), height(height), depth(depth), params(params) {
-	
+VolIterator::VolIterator(std::string filename, size_t width, size_t height, size_t depth, const VolIteratorParams& params) : filename(filename), width(width), height(height), depth(depth), params(params), budget(MemoryBudget::Current()) {
+	setRegion(params.region);
+
 	if (fs::isDirectory(filename)) {
 		std::vector<std::string> filenames;
 		fs::listDirectoryFiles(filename, filenames);
+		std::sort(filenames.begin(), filenames.end(), fs::naturalLess); // directories list files in no particular order, parts are numbered in the order they go
 		for (int i = 0, sz = filenames.size(); i < sz; ++i) {
 			if (i == 0) {
 				commonFileSize = fs::fileSize(filenames[i]);
@@ -40,6 +63,7 @@ bool VolIterator::loadSlice(size_t z) {
 	}
 
 	assert(z < depth);
+	metrics::ScopedTimer timer(metrics::Stage::LOAD_SLICE);
 
 	// Stepping backwards or forward by a substantial amount clears the buffers fully and loads just the slice requested
 	// The assumption is that this will rarely ever be needed
@@ -48,11 +72,31 @@ bool VolIterator::loadSlice(size_t z) {
 		currentZ = z;
 	}
 
-	// Fetch the slices required to fill the gap between currentZ and z
+	// Fetch the slices required to fill the gap between currentZ and z, reading only the rows of the region
+	const size_t rows = params.region.size(1);
 	while (z >= currentZ + slices.size()) {
-		float* slice = new float[width * height];
-		std::size_t remaining = width * height * sizeof(float); // number of bytes to read
-		std::streamoff pos = (std::streamoff)(currentZ + slices.size()) * width * height * sizeof(float); // global offset
+
+		// Short of memory, drop the slices that come before those averaged with z, then give up
+		if (!budget.tryAcquire(width * rows * sizeof(float))) {
+			while (!slices.empty() && currentZ + params.downscaleZ <= z) {
+				++currentZ;
+				delete[] slices.front();
+				slices.erase(slices.begin());
+				budget.release(sliceBytes);
+				metrics::add(metrics::Counter::SLICES_EVICTED);
+			}
+			if (slices.empty() && z + 1 > currentZ + params.downscaleZ) {
+				currentZ = z + 1 - params.downscaleZ;
+			}
+			if (!budget.tryAcquire(width * rows * sizeof(float))) {
+				budget.printExceeded("loading a volume slice", width * rows * sizeof(float));
+				return false;
+			}
+		}
+		sliceBytes = width * rows * sizeof(float);
+		float* slice = new float[width * rows];
+		std::size_t remaining = width * rows * sizeof(float); // number of bytes to read
+		std::streamoff pos = ((std::streamoff)(currentZ + slices.size()) * height + params.region.begin[1]) * width * sizeof(float); // global offset
 		std::size_t writeOffset = 0; // offset into the slice being written out
 		while (remaining > 0) {
 			std::size_t fileIdx = pos / commonFileSize; // grab the file that contains the beginning of the range of bytes to read
@@ -73,6 +117,8 @@ bool VolIterator::loadSlice(size_t z) {
 			pos += readSize;
 		}
 		slices.push_back(slice);
+		metrics::add(metrics::Counter::BYTES_READ, width * rows * sizeof(float));
+		metrics::add(metrics::Counter::SLICES_LOADED);
 	}
 
 	// Free up trailing slices that aren't needed anymore
@@ -80,6 +126,8 @@ bool VolIterator::loadSlice(size_t z) {
 		++currentZ;
 		delete[] slices.front();
 		slices.erase(slices.begin());
+		budget.release(sliceBytes);
+		metrics::add(metrics::Counter::SLICES_EVICTED);
 	}
 
 	return true;
@@ -93,6 +141,8 @@ VolIterator::~VolIterator() {
 }
 
 void VolIterator::clearSlices() {
+	metrics::add(metrics::Counter::SLICES_EVICTED, slices.size());
+	budget.release(slices.size() * sliceBytes);
 	for (auto& slice : slices) {
 		delete[] slice;
 		slice = nullptr;
@@ -126,144 +176,202 @@ VolIterator* VolIterator::Open(std::string filename, size_t width, size_t height
 		}
 	}
 
+	// Check region
+	const VolRegion& region = params.region;
+	if (!region.empty() && (region.begin[0] >= width || region.begin[1] >= height || region.begin[2] >= depth)) {
+		printf(RED "Region %zu,%zu,%zu to %zu,%zu,%zu lies outside of the %zu x %zu x %zu volume.\n" WHITE, region.begin[0], region.begin[1], region.begin[2], region.end[0], region.end[1], region.end[2], width, height, depth);
+		return nullptr;
+	}
+
 	// Create iterator
 	return new VolIterator(filename, width, height, depth, params);
 }
 
+void VolIterator::setRegion(const VolRegion& region) {
+	const size_t sizes[3] = { width, height, depth };
+	const size_t downscale[3] = { params.downscaleX, params.downscaleY, params.downscaleZ };
+	params.region = region;
+	for (int axis = 0; axis < 3; ++axis) {
+		if (region.empty()) {
+			params.region.begin[axis] = 0;
+			params.region.end[axis] = sizes[axis];
+		} else {
+			// Begin on the downscale grid of the whole volume, so that downscaled voxels and the region's origin line up with those of the whole volume
+			params.region.end[axis] = std::min(params.region.end[axis], sizes[axis]);
+			params.region.begin[axis] = std::min(params.region.begin[axis], params.region.end[axis]) / downscale[axis] * downscale[axis];
+		}
+	}
+	clearSlices();
+	currentZ = 0;
+}
+
+void VolIterator::setLoadedNum(size_t loadedNum) {
+	params.loadedNum = std::max(loadedNum, params.downscaleZ);
+}
+
+VolRegion VolIterator::downscaledToRegion(const size_t begin[3], const size_t end[3], size_t margin) const {
+	const size_t downscale[3] = { params.downscaleX, params.downscaleY, params.downscaleZ };
+	VolRegion region;
+	for (int axis = 0; axis < 3; ++axis) {
+		const size_t from = begin[axis] > margin ? begin[axis] - margin : 0;
+		const size_t to = end[axis] + margin;
+		region.begin[axis] = std::min(params.region.end[axis], params.region.begin[axis] + from * downscale[axis]);
+		region.end[axis] = std::min(params.region.end[axis], params.region.begin[axis] + to * downscale[axis]);
+	}
+	return region;
+}
+
+void VolIterator::getDownscaledOrigin(float origin[3]) const {
+	const size_t downscale[3] = { params.downscaleX, params.downscaleY, params.downscaleZ };
+	for (int axis = 0; axis < 3; ++axis) {
+		origin[axis] = (float)params.region.begin[axis] / downscale[axis];
+	}
+}
+
+VolIterator* VolIterator::clone() const {
+	VolIterator* vol = new VolIterator(filename, width, height, depth, params);
+	vol->brickIndex = brickIndex;
+	return vol;
+}
+
+void VolIterator::setBrickIndex(std::shared_ptr<const BrickIndex> index) {
+	brickIndex = std::move(index);
+}
+
+bool VolIterator::getValueBounds(size_t z, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float& min, float& max) const {
+	if (!brickIndex || xBegin >= xEnd || yBegin >= yEnd) {
+		return false;
+	}
+	const VolRegion& region = params.region;
+	VolRegion full;
+	full.begin[0] = std::min(region.end[0], region.begin[0] + xBegin * params.downscaleX);
+	full.end[0] = std::min(region.end[0], region.begin[0] + xEnd * params.downscaleX);
+	full.begin[1] = std::min(region.end[1], region.begin[1] + yBegin * params.downscaleY);
+	full.end[1] = std::min(region.end[1], region.begin[1] + yEnd * params.downscaleY);
+	full.begin[2] = std::min(region.end[2], region.begin[2] + z * params.downscaleZ);
+	full.end[2] = std::min(region.end[2], full.begin[2] + params.downscaleZ);
+	if (!brickIndex->getBounds(full, min, max)) {
+		return false;
+	}
+
+	// An average lies within the bounds of its samples, up to the rounding of its sum
+	const size_t samples = params.downscaleX * params.downscaleY * params.downscaleZ;
+	if (samples > 1) {
+		const float margin = std::max(std::abs(min), std::abs(max)) * (samples + 1) * FLT_EPSILON;
+		min -= margin;
+		max += margin;
+	}
+	return true;
+}
+
 float VolIterator::getVoxel(size_t x, size_t y, size_t z) {
 
 	// Sample downscaleX x downscaleY x downscaleZ pixels to return an average
 	float total = 0.0f;
 	size_t count = 0;
-	for (size_t fullZ = z * params.downscaleZ; fullZ < (z + 1) * params.downscaleZ && fullZ < depth; ++fullZ) {
+	const VolRegion& region = params.region;
+	const size_t zBegin = region.begin[2] + z * params.downscaleZ, yBegin = region.begin[1] + y * params.downscaleY, xBegin = region.begin[0] + x * params.downscaleX;
+	for (size_t fullZ = zBegin; fullZ < zBegin + params.downscaleZ && fullZ < region.end[2]; ++fullZ) {
 		
 		if (fullZ < currentZ || fullZ >= currentZ + slices.size()) {
 			printf(RED "Z is out of range when fetching voxels: %zu: full = %zu, current = %zu, slices.length = %zu (loaded num: %zu), depth = %zu...\n" WHITE, z, fullZ, currentZ, slices.size(), params.loadedNum, depth);
 			exit(1);
 		}
 
-		for (size_t fullY = y * params.downscaleY; fullY < (y + 1) * params.downscaleY && fullY < height; ++fullY) {
-			for (size_t fullX = x * params.downscaleX; fullX < (x + 1) * params.downscaleX && fullX < width; ++fullX) {
-				total += slices[fullZ - currentZ][fullY * width + fullX];
+		for (size_t fullY = yBegin; fullY < yBegin + params.downscaleY && fullY < region.end[1]; ++fullY) {
+			for (size_t fullX = xBegin; fullX < xBegin + params.downscaleX && fullX < region.end[0]; ++fullX) {
+				total += slices[fullZ - currentZ][(fullY - region.begin[1]) * width + fullX];
 				++count;
 			}
 		}
 	}
 
 	// Average the sampled values
+	metrics::add(metrics::Counter::VOXELS_SAMPLED, count);
 	return total / count;
 }
 
-bool VolIterator::exportSlicePng(size_t z, std::string filename, float minThreshold, float maxThreshold) {
-
-	if (z >= getDownscaledDepth()) {
-		printf(RED "Invalid slice %zu on volume of size %zu x %zu x %zu.\n" WHITE, z, getDownscaledWidth(), getDownscaledHeight(), getDownscaledDepth());
-		return false;
-	}
-    
-    // load required slice(s)
-	for (size_t fullZ = z * params.downscaleZ; fullZ < (z + 1) * params.downscaleZ && fullZ < depth; ++fullZ) {
-		if (!loadSlice(fullZ)) {
-			printf(RED "Cannot load slice %zu out of %zu, aborting.\n" WHITE, fullZ, depth);
-			return false;
-		}
-	}
-
-	// Convert slice to 8-bit greyscale image
-	size_t dWidth = getDownscaledWidth();
-	size_t dHeight = getDownscaledHeight();
-	unsigned char* pixels = new unsigned char[dWidth * dHeight];
-	for (size_t y = 0; y < dHeight; ++y) {
-		for (size_t x = 0; x < dWidth; ++x) {
-			float val = getVoxel(x, y, z);
-			val = (val - minThreshold) / (maxThreshold - minThreshold); // 0..1 remap
-			pixels[y * dWidth + x] = val < 0.0f ? 0 : val > 1.0f ? 255 : int(val * 255); // clamp & write
-		}
-	}
-
-	// Write out png file
-	bool success = stbi_write_png(filename.c_str(), (int)dWidth, (int)dHeight, 1 /* greyscale */, pixels, 0);
-	delete[] pixels;
-	pixels = nullptr;
-	if (!success) {
-		printf(RED "Error writing to %zu x %zu png file %s.\n" WHITE, dWidth, dHeight, filename.c_str());
-		return false;
-	}
-
-	return true;
+bool VolIterator::readSlice(size_t z, float* out) {
+	return readRows(z, 0, getDownscaledHeight(), out);
 }
 
-bool VolIterator::exportObj(std::string filename, float threshold, float scale) {
-
-	ObjModel model;
+bool VolIterator::readRows(size_t z, size_t yFirst, size_t yLast, float* out) {
+	return readBlock(z, 0, getDownscaledWidth(), yFirst, yLast, out);
+}
 
-	size_t dDepth = getDownscaledDepth();
-	size_t dWidth = getDownscaledWidth();
-	size_t dHeight = getDownscaledHeight();
+bool VolIterator::readBlock(size_t z, size_t xFirst, size_t xLast, size_t yFirst, size_t yLast, float* out) {
 
-	if (params.loadedNum < 3 * params.downscaleZ) {
-		printf(RED "params.loadedNum needs to be at least %zu for simple obj export to function!\n" WHITE, 3 * params.downscaleZ);
+	if (z >= getDownscaledDepth() || xFirst > xLast || xLast > getDownscaledWidth() || yFirst > yLast || yLast > getDownscaledHeight()) {
+		printf(RED "Invalid block %zu,%zu to %zu,%zu of slice %zu on volume of size %zu x %zu x %zu.\n" WHITE, xFirst, yFirst, xLast, yLast, z, getDownscaledWidth(), getDownscaledHeight(), getDownscaledDepth());
 		return false;
 	}
 
-	// load first slice(s)
-	for (size_t fullZ = 0; fullZ < params.downscaleZ && fullZ < depth; ++fullZ) {
+	// load required slice(s)
+	const VolRegion& region = params.region;
+	const size_t zBegin = region.begin[2] + z * params.downscaleZ, zEnd = std::min(region.end[2], zBegin + params.downscaleZ);
+	for (size_t fullZ = zBegin; fullZ < zEnd; ++fullZ) {
 		if (!loadSlice(fullZ)) {
 			printf(RED "Cannot load slice %zu out of %zu, aborting.\n" WHITE, fullZ, depth);
 			return false;
 		}
 	}
 
-	// Iterate over voxels, slice by slice
-	for (size_t z = 0; z < dDepth; ++z) {
-
-		// Ensure the next slice(s) is/are loaded in - the current and previous slices should already be available.
-		if (z < dDepth - 1) {
-			for (size_t fullZ = (z + 1) * params.downscaleZ; fullZ < (z + 2) * params.downscaleZ && fullZ < depth; ++fullZ) {
-				if (!loadSlice(fullZ)) {
-					printf(RED "Cannot load slice %zu (at step %zu) out of %zu (full = %zu, depth = %zu), aborting.\n" WHITE, z + 1, z, getDownscaledDepth(), fullZ, depth);
-					return false;
+	// Accumulate a row of downscaled voxels at a time, within the region; each voxel sums its samples in the same order as getVoxel
+	metrics::ScopedTimer timer(metrics::Stage::DOWNSCALE);
+	const size_t regionWidth = region.size(0);
+	const size_t dWidth = xLast - xFirst;
+	for (size_t y = yFirst; y < yLast; ++y) {
+		float* row = &out[(y - yFirst) * dWidth];
+		std::fill(row, row + dWidth, 0.0f);
+		const size_t yBegin = region.begin[1] + y * params.downscaleY, yEnd = std::min(region.end[1], yBegin + params.downscaleY);
+		for (size_t fullZ = zBegin; fullZ < zEnd; ++fullZ) {
+			for (size_t fullY = yBegin; fullY < yEnd; ++fullY) {
+				const float* fullRow = &slices[fullZ - currentZ][(fullY - region.begin[1]) * width + region.begin[0]];
+				if (params.downscaleX == 1) {
+					for (size_t x = 0; x < dWidth; ++x) {
+						row[x] += fullRow[xFirst + x];
+					}
+				} else {
+					for (size_t x = 0; x < dWidth; ++x) {
+						for (size_t fullX = (xFirst + x) * params.downscaleX; fullX < (xFirst + x + 1) * params.downscaleX && fullX < regionWidth; ++fullX) {
+							row[x] += fullRow[fullX];
+						}
+					}
 				}
 			}
 		}
-		
-		for (size_t y = 0; y < dHeight; ++y) {
-			for (size_t x = 0; x < dWidth; ++x) {
 
-				bool vox = getVoxel(x, y, z) >= threshold;
-				if (!vox) continue;
-
-				// 6 sides
-				if (x == dWidth - 1 || getVoxel(x + 1, y, z) < threshold) {
-					model.addAASquare((x + 0.5f) * scale, y * scale, z * scale, ObjModel::Direction::POS_X, 0.5f * scale);
-				}
-				if (x == 0 || getVoxel(x - 1, y, z) < threshold) {
-					model.addAASquare((x - 0.5f) * scale, y * scale, z * scale, ObjModel::Direction::NEG_X, 0.5f * scale);
-				}
-				if (y == dHeight - 1 || getVoxel(x, y + 1, z) < threshold) {
-					model.addAASquare(x * scale, (y + 0.5f) * scale, z * scale, ObjModel::Direction::POS_Y, 0.5f * scale);
-				}
-				if (y == 0 || getVoxel(x, y - 1, z) < threshold) {
-					model.addAASquare(x * scale, (y - 0.5f) * scale, z * scale, ObjModel::Direction::NEG_Y, 0.5f * scale);
-				}
-				if (z == dDepth - 1 || getVoxel(x, y, z + 1) < threshold) {
-					model.addAASquare(x * scale, y * scale, (z + 0.5f) * scale, ObjModel::Direction::POS_Z, 0.5f * scale);
-				}
-				if (z == 0 || getVoxel(x, y, z - 1) < threshold) {
-					model.addAASquare(x * scale, y * scale, (z - 0.5f) * scale, ObjModel::Direction::NEG_Z, 0.5f * scale);
-				}
-
-			}
+		// Average the sampled values; only the last column can have fewer samples
+		const size_t samplesYZ = (yEnd - yBegin) * (zEnd - zBegin);
+		for (size_t x = 0; x < dWidth; ++x) {
+			const size_t samplesX = std::min(regionWidth, (xFirst + x + 1) * params.downscaleX) - (xFirst + x) * params.downscaleX;
+			row[x] /= samplesX * samplesYZ;
 		}
-
-		printf("%zu of %zu\n", z + 1, dDepth);
 	}
 
-	// Write out to wavefront file
-	if (!model.writeToFile(filename)) {
-		printf(RED "Cannot write obj model to file %s, aborting.\n" WHITE, filename.c_str());
-		return false;
+	const size_t fullColumns = std::min(regionWidth, xLast * params.downscaleX) - std::min(regionWidth, xFirst * params.downscaleX);
+	const size_t fullRows = std::min(region.end[1], region.begin[1] + yLast * params.downscaleY) - std::min(region.end[1], region.begin[1] + yFirst * params.downscaleY);
+	metrics::add(metrics::Counter::VOXELS_SAMPLED, (uint64_t)fullColumns * fullRows * (zEnd - zBegin));
+	return true;
+}
+
+const float* VolIterator::getFullSlice(size_t z) {
+	if (z < params.region.begin[2] || z >= params.region.end[2] || !loadSlice(z)) {
+		printf(RED "Cannot load slice %zu out of %zu.\n" WHITE, z, depth);
+		return nullptr;
 	}
+	return slices[z - currentZ];
+}
 
-	return true;
+bool VolIterator::exportSlicePng(size_t z, std::string filename, float minThreshold, float maxThreshold, MaskSource* mask) {
+	VolSlices values(*this);
+	return slices::exportPng(values, z, filename, minThreshold, maxThreshold, mask);
+}
+
+bool VolIterator::exportObj(std::string filename, float threshold, float scale, const DecimateParams& decimate) {
+	VolSlices values(*this);
+	ThresholdMask mask(values, threshold);
+	float offset[3];
+	getDownscaledOrigin(offset);
+	return mesher::exportObj(mask, filename, scale, decimate, offset);
 }
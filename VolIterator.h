@@ -3,11 +3,31 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include <memory>
+
+#include "Decimator.h"
+
+class MaskSource;
+class BrickIndex;
+class MemoryBudget;
+
+
+/// Box of full-resolution voxels, [begin, end) along X, Y and Z
+struct VolRegion {
+	size_t begin[3] = { 0, 0, 0 };
+	size_t end[3] = { 0, 0, 0 };
+
+	inline bool empty() const { return end[0] <= begin[0] || end[1] <= begin[1] || end[2] <= begin[2]; }
+	inline size_t size(int axis) const { return end[axis] > begin[axis] ? end[axis] - begin[axis] : 0; }
+
+	/// Reads "x0,y0,z0,x1,y1,z1"; returns false on malformed text
+	static bool parse(const std::string& text, VolRegion& region);
+};
 
 
 struct VolIteratorParams {
 
-	/// Maximum of slices to extract simultaneously before discarding old slices
+	/// Maximum of slices to extract simultaneously before discarding old slices; fewer are kept when the memory budget runs short
 	size_t loadedNum = 5;
 
 	/// Downscale factors - if downscaleX == 2, each sampled voxel at coord x will be the result of the average of (x * 2) and (x * 2 + 1)
@@ -15,11 +35,18 @@ struct VolIteratorParams {
 	size_t downscaleY = 1;
 	size_t downscaleZ = 1;
 
+	/// Region of the volume to read, in full-resolution voxels; slices only get read within its rows, and downscaled voxels start at its corner
+	/// An empty region reads the whole volume
+	VolRegion region;
+
 };
 
 
 class VolIterator {
 
+	/// Path to the .vol file or directory of .vol-parts
+	std::string filename;
+
 	/// Width, height, depth of the file
 	size_t width, height, depth;
 
@@ -30,13 +57,20 @@ class VolIterator {
 	std::vector<std::ifstream> files;
 	size_t commonFileSize;
 
-	/// Array of slices of the file currently loaded in; each slice is width x height floats
+	/// Array of slices of the file currently loaded in; each slice holds the rows of the region, width x region height floats
 	/// Maximum length at any one time is params.loadedNum
 	std::vector<float*> slices;
 
 	/// Z coordinate of the first slice currently loaded into the slices vector; if more than one slice is loaded, they're assumed to be neighbours
 	size_t currentZ = 0;
 
+	/// Size of each loaded slice, reserved from the memory budget current when the iterator was created while it's loaded
+	size_t sliceBytes = 0;
+	MemoryBudget& budget;
+
+	/// Per-brick value bounds of the whole volume, if available; shared with clones
+	std::shared_ptr<const BrickIndex> brickIndex;
+
 protected:
 
 	/// Creates a volume iterator to read a .vol file, assumed large
@@ -51,10 +85,37 @@ public:
 	/// Attempts to find the given file, and checks the file size; if valid, returns a new VolIterator; if not, returns nullptr
 	static VolIterator* Open(std::string filename, size_t width, size_t height, size_t depth, const VolIteratorParams& params);
 
-	/// Getters
-	inline size_t getDownscaledWidth()	const { return width / params.downscaleX  + (width % params.downscaleX  ? 1 : 0); }
-	inline size_t getDownscaledHeight() const { return height / params.downscaleY + (height % params.downscaleY ? 1 : 0); }
-	inline size_t getDownscaledDepth()	const { return depth / params.downscaleZ  + (depth % params.downscaleZ  ? 1 : 0); }
+	/// Opens the same volume again, with its own file handles and slices, so that it can be read from another thread
+	VolIterator* clone() const;
+
+	/// Getters; downscaled sizes are those of the region
+	inline size_t getDownscaledWidth()	const { return (params.region.size(0) + params.downscaleX - 1) / params.downscaleX; }
+	inline size_t getDownscaledHeight() const { return (params.region.size(1) + params.downscaleY - 1) / params.downscaleY; }
+	inline size_t getDownscaledDepth()	const { return (params.region.size(2) + params.downscaleZ - 1) / params.downscaleZ; }
+	inline const VolRegion& getRegion() const { return params.region; }
+	inline size_t getFullWidth() const { return width; }
+	inline size_t getFullHeight() const { return height; }
+	inline size_t getFullDepth() const { return depth; }
+	inline const std::string& getFilename() const { return filename; }
+
+	/// Restricts reading to a region (clamped to the volume, and its begin moved back onto the downscale grid; empty for the whole volume), dropping loaded slices
+	void setRegion(const VolRegion& region);
+
+	/// Sets the maximum of slices kept loaded, at least downscaleZ; clones made afterwards keep as many
+	void setLoadedNum(size_t loadedNum);
+
+	/// Position of the region's corner in downscaled voxels, to place outputs where they'd be in the whole volume
+	void getDownscaledOrigin(float origin[3]) const;
+
+	/// Full-resolution region covered by downscaled voxels [begin, end) of the current region, grown by margin downscaled voxels on each side
+	VolRegion downscaledToRegion(const size_t begin[3], const size_t end[3], size_t margin) const;
+
+	/// Attaches an index of the volume's per-brick value bounds, used to answer getValueBounds
+	void setBrickIndex(std::shared_ptr<const BrickIndex> index);
+
+	/// Bounds [min, max] of the downscaled values of columns [xBegin, xEnd) of rows [yBegin, yEnd) of slice z, from the brick index without reading anything;
+	/// returns false without an index. When averaging, the bounds are widened by the rounding error the sums may make
+	bool getValueBounds(size_t z, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float& min, float& max) const;
 
 	/// Clears the internal buffer of slices
 	void clearSlices();
@@ -62,9 +123,22 @@ public:
 	/// Obtains the float value for a single voxel
 	float getVoxel(size_t x, size_t y, size_t z);
 
-	/// Exports a png image of a slice
-	bool exportSlicePng(size_t z, std::string filename, float minThreshold, float maxThreshold);
+	/// Fills out with the dWidth x dHeight averaged voxels of downscaled slice z, loading the slices it needs
+	bool readSlice(size_t z, float* out);
+
+	/// Fills out with the dWidth x (yEnd - yBegin) averaged voxels of rows [yBegin, yEnd) of downscaled slice z, loading the slices it needs
+	bool readRows(size_t z, size_t yBegin, size_t yEnd, float* out);
+
+	/// Fills out with the (xEnd - xBegin) x (yEnd - yBegin) averaged voxels of columns [xBegin, xEnd) of rows [yBegin, yEnd) of downscaled slice z, loading the
+	/// slices it needs; only those columns get averaged
+	bool readBlock(size_t z, size_t xBegin, size_t xEnd, size_t yBegin, size_t yEnd, float* out);
+
+	/// Loads full-resolution slice z and returns its rows within the region, width x region height floats, valid until the next slice gets loaded; nullptr on failure
+	const float* getFullSlice(size_t z);
+
+	/// Exports a png image of a slice; voxels outside of mask (if given) are left black
+	bool exportSlicePng(size_t z, std::string filename, float minThreshold, float maxThreshold, MaskSource* mask = nullptr);
 
-	/// Converts the entire volume to cubified polygon mesh
-	bool exportObj(std::string filename, float threshold, float scale);
+	/// Converts the entire volume to cubified polygon mesh, optionally simplified
+	bool exportObj(std::string filename, float threshold, float scale, const DecimateParams& decimate = DecimateParams());
 };
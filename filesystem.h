@@ -2,6 +2,8 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <cctype>
 #ifdef __MINGW32__
 	// On MinGW, cannot use std::filesystem...
 	#include <sys/stat.h>
@@ -35,6 +37,32 @@ namespace fs {
 		}
 	}
 
+	/// Orders filenames with the numbers in them compared by value, so that part2 comes before part10
+	inline bool naturalLess(const std::string& a, const std::string& b) {
+		size_t i = 0, j = 0;
+		while (i < a.size() && j < b.size()) {
+			if (isdigit((unsigned char)a[i]) && isdigit((unsigned char)b[j])) {
+				// Compare the numbers without leading zeros by length, then digit by digit
+				size_t iEnd = i, jEnd = j;
+				while (i < a.size() && a[i] == '0') ++i;
+				while (j < b.size() && b[j] == '0') ++j;
+				for (iEnd = i; iEnd < a.size() && isdigit((unsigned char)a[iEnd]); ++iEnd);
+				for (jEnd = j; jEnd < b.size() && isdigit((unsigned char)b[jEnd]); ++jEnd);
+				if (iEnd - i != jEnd - j) return iEnd - i < jEnd - j;
+				const int order = a.compare(i, iEnd - i, b, j, jEnd - j);
+				if (order != 0) return order < 0;
+				i = iEnd;
+				j = jEnd;
+			} else if (a[i] != b[j]) {
+				return (unsigned char)a[i] < (unsigned char)b[j];
+			} else {
+				++i;
+				++j;
+			}
+		}
+		return a.size() - i < b.size() - j;
+	}
+
 	/// Returns the file size in bytes of the given file
 	inline size_t fileSize(std::string filename) {
 	#ifdef __MINGW32__
@@ -45,6 +73,18 @@ namespace fs {
 	#endif
 	}
 
+	/// Returns the time the given file was last modified, in ticks of the platform's file clock since its epoch
+	inline int64_t fileModificationTime(std::string filename) {
+	#ifdef __MINGW32__
+		struct stat buf;
+		return stat(filename.c_str(), &buf) == 0 ? (int64_t)buf.st_mtime : 0;
+	#else
+		std::error_code error;
+		const auto time = std::filesystem::last_write_time(filename, error);
+		return error ? 0 : (int64_t)time.time_since_epoch().count();
+	#endif
+	}
+
 	/// Creates the directory pointed to by the path and returns true for success
 	inline bool createDirectory(std::string path) {
 		if (fileExists(path)) return true;
@@ -55,4 +95,32 @@ namespace fs {
 	#endif
 	}
 
+	/// Deletes a file, or a directory along with the files in it
+	inline void removeAll(std::string path) {
+	#ifdef __MINGW32__
+		if (isDirectory(path)) {
+			std::vector<std::string> filenames;
+			listDirectoryFiles(path, filenames);
+			for (const std::string& filename : filenames) std::remove(filename.c_str());
+			_rmdir(path.c_str());
+		} else {
+			std::remove(path.c_str());
+		}
+	#else
+		std::filesystem::remove_all(path);
+	#endif
+	}
+
+	/// Moves a file to a new name, replacing any file there; returns true for success
+	inline bool renameFile(std::string from, std::string to) {
+	#ifdef __MINGW32__
+		std::remove(to.c_str());
+		return std::rename(from.c_str(), to.c_str()) == 0;
+	#else
+		std::error_code error;
+		std::filesystem::rename(from, to, error);
+		return !error;
+	#endif
+	}
+
 }
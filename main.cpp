@@ -1,23 +1,65 @@
 
 #include <iostream>
 #include <memory>
+#include <cmath>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
 #include "VolIterator.h"
+#include "BrickIndex.h"
+#include "MaskSource.h"
+#include "SliceSource.h"
+#include "Filters.h"
+#include "AdaptiveThreshold.h"
+#include "Morphology.h"
+#include "Components.h"
+#include "Mesher.h"
+#include "DistanceTransform.h"
+#include "Thickness.h"
+#include "Stats.h"
+#include "Measure.h"
+#include "RegionGrowing.h"
+#include "Pipeline.h"
+#include "Batch.h"
+#include "Bench.h"
+#include "Metrics.h"
+#include "ThreadPool.h"
 #include "Arguments.h"
 #include "filesystem.h"
 #include "colours.h"
 
 
-int main(int argc, char** argv) {
-	printf("\n");
+/// Runs one scan with the given command-line arguments; returns the exit code
+/// Jobs of a batch fail on bad arguments instead of exiting, cannot change the thread pool or memory budget the batch shares, and within a memory budget, wait
+/// for a budget of their own out of it; validateOnly stops once the arguments are read and checked
+static int runJob(int argc, char** argv, bool batchJob, uint64_t& regionBytes, bool validateOnly = false) {
 
 	// Read command-line arguments
 	std::string filename;
 	size_t width, height, depth, skipZ = 0;
-    float threshold;
-    bool generate3DModel;
+    float threshold, hysteresisHigh;
+    bool useBrickIndex, autoCrop, printThreadStats, printMetrics, writeTrace, generate3DModel, generateThickness, generateStats, generateMeasurements, generateFilteredVol, analyseComponents, extractCavity;
+    float voxelSize;
+    float gaussianSigma;
+    size_t medianRadius;
+    std::string morphologyName, greyMorphologyName, adaptiveName;
+    AdaptiveParams adaptive;
+    size_t morphologyRadius;
 	VolIteratorParams params;
+	DecimateParams decimate;
+	ComponentParams components, cavity;
+	size_t cavitySeal;
+	GrowParams grow;
+    std::vector<std::string> outputs;
+    size_t histogramBins;
+    float histogramMin, histogramMax;
+    size_t shardIndex = 0, shardCount = 1;
     {
-        Arguments args(argc, argv);
+        Arguments args(argc, argv, !batchJob);
+        if (batchJob && (args.has("threads") || args.has("memoryBudget"))) {
+            printf(RED "-threads and -memoryBudget apply to the whole batch, give them alongside -batch rather than on manifest lines.\n" WHITE);
+            return 1;
+        }
         if (args.read<bool>("harp-adult", false)) {
             filename = "../seals-scans/phoca_groenlandica_7495 [2022-04-20 11.02.48]/phoca_groenlandica_7495b/phoca_groenlandica_7495.vol-parts";
             width = 1920;
@@ -41,20 +83,170 @@ int main(int argc, char** argv) {
             depth = args.read<size_t>("depth", 1535);
         }
         threshold = args.read<float>("threshold", 7.5f);
+        hysteresisHigh = args.read<float>("hysteresis", threshold);
         params.downscaleX = params.downscaleY = args.read<size_t>("downscaleXY", 1);
         params.downscaleZ = args.read<size_t>("downscaleZ", 1);
+        if (!VolRegion::parse(args.read<std::string>("roi", "0,0,0,0,0,0"), params.region)) {
+            printf(RED "Cannot read region of interest, expecting x0,y0,z0,x1,y1,z1 in full-resolution voxels.\n" WHITE);
+            return 1;
+        }
+        useBrickIndex = args.read<bool>("brickIndex", false);
+        autoCrop = args.read<bool>("autoCrop", false);
+        adaptiveName = args.read<std::string>("adaptive", "");
+        if (!adaptiveName.empty() && !AdaptiveParams::parseMethod(adaptiveName, adaptive.method)) {
+            printf(RED "Unknown adaptive threshold method %s (expected niblack or sauvola).\n" WHITE, adaptiveName.c_str());
+            return 1;
+        }
+        adaptive.k = args.read<float>("adaptiveK", adaptive.method == AdaptiveMethod::NIBLACK ? 0.2f : 0.5f);
+        adaptive.radius = args.read<size_t>("adaptiveRadius", adaptive.radius);
+        adaptive.volumetric = args.read<bool>("adaptive3d", false);
+        adaptive.minStdDev = args.read<float>("adaptiveMinStdDev", 0.0f);
+        adaptive.threshold = threshold;
+        medianRadius = args.read<size_t>("median", 0);
+        gaussianSigma = args.read<float>("gaussian", 0.0f);
+        greyMorphologyName = args.read<std::string>("greyMorphology", "");
+        morphologyName = args.read<std::string>("morphology", "");
+        morphologyRadius = args.read<size_t>("morphRadius", 1);
+        analyseComponents = args.read<bool>("components", false);
+        components.keepLargest = args.read<size_t>("keepComponents", 0);
+        components.minVoxels = args.read<size_t>("minComponentSize", 0);
+        if (!GrowParams::parseSeeds(args.read<std::string>("seeds", ""), grow.seeds)) {
+            printf(RED "Cannot read seeds, expecting x,y,z voxel coordinates separated by semicolons.\n" WHITE);
+            return 1;
+        }
+        grow.minValue = args.read<float>("growMin", threshold);
+        grow.maxValue = args.read<float>("growMax", grow.maxValue);
+        grow.maxGradient = args.read<float>("growGradient", 0.0f);
+        extractCavity = args.read<bool>("cavity", false);
+        cavity.keepLargest = args.read<size_t>("cavityCount", 1);
+        cavitySeal = args.read<size_t>("cavitySeal", 0);
         generate3DModel = args.read<bool>("3d", false);
+        generateThickness = args.read<bool>("thickness", false);
+        generateStats = args.read<bool>("stats", false);
+        generateMeasurements = args.read<bool>("measure", false);
+        generateFilteredVol = args.read<bool>("filteredVol", false);
+        voxelSize = args.read<float>("voxelSize", 0.0f);
+        if (!batchJob) {
+            ThreadPool::SetGlobalThreadCount(args.read<size_t>("threads", 0));
+            MemoryBudget::SetGlobalTotal((uint64_t)args.read<size_t>("memoryBudget", 0) * 1024 * 1024);
+        }
+        printThreadStats = args.read<bool>("threadStats", false);
+        printMetrics = args.read<bool>("metrics", false);
+        writeTrace = args.read<bool>("trace", false);
+        std::stringstream outputList(args.read<std::string>("outputs", ""));
+        for (std::string output; std::getline(outputList, output, ',');) {
+            if (output != "png" && output != "obj" && output != "stats" && output != "histogram" && output != "projections" && output != "vol") {
+                printf(RED "Unknown output %s (expected png, obj, stats, histogram, projections or vol).\n" WHITE, output.c_str());
+                return 1;
+            }
+            outputs.push_back(output);
+        }
+        // Each of these flags selects a single export, so combining them would silently drop all but the first; several outputs of one pass need -outputs
+        const int modeCount = (int)generate3DModel + (int)generateThickness + (int)generateStats + (int)generateMeasurements + (int)generateFilteredVol;
+        if (modeCount > 1 || (modeCount > 0 && !outputs.empty())) {
+            printf(RED "Only one of -3d, -stats, -measure, -thickness and -filteredVol can be given, and none with -outputs; use -outputs obj,stats,... to write several outputs in one pass.\n" WHITE);
+            return 1;
+        }
+        const std::string shard = args.read<std::string>("shard", "0/1");
+        if (sscanf(shard.c_str(), "%zu/%zu", &shardIndex, &shardCount) != 2 || shardCount == 0 || shardIndex >= shardCount) {
+            printf(RED "Invalid shard %s (expected i/N, with i from 0 to N - 1).\n" WHITE, shard.c_str());
+            return 1;
+        }
+        histogramBins = args.read<size_t>("histogramBins", 256);
+        histogramMin = args.read<float>("histogramMin", 0.0f);
+        histogramMax = args.read<float>("histogramMax", 2.0f * threshold);
+
+        // Sauvola's range is the largest standard deviation expected; 128 only suits 8-bit images, so it defaults to the threshold, about half the span of the values
+        adaptive.range = args.read<float>("adaptiveRange", threshold);
+        if (!adaptiveName.empty() && adaptive.method == AdaptiveMethod::SAUVOLA && !(adaptive.range > 0.0f)) {
+            printf(RED "Invalid Sauvola range %g, set -adaptiveRange to about half the span of the values (it defaults to the threshold).\n" WHITE, adaptive.range);
+            return 1;
+        }
         if (!generate3DModel) {
             skipZ = args.read<size_t>("skipZ", 10);
         }
+        if (generate3DModel || !outputs.empty()) {
+            decimate.targetTriangles = args.read<size_t>("decimate", 0);
+            decimate.maxError = args.read<float>("decimateError", 0.0f);
+        }
+        if (!args.check()) {
+            return 1;
+        }
     }
+	if (shardCount > 1 && (!outputs.empty() || generateMeasurements || generateThickness || generateFilteredVol)) {
+		printf(RED "Only slices, meshes (-3d) and statistics (-stats) can be split into shards.\n" WHITE);
+		return 1;
+	}
+	if (validateOnly) {
+		return 0;
+	}
 	params.loadedNum = params.downscaleZ * 3;
+	if (printMetrics) {
+		metrics::enable();
+	}
+	if (writeTrace) {
+		metrics::enableTracing();
+	}
+
+	// Physical volume of a downscaled voxel, 0 if the voxel size is unknown
+	const double voxelVolume = (double)voxelSize * voxelSize * voxelSize * params.downscaleX * params.downscaleY * params.downscaleZ;
 	printf(BLUE "Opening volume %s at size %zu x %zu x %zu (threshold: %f).\n\n" WHITE, filename.c_str(), width, height, depth, threshold);
 
+	// Budget of the job within a batch, if any, which everything the job allocates draws from once it has been given one
+	std::unique_ptr<MemoryBudget> jobBudget;
+	std::unique_ptr<MemoryBudget::Scope> jobScope;
+
 	// Create volume iterator object
 	std::unique_ptr<VolIterator> vol = std::unique_ptr<VolIterator>(VolIterator::Open(filename, width, height, depth, params));
 	if (!vol) return 1;
 
+    // Memory the job needs for the region of the volume: the full-resolution rows each slab's iterator keeps loaded, per slice of its window, and the downscaled
+    // slices of filters, masks, meshing and outputs
+    const bool cacheValues = std::any_of(outputs.begin(), outputs.end(), [](const std::string& output) { return output != "obj"; });
+    const size_t cacheReach = (!adaptiveName.empty() && adaptive.volumetric ? adaptive.radius : 0) + (morphologyName.empty() ? 0 : 2 * morphologyRadius) + (extractCavity ? 2 * cavitySeal : 0);
+    const uint64_t iterators = ThreadPool::Global().getThreadCount() * 2 + 2;
+    struct JobMemory {
+        uint64_t windowBytes, filterBytes, meshBytes, growBytes;
+        inline uint64_t getOtherBytes() const { return filterBytes + meshBytes + growBytes; }
+    };
+    const auto estimateMemory = [&](const VolIterator& vol) {
+        const uint64_t sliceBytes = (uint64_t)vol.getFullWidth() * vol.getRegion().size(1) * sizeof(float);
+        const uint64_t downscaledBytes = (uint64_t)vol.getDownscaledWidth() * vol.getDownscaledHeight() * sizeof(float);
+
+        // Downscaled slices each slab's chain of filters and masks holds (rings and windows of their radius plus a few working slices), as counted in floats, and
+        // a few for the outputs
+        const size_t gaussianRadius = gaussianSigma > 0.0f ? (size_t)std::ceil(3.0f * gaussianSigma) : 0;
+        const size_t greyStageCount = greyMorphologyName == "open" || greyMorphologyName == "close" ? 2 : greyMorphologyName.empty() ? 0 : 1;
+        const size_t chainSlices = 2 + (medianRadius > 0 ? 2 * medianRadius + 3 : 0) + (gaussianSigma > 0.0f ? 2 * gaussianRadius + 4 : 0) + greyStageCount * (2 * morphologyRadius + 5) +
+            (cacheValues ? 2 * cacheReach + 3 : 0) + (adaptiveName.empty() ? 0 : adaptive.volumetric ? 3 * (2 * adaptive.radius + 3) : 8) +
+            ((hysteresisHigh > threshold && grow.seeds.empty()) || analyseComponents || components.keepLargest > 0 || components.minVoxels > 0 || extractCavity ? 8 : 0) + 1;
+
+        // Region growing keeps the candidates and the region of the whole volume as bits; meshing needs at least the lattice planes of the merged mesh and a slab
+        // of a single slice, the length of slabs and how many are held at once being sized from the exposed surface once meshing starts
+        const bool meshing = generate3DModel || std::find(outputs.begin(), outputs.end(), "obj") != outputs.end();
+        return JobMemory{ iterators * sliceBytes, (iterators * chainSlices + 8) * downscaledBytes, meshing ? 5 * downscaledBytes : 0,
+            grow.seeds.empty() ? 0 : 2 * vol.getDownscaledDepth() * downscaledBytes / 32 };
+    };
+
+    // A job of a batch with a memory budget waits for a budget of its own out of the batch's, sized for the region before any cropping (which only shrinks it)
+    // as twice its filters, masks and full slice windows, to leave room for meshes and images; everything the job allocates from then on draws from it
+    MemoryBudget& globalBudget = MemoryBudget::Global();
+    if (batchJob && globalBudget.isLimited()) {
+        const JobMemory memory = estimateMemory(*vol);
+        const uint64_t jobBytes = std::min(globalBudget.getTotal(), 2 * (memory.windowBytes * params.downscaleZ * 3 + memory.getOtherBytes()));
+        printf(BLUE "Reserving %.1f MB of the %.1f MB memory budget for this job, waiting for room if needed.\n" WHITE, jobBytes / (1024.0 * 1024.0), globalBudget.getTotal() / (1024.0 * 1024.0));
+        jobBudget = std::make_unique<MemoryBudget>(jobBytes, &globalBudget);
+        jobScope = std::make_unique<MemoryBudget::Scope>(*jobBudget);
+        vol.reset(vol->clone()); // reopened so that its slices draw from the job's budget
+    }
+
+	// Per-brick value bounds, so that thresholding fills the parts of slices that are entirely air or solid without reading them
+	if (useBrickIndex) {
+		std::shared_ptr<BrickIndex> index = BrickIndex::Open(*vol);
+		if (!index) return 1;
+		vol->setBrickIndex(index);
+	}
+
 	// Get file name without extension
 	long long int lastSlash = filename.find_last_of('/');
 	long long int lastBlackslash = filename.find_last_of('\\');
@@ -67,25 +259,493 @@ int main(int argc, char** argv) {
 		printf(RED "Cannot create output directory out/%s, aborting operation.\n" WHITE, name.c_str());
 		return 1;
 	}
+
+    // Restrict processing to the bounding box of what may end up in the mask, with enough empty margin for morphology to behave as on the whole volume
+    if (autoCrop) {
+        VolSlices fullSlices(*vol);
+        ThresholdMask fullMask(fullSlices, grow.seeds.empty() ? threshold : grow.minValue);
+        AdaptiveThreshold fullAdaptiveMask(fullSlices, adaptive);
+        const bool cropAdaptive = grow.seeds.empty() && !adaptiveName.empty();
+        if (cropAdaptive) {
+            printf(BLUE "Finding bounding box of voxels above their %s threshold\n" WHITE, adaptiveName.c_str());
+        } else {
+            printf(BLUE "Finding bounding box of voxels above %g\n" WHITE, grow.seeds.empty() ? threshold : grow.minValue);
+        }
+        size_t boxBegin[3], boxEnd[3];
+        if (!masks::findBounds(cropAdaptive ? (MaskSource&)fullAdaptiveMask : fullMask, boxBegin, boxEnd)) {
+            return 1;
+        }
+        if (boxEnd[0] == 0) {
+            printf(RED "No voxels above threshold, nothing to crop to.\n" WHITE);
+            return 1;
+        }
+        const size_t margin = 1 + (cropAdaptive ? adaptive.radius : 0) + medianRadius + (gaussianSigma > 0.0f ? (size_t)std::ceil(3.0f * gaussianSigma) : 0) + (greyMorphologyName.empty() ? 0 : 2 * morphologyRadius) + (morphologyName.empty() ? 0 : 2 * morphologyRadius) + (extractCavity ? 2 * cavitySeal : 0);
+        vol->setRegion(vol->downscaledToRegion(boxBegin, boxEnd, margin));
+    }
+    if (autoCrop || !params.region.empty()) {
+        const VolRegion& region = vol->getRegion();
+        const double fullVoxels = (double)width * height * depth;
+        printf(BLUE "Processing region %zu,%zu,%zu to %zu,%zu,%zu: reading %.1f%% of the volume data, sampling %.1f%% of its voxels.\n" WHITE,
+            region.begin[0], region.begin[1], region.begin[2], region.end[0], region.end[1], region.end[2],
+            100.0 * width * region.size(1) * region.size(2) / fullVoxels, 100.0 * region.size(0) * region.size(1) * region.size(2) / fullVoxels);
+    }
+    const VolRegion& processed = vol->getRegion();
+
+    // Seeds are given in downscaled voxels of the whole volume, while everything downstream works within the region
+    if (!grow.seeds.empty() && (autoCrop || !params.region.empty())) {
+        float seedOrigin[3];
+        vol->getDownscaledOrigin(seedOrigin);
+        const size_t regionSize[3] = { vol->getDownscaledWidth(), vol->getDownscaledHeight(), vol->getDownscaledDepth() };
+        std::vector<std::array<size_t, 3>> seeds;
+        for (const auto& seed : grow.seeds) {
+            std::array<size_t, 3> local;
+            bool inside = true;
+            for (int axis = 0; axis < 3; ++axis) {
+                const size_t begin = (size_t)seedOrigin[axis];
+                inside = inside && seed[axis] >= begin && seed[axis] - begin < regionSize[axis];
+                local[axis] = seed[axis] - begin;
+            }
+            if (inside) {
+                seeds.push_back(local);
+            } else {
+                printf(YELLOW "Warning: seed %zu,%zu,%zu is outside of the processed region, ignoring it.\n" WHITE, seed[0], seed[1], seed[2]);
+            }
+        }
+        if (seeds.empty()) {
+            printf(RED "None of the seeds are inside the processed region.\n" WHITE);
+            return 1;
+        }
+        grow.seeds = seeds;
+    }
+    regionBytes = (uint64_t)width * processed.size(1) * processed.size(2) * sizeof(float);
+
+    // Within a memory budget, size the slice windows of the slab iterators to half of what is left once everything else is accounted for, and fail now rather
+    // than midway if even the smallest windows don't fit
+    MemoryBudget& memoryBudget = MemoryBudget::Current();
+    if (memoryBudget.isLimited()) {
+        const JobMemory memory = estimateMemory(*vol);
+        const uint64_t available = memoryBudget.getAvailable();
+        const uint64_t otherBytes = memory.getOtherBytes();
+        const uint64_t minimum = memory.windowBytes * params.downscaleZ + otherBytes;
+        if (minimum > available) {
+            printf(RED "A memory budget of %.1f MB is too small for this job, which needs at least %.1f MB: %.1f MB for %zu slice windows of %zu slices, %.1f MB for filters and masks, "
+                "%.1f MB for meshing and %.1f MB for region growing; raise -memoryBudget, lower -threads or crop to a region.\n" WHITE,
+                available / (1024.0 * 1024.0), minimum / (1024.0 * 1024.0), memory.windowBytes * params.downscaleZ / (1024.0 * 1024.0), (size_t)iterators, params.downscaleZ,
+                memory.filterBytes / (1024.0 * 1024.0), memory.meshBytes / (1024.0 * 1024.0), memory.growBytes / (1024.0 * 1024.0));
+            return 1;
+        }
+        const size_t loadedNum = std::min(std::max((size_t)((available / 2 > otherBytes ? available / 2 - otherBytes : 0) / memory.windowBytes), params.downscaleZ), params.downscaleZ * 3);
+        vol->setLoadedNum(loadedNum);
+        printf(BLUE "Memory budget of %.1f MB, of which about %.1f MB for filters, masks and meshing: keeping up to %zu slices loaded per iterator.\n" WHITE,
+            available / (1024.0 * 1024.0), otherBytes / (1024.0 * 1024.0), loadedNum);
+    }
+    float origin[3];
+    vol->getDownscaledOrigin(origin);
+
+    // Values, optionally denoised and filtered with greyscale morphology
+    VolSlices volSlices(*vol);
+    SliceSource* values = &volSlices;
+    std::vector<std::unique_ptr<SliceSource>> greyStages;
+    if (medianRadius > 0) {
+        greyStages.emplace_back(new MedianFilter(*values, medianRadius));
+        values = greyStages.back().get();
+    }
+    if (gaussianSigma > 0.0f) {
+        greyStages.emplace_back(new GaussianFilter(*values, gaussianSigma));
+        values = greyStages.back().get();
+    }
+    if (!greyMorphologyName.empty()) {
+        MorphologyOp op;
+        if (!morphology::parseOp(greyMorphologyName, op)) {
+            printf(RED "Unknown morphology operation %s (expected erode, dilate, open or close).\n" WHITE, greyMorphologyName.c_str());
+            return 1;
+        }
+        values = &morphology::grey(*values, op, morphologyRadius, greyStages);
+    }
+
+    // Outputs of a single sweep (other than the mesh alone) read the values the mask is computed from; a cache holding the slices the mask reads ahead of the sweep lets both share one read
+    std::unique_ptr<SliceCache> sharedValues;
+    if (cacheValues) {
+        sharedValues = std::make_unique<SliceCache>(*values, 2 * cacheReach + 3);
+        values = sharedValues.get();
+    }
+
+    // Occupancy of the voxels above the global or local threshold, or grown from seeds, optionally cleaned up with binary morphology and restricted to the main connected components
+    ThresholdMask thresholdMask(*values, threshold);
+    MaskSource* mask = &thresholdMask;
+    std::unique_ptr<AdaptiveThreshold> adaptiveMask;
+    if (!adaptiveName.empty()) {
+        printf(BLUE "Thresholding with %s over %s windows of radius %zu\n" WHITE, adaptiveName.c_str(), adaptive.volumetric ? "3D" : "2D", adaptive.radius);
+        adaptiveMask = std::make_unique<AdaptiveThreshold>(*values, adaptive);
+        mask = adaptiveMask.get();
+    }
+    std::unique_ptr<ThresholdMask> hysteresisSeeds;
+    std::unique_ptr<ComponentFilter> hysteresisFilter;
+    if (hysteresisHigh > threshold && grow.seeds.empty()) {
+        printf(BLUE "Keeping components above threshold that hold voxels above %g\n" WHITE, hysteresisHigh);
+        ComponentParams seeded;
+        seeded.markedOnly = true;
+        hysteresisSeeds = std::make_unique<ThresholdMask>(*values, hysteresisHigh);
+        hysteresisFilter = std::make_unique<ComponentFilter>(*mask, seeded, hysteresisSeeds.get());
+        if (!hysteresisFilter->analyse() || !hysteresisFilter->report("")) {
+            return 1;
+        }
+        mask = hysteresisFilter.get();
+    }
+    std::unique_ptr<RegionGrowing> region;
+    if (!grow.seeds.empty()) {
+        printf(BLUE "Growing region from %zu seed(s) through values in [%g, %g]\n" WHITE, grow.seeds.size(), grow.minValue, grow.maxValue);
+        region = std::make_unique<RegionGrowing>(*values, grow);
+        if (!region->grow()) {
+            return 1;
+        }
+        printf(BLUE "Region holds %llu voxels.\n" WHITE, (unsigned long long)region->getVoxelCount());
+        mask = region.get();
+    }
+    std::vector<std::unique_ptr<MaskSource>> maskStages;
+    if (!morphologyName.empty()) {
+        MorphologyOp op;
+        if (!morphology::parseOp(morphologyName, op)) {
+            printf(RED "Unknown morphology operation %s (expected erode, dilate, open or close).\n" WHITE, morphologyName.c_str());
+            return 1;
+        }
+        mask = &morphology::binary(*mask, op, morphologyRadius, maskStages);
+    }
+    std::unique_ptr<ComponentFilter> componentFilter;
+    const bool filterComponents = components.keepLargest > 0 || components.minVoxels > 0;
+    if (analyseComponents || filterComponents) {
+        printf(BLUE "Labelling connected components, sizes written to out/%s.components.csv\n" WHITE, name.c_str());
+        componentFilter = std::make_unique<ComponentFilter>(*mask, components);
+        if (!componentFilter->analyse() || !componentFilter->report("out/" + name + ".components.csv")) {
+            return 1;
+        }
+        if (filterComponents) {
+            mask = componentFilter.get();
+        }
+    }
+
+    // Enclosed air: background not connected to the volume bounds, after optionally closing the bone to seal small openings
+    std::unique_ptr<InvertedMask> background;
+    std::unique_ptr<ComponentFilter> cavityFilter;
+    if (extractCavity) {
+        MaskSource* bone = mask;
+        if (cavitySeal > 0) {
+            bone = &morphology::binary(*bone, MorphologyOp::CLOSE, cavitySeal, maskStages);
+        }
+        background = std::make_unique<InvertedMask>(*bone);
+        cavity.enclosedOnly = true;
+        printf(BLUE "Labelling background, sizes written to out/%s.cavity.csv\n" WHITE, name.c_str());
+        cavityFilter = std::make_unique<ComponentFilter>(*background, cavity);
+        if (!cavityFilter->analyse() || !cavityFilter->report("out/" + name + ".cavity.csv")) {
+            return 1;
+        }
+        uint64_t cavityVoxels = 0;
+        for (const ComponentFilter::Component& component : cavityFilter->getComponents()) {
+            if (cavityFilter->isKept(component)) cavityVoxels += component.voxels;
+        }
+        if (voxelVolume > 0.0) {
+            printf(BLUE "Cavity volume: %llu voxels (%g).\n" WHITE, (unsigned long long)cavityVoxels, cavityVoxels * voxelVolume);
+        } else {
+            printf(BLUE "Cavity volume: %llu voxels.\n" WHITE, (unsigned long long)cavityVoxels);
+        }
+        mask = cavityFilter.get();
+    }
     
-    if (generate3DModel) {
-        // Export entire volume as polygon mesh (simple cubes)
-        printf(BLUE "Generating 3D obj, target file: out/%s.obj\n" WHITE, name.c_str());
-        if (!vol->exportObj("out/" + name + ".obj", threshold, 0.01f)) {
+    // A shard only exports its part of the slices, its neighbours being read as needed to get its seams right
+    const size_t shardBegin = vol->getDownscaledDepth() * shardIndex / shardCount;
+    const size_t shardEnd = vol->getDownscaledDepth() * (shardIndex + 1) / shardCount;
+    const std::string shardName = "out/" + name + ".shard" + std::to_string(shardIndex) + "of" + std::to_string(shardCount);
+    if (shardCount > 1) {
+        printf(BLUE "Processing shard %zu of %zu: slices %zu to %zu.\n" WHITE, shardIndex, shardCount, shardBegin, shardEnd);
+    }
+
+    if (!outputs.empty()) {
+        // Any combination of outputs, fed from a single sweep over the volume
+        std::vector<std::unique_ptr<SliceSink>> sinks;
+        for (const std::string& output : outputs) {
+            if (output == "png") {
+                printf(BLUE "Generating cross sections, target directory: out/%s/\n" WHITE, name.c_str());
+                const auto sliceFilename = [name, origin](size_t z) { return "out/" + name + "/" + std::to_string(z + (size_t)origin[2]) + ".png"; };
+                sinks.emplace_back(new PngSink(sliceFilename, skipZ + 1, threshold, threshold, !extractCavity, extractCavity || mask != &thresholdMask));
+            } else if (output == "obj") {
+                printf(BLUE "Generating 3D obj, target file: out/%s.obj\n" WHITE, name.c_str());
+                sinks.emplace_back(new ObjSink("out/" + name + ".obj", mask->getWidth(), mask->getHeight(), 0.01f, decimate, origin));
+            } else if (output == "stats") {
+                printf(BLUE "Computing statistics, target files: out/%s.stats.csv and out/%s.stats.json\n" WHITE, name.c_str(), name.c_str());
+                sinks.emplace_back(new StatsSink(threshold, voxelVolume, "out/" + name + ".stats.csv", "out/" + name + ".stats.json"));
+            } else if (output == "histogram") {
+                printf(BLUE "Computing histogram of %zu bins over [%g, %g), target file: out/%s.histogram.csv\n" WHITE, histogramBins, histogramMin, histogramMax, name.c_str());
+                sinks.emplace_back(new HistogramSink(histogramBins, histogramMin, histogramMax, "out/" + name + ".histogram.csv"));
+            } else if (output == "projections") {
+                printf(BLUE "Generating maximum intensity projections, target files: out/%s.mip_{x,y,z}.png\n" WHITE, name.c_str());
+                sinks.emplace_back(new ProjectionSink("out/" + name + ".mip_"));
+            } else if (output == "vol") {
+                printf(BLUE "Writing filtered %zu x %zu x %zu volume, target file: out/%s.filtered.vol\n" WHITE, values->getWidth(), values->getHeight(), values->getDepth(), name.c_str());
+                sinks.emplace_back(new VolSink("out/" + name + ".filtered.vol"));
+            }
+        }
+        std::vector<SliceSink*> sinkPointers;
+        for (auto& sink : sinks) sinkPointers.push_back(sink.get());
+        if (!pipeline::run(values, mask, sinkPointers)) {
+            return 1;
+        }
+    } else if (generateStats) {
+        // Per-slice and whole-volume value statistics, in a single read pass
+        printf(BLUE "Computing statistics, target files: out/%s.stats.csv and out/%s.stats.json\n" WHITE, name.c_str(), name.c_str());
+        std::vector<ValueStats> sliceStats;
+        if (!stats::compute(*values, threshold, sliceStats, shardBegin, shardEnd)) {
+            return 1;
+        }
+        if (shardCount > 1) {
+            printf(BLUE "Writing partial statistics to %s.statspart, to be merged with -merge out/%s -shards %zu\n" WHITE, shardName.c_str(), name.c_str(), shardCount);
+            if (!stats::writePartial(sliceStats, shardBegin, shardEnd, threshold, voxelVolume, shardName + ".statspart")) {
+                return 1;
+            }
+        } else {
+            stats::print(sliceStats, voxelVolume);
+            if (!stats::writeCsv(sliceStats, "out/" + name + ".stats.csv") || !stats::writeJson(sliceStats, threshold, voxelVolume, "out/" + name + ".stats.json")) {
+                return 1;
+            }
+        }
+    } else if (generateMeasurements) {
+        // Volume, surface area and topology of the mask, without building a mesh
+        printf(BLUE "Measuring mask, target file: out/%s.measure.json\n" WHITE, name.c_str());
+        Measurements measurements;
+        if (!measure::compute(*mask, measurements)) {
+            return 1;
+        }
+        VoxelSpacing spacing;
+        if (voxelSize > 0.0f) {
+            spacing.x = (double)voxelSize * params.downscaleX;
+            spacing.y = (double)voxelSize * params.downscaleY;
+            spacing.z = (double)voxelSize * params.downscaleZ;
+        }
+        if (!measure::report(measurements, spacing, "out/" + name + ".measure.json")) {
+            return 1;
+        }
+    } else if (generate3DModel) {
+        // Export entire volume as polygon mesh (simple cubes), or the faces of the shard's slices, to be joined with the others' and simplified on merging
+        if (shardCount > 1) {
+            printf(BLUE "Generating partial mesh, target file: %s.objpart, to be merged with -merge out/%s -shards %zu\n" WHITE, shardName.c_str(), name.c_str(), shardCount);
+            if (!mesher::exportPartialObj(*mask, shardName + ".objpart", 0.01f, shardBegin, shardEnd, origin)) {
+                return 1;
+            }
+        } else {
+            printf(BLUE "Generating 3D obj, target file: out/%s.obj\n" WHITE, name.c_str());
+            if (!mesher::exportObj(*mask, "out/" + name + ".obj", 0.01f, decimate, origin)) {
+                return 1;
+            }
+        }
+    } else if (generateThickness) {
+        // Export local thickness of the mask as a volume, through a scratch file holding the distance transform
+        printf(BLUE "Computing distance transform, scratch file: out/%s.edt.tmp\n" WHITE, name.c_str());
+        DistanceMap distances(*mask, "out/" + name + ".edt.tmp");
+        if (!distances.compute()) {
+            return 1;
+        }
+        printf(BLUE "Generating local thickness (max distance %.2f), target files: out/%s.thickness.vol and out/%s.thickness.csv\n" WHITE, distances.getMaxDistance(), name.c_str(), name.c_str());
+        LocalThickness localThickness(distances);
+        if (!thickness::exportThickness(localThickness, "out/" + name + ".thickness.vol", "out/" + name + ".thickness.csv")) {
+            return 1;
+        }
+    } else if (generateFilteredVol) {
+        // Export the filtered values as a volume of the same layout as the input, at the downscaled size
+        printf(BLUE "Writing filtered %zu x %zu x %zu volume, target file: out/%s.filtered.vol\n" WHITE, values->getWidth(), values->getHeight(), values->getDepth(), name.c_str());
+        if (!slices::exportVol(*values, "out/" + name + ".filtered.vol")) {
             return 1;
         }
     } else {
         // Export cross-sections from the volume
         printf(BLUE "Generating cross sections, target directory: out/%s/\n" WHITE, name.c_str());
-        for (size_t z = 0, depth = vol->getDownscaledDepth(); z < depth; z += skipZ + 1) {
-            printf("%zu / %zu\n", z+1, depth);
-            if (!vol->exportSlicePng(z, "out/" + name + "/" + std::to_string(z) + ".png", threshold, threshold)) {
-                return 1;
-            }
+        const auto sliceFilename = [&](size_t z) { return "out/" + name + "/" + std::to_string(z + (size_t)origin[2]) + ".png"; };
+        if (!slices::exportPngs(extractCavity ? nullptr : values, extractCavity || mask != &thresholdMask ? mask : nullptr, skipZ + 1, threshold, threshold, sliceFilename, shardBegin, shardEnd)) {
+            return 1;
         }
     }
     
+    if (printThreadStats) {
+        ThreadPool::Global().printStats();
+    }
+    if (memoryBudget.isLimited()) {
+        printf("Peak tracked memory: %.1f MB of the %.1f MB budget.\n", memoryBudget.getPeak() / (1024.0 * 1024.0), memoryBudget.getTotal() / (1024.0 * 1024.0));
+    }
+    if (printMetrics) {
+        metrics::print();
+        if (!metrics::writeJson("out/" + name + ".metrics.json")) {
+            return 1;
+        }
+    }
+    if (writeTrace) {
+        printf(BLUE "Writing trace, target file: out/%s.trace.json\n" WHITE, name.c_str());
+        if (!metrics::writeTrace("out/" + name + ".trace.json")) {
+            return 1;
+        }
+    }
     printf(BLUE "Done.\n" WHITE);
 
 	return 0;
 }
+
+/// Joins the partial meshes and statistics written by the shards of a scan into the files a single run would have written; returns the exit code
+static int runMerge(int argc, char** argv) {
+	std::string prefix;
+	size_t shardCount;
+	DecimateParams decimate;
+	{
+		Arguments args(argc, argv);
+		prefix = args.read<std::string>("merge", "", true);
+		shardCount = args.read<size_t>("shards", 0, true);
+		decimate.targetTriangles = args.read<size_t>("decimate", 0);
+		decimate.maxError = args.read<float>("decimateError", 0.0f);
+		MemoryBudget::SetGlobalTotal((uint64_t)args.read<size_t>("memoryBudget", 0) * 1024 * 1024);
+	}
+
+	// Parts are named <prefix>.shard<i>of<N>, as written by -shard i/N
+	std::vector<std::string> meshParts, statsParts;
+	for (size_t i = 0; i < shardCount; ++i) {
+		const std::string part = prefix + ".shard" + std::to_string(i) + "of" + std::to_string(shardCount);
+		if (fs::fileExists(part + ".objpart")) meshParts.push_back(part + ".objpart");
+		if (fs::fileExists(part + ".statspart")) statsParts.push_back(part + ".statspart");
+	}
+	if (meshParts.empty() && statsParts.empty()) {
+		printf(RED "No partial meshes or statistics named %s.shard<i>of%zu found.\n" WHITE, prefix.c_str(), shardCount);
+		return 1;
+	}
+	if ((!meshParts.empty() && meshParts.size() != shardCount) || (!statsParts.empty() && statsParts.size() != shardCount)) {
+		printf(RED "Found %zu partial meshes and %zu partial statistics, but %zu shards.\n" WHITE, meshParts.size(), statsParts.size(), shardCount);
+		return 1;
+	}
+
+	if (!meshParts.empty()) {
+		printf(BLUE "Merging %zu partial meshes, target file: %s.obj\n" WHITE, shardCount, prefix.c_str());
+		if (!mesher::mergePartialObjs(meshParts, prefix + ".obj", decimate)) {
+			return 1;
+		}
+	}
+	if (!statsParts.empty()) {
+		printf(BLUE "Merging %zu partial statistics, target files: %s.stats.csv and %s.stats.json\n" WHITE, shardCount, prefix.c_str(), prefix.c_str());
+		std::vector<ValueStats> sliceStats;
+		float threshold;
+		double voxelVolume;
+		if (!stats::mergePartials(statsParts, sliceStats, threshold, voxelVolume)) {
+			return 1;
+		}
+		stats::print(sliceStats, voxelVolume);
+		if (!stats::writeCsv(sliceStats, prefix + ".stats.csv") || !stats::writeJson(sliceStats, threshold, voxelVolume, prefix + ".stats.json")) {
+			return 1;
+		}
+	}
+
+	printf(BLUE "Done.\n" WHITE);
+	return 0;
+}
+
+/// Generates a synthetic volume and times the stages of an export over it; returns the exit code
+static int runBench(int argc, char** argv) {
+	SyntheticParams synthetic;
+	bool keepVolume;
+	{
+		Arguments args(argc, argv);
+		args.read<bool>("bench", true);
+		synthetic.width = args.read<size_t>("width", synthetic.width);
+		synthetic.height = args.read<size_t>("height", synthetic.height);
+		synthetic.depth = args.read<size_t>("depth", synthetic.depth);
+		synthetic.parts = args.read<size_t>("benchParts", synthetic.parts);
+		synthetic.noise = args.read<float>("benchNoise", synthetic.noise);
+		keepVolume = args.read<bool>("benchKeep", false);
+		ThreadPool::SetGlobalThreadCount(args.read<size_t>("threads", 0));
+	}
+	if (!fs::createDirectory("out") || !fs::createDirectory("out/bench")) {
+		printf(RED "Cannot create output directory out/bench, aborting operation.\n" WHITE);
+		return 1;
+	}
+
+	const std::string filename = synthetic.parts > 1 ? "out/bench/synthetic.vol-parts" : "out/bench/synthetic.vol";
+	printf(BLUE "Generating synthetic %zu x %zu x %zu volume in %zu part(s), target: %s\n" WHITE, synthetic.width, synthetic.height, synthetic.depth, synthetic.parts, filename.c_str());
+	if (!bench::generateVolume(synthetic, filename)) {
+		return 1;
+	}
+	printf(BLUE "Running benchmarks\n" WHITE);
+	std::vector<BenchResult> results;
+	const bool success = bench::run(synthetic, filename, "out/bench", results);
+	if (!keepVolume) {
+		fs::removeAll(filename);
+	}
+	if (!success) {
+		return 1;
+	}
+	bench::print(results);
+	if (!bench::writeJson(results, synthetic, ThreadPool::Global().getThreadCount(), "out/bench/bench.json")) {
+		return 1;
+	}
+	printf(BLUE "Results written to out/bench/bench.json.\n" WHITE);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	printf("\n");
+	metrics::setThreadName("main");
+
+	// A job manifest runs many scans in one process, sharing the thread pool, merging joins the outputs of shards and benchmarks run on a synthetic volume;
+	// any other arguments describe a single scan
+	bool batchMode = false, mergeMode = false, benchMode = false;
+	for (int i = 1; i < argc; ++i) {
+		benchMode = benchMode || std::string(argv[i]) == "-bench" || std::string(argv[i]) == "--bench";
+		batchMode = batchMode || std::string(argv[i]) == "-batch" || std::string(argv[i]) == "--batch";
+		mergeMode = mergeMode || std::string(argv[i]) == "-merge" || std::string(argv[i]) == "--merge";
+	}
+	if (mergeMode) {
+		return runMerge(argc, argv);
+	}
+	if (benchMode) {
+		return runBench(argc, argv);
+	}
+	if (!batchMode) {
+		uint64_t regionBytes = 0;
+		return runJob(argc, argv, false, regionBytes);
+	}
+
+	std::string manifest;
+	size_t concurrentJobs;
+	bool printThreadStats;
+	{
+		Arguments args(argc, argv);
+		manifest = args.read<std::string>("batch", "", true);
+		concurrentJobs = args.read<size_t>("batchJobs", 2);
+		ThreadPool::SetGlobalThreadCount(args.read<size_t>("threads", 0));
+		MemoryBudget::SetGlobalTotal((uint64_t)args.read<size_t>("memoryBudget", 0) * 1024 * 1024);
+		printThreadStats = args.read<bool>("threadStats", false);
+	}
+	std::vector<BatchJob> jobs;
+	if (!batch::readManifest(manifest, jobs)) {
+		return 1;
+	}
+	if (MemoryBudget::Global().isLimited()) {
+		printf(BLUE "Running %zu jobs from %s, up to %zu at once within %.1f MB.\n\n" WHITE, jobs.size(), manifest.c_str(), concurrentJobs, MemoryBudget::Global().getTotal() / (1024.0 * 1024.0));
+	} else {
+		printf(BLUE "Running %zu jobs from %s, up to %zu at once.\n\n" WHITE, jobs.size(), manifest.c_str(), concurrentJobs);
+	}
+
+	const auto runBatchJob = [](BatchJob& job, bool validateOnly) {
+		std::vector<char*> jobArgv = { (char*)"seals-vol" };
+		for (std::string& arg : job.args) jobArgv.push_back(&arg[0]);
+		return runJob((int)jobArgv.size(), jobArgv.data(), true, job.regionBytes, validateOnly);
+	};
+
+	// Check the arguments of every job before any starts, so that a bad line only fails its own job
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		if (runBatchJob(jobs[i], true) != 0) {
+			jobs[i].status = 1;
+			printf(RED "Job %zu of %zu (manifest line %zu) has invalid arguments, skipping it.\n\n" WHITE, i + 1, jobs.size(), jobs[i].line);
+		}
+	}
+	const auto start = std::chrono::steady_clock::now();
+	const bool success = batch::run(jobs, concurrentJobs, [&](BatchJob& job) {
+		return runBatchJob(job, false);
+	});
+	batch::printSummary(jobs, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	if (printThreadStats) {
+		ThreadPool::Global().printStats();
+	}
+	return success ? 0 : 1;
+}